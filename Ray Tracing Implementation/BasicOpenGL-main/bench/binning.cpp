@@ -0,0 +1,121 @@
+// Secondary ray binning benchmark.
+// Renders each scene with the wavefront tracer, once with reflected/refracted
+// rays traced in the order they were spawned and once binned by direction
+// octant and origin cell, and reports the time per frame of both.
+//
+// Usage: bench_binning [scene file ...] [--samples N] [--spheres N] [--runs N] [--threads N]
+// Without scene files it uses ../scene2.txt; --spheres 0 skips the generated scene.
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Renderer.h"
+#include "SceneReader.h"
+
+// Spheres scattered in front of a mirror wall, half of them reflective or transparent
+static Scene *makeManySpheres(int count)
+{
+    Scene *scene = new Scene(Eye(glm::vec3(0.0f, 0.0f, 4.0f)), Ambient(glm::vec3(0.1f, 0.2f, 0.3f)));
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> position(-3.0f, 3.0f), depth(-8.0f, -1.0f), radius(0.05f, 0.25f), unit(0.0f, 1.0f);
+
+    scene->addObject(new Plane(Material(glm::vec3(0.6f, 0.6f, 0.6f), 10.0f), 1, glm::vec4(0.0f, 0.0f, 1.0f, 9.0f)));
+    for (int i = 0; i < count; i++)
+    {
+        int status = i % 4 == 0 ? 1 : (i % 4 == 1 ? 2 : 0);
+        Material material(glm::vec3(unit(rng), unit(rng), unit(rng)), 10.0f);
+        scene->addObject(new Sphere(material, status, glm::vec3(position(rng), position(rng), depth(rng)), radius(rng)));
+    }
+    for (size_t i = 0; i < scene->objects.size(); i++)
+        scene->objects[i]->ObjectId = static_cast<int>(i);
+
+    scene->addLight(new DirectionalLight(glm::vec3(0.7f, 0.6f, 0.5f), glm::vec3(0.5f, -0.3f, -1.0f)));
+    scene->addLight(new DirectionalLight(glm::vec3(0.3f, 0.4f, 0.5f), glm::vec3(-0.4f, 0.2f, -1.0f)));
+    scene->buildAccelerationStructure();
+    return scene;
+}
+
+struct Result
+{
+    double seconds = 1e30;
+    RenderStats stats;
+};
+
+static void renderOnce(Scene &scene, const RenderSettings &settings, ThreadPool &pool, Framebuffer &framebuffer, Result &best)
+{
+    Renderer renderer(scene, settings, &pool);
+    auto start = std::chrono::steady_clock::now();
+    renderer.Render(framebuffer);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (seconds < best.seconds)
+    {
+        best.seconds = seconds;
+        best.stats = renderer.getStats();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> sceneFiles;
+    int samples = 4, spheres = 2000, runs = 3, threads = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--samples" && i + 1 < argc)
+            samples = std::stoi(argv[++i]);
+        else if (arg == "--spheres" && i + 1 < argc)
+            spheres = std::stoi(argv[++i]);
+        else if (arg == "--runs" && i + 1 < argc)
+            runs = std::stoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::stoi(argv[++i]);
+        else
+            sceneFiles.push_back(arg);
+    }
+
+    std::vector<std::pair<std::string, std::unique_ptr<Scene>>> scenes;
+    SceneReader reader;
+    if (sceneFiles.empty())
+        sceneFiles.push_back("../scene2.txt");
+    for (const std::string &file : sceneFiles)
+        scenes.emplace_back(file, std::unique_ptr<Scene>(reader.readScene(file)));
+    if (spheres > 0)
+        scenes.emplace_back(std::to_string(spheres) + " spheres", std::unique_ptr<Scene>(makeManySpheres(spheres)));
+
+    ThreadPool pool(threads);
+    std::cout << "threads " << pool.size() << ", " << samples << " samples per pixel, best of " << runs << " runs" << std::endl;
+
+    for (auto &entry : scenes)
+    {
+        RenderSettings settings;
+        settings.samplesPerPixel = samples;
+        settings.wavefrontMinPixels = 0;
+        settings.packetSize = 8;
+
+        // Alternate the two variants so drift in the machine load hits both alike
+        Framebuffer unbinnedImage, binnedImage;
+        Result unbinned, binned;
+        for (int run = 0; run < runs; run++)
+        {
+            settings.binSecondaryRays = false;
+            renderOnce(*entry.second, settings, pool, unbinnedImage, unbinned);
+            settings.binSecondaryRays = true;
+            renderOnce(*entry.second, settings, pool, binnedImage, binned);
+        }
+
+        bool identical = std::memcmp(unbinnedImage.pixels(), binnedImage.pixels(), static_cast<size_t>(settings.height) * unbinnedImage.getRowStride()) == 0;
+        double rays = static_cast<double>(binned.stats.cameraRays + binned.stats.secondaryRays + binned.stats.shadowRays);
+
+        std::cout << entry.first << ": " << binned.stats.secondaryRays << " secondary rays" << std::endl;
+        std::cout << "  unbinned " << unbinned.seconds * 1000.0 << " ms (" << rays / unbinned.seconds * 1e-6 << " Mrays/s)" << std::endl;
+        std::cout << "  binned   " << binned.seconds * 1000.0 << " ms (" << rays / binned.seconds * 1e-6 << " Mrays/s)" << std::endl;
+        std::cout << "  speedup  " << unbinned.seconds / binned.seconds << "x, images " << (identical ? "identical" : "DIFFER") << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,325 @@
+// Kernel and frame benchmark suite.
+// Times the intersection and shading kernels one call at a time on fixed,
+// seeded ray sets (Sphere::Intersect, Plane::Intersect, Scene::GetHit,
+// Phong::occluded, Phong::calcColor), then renders whole frames of the shipped
+// scenes, and reports ns per ray and Mrays/s. Every figure is the best of
+// --runs runs. With --json the results are also written as JSON for
+// comparing releases (see the end of this file for the layout).
+//
+// Usage: bench_kernels [frame scene file ...] [--scene FILE] [--rays N] [--runs N]
+//                      [--samples N] [--threads N] [--json FILE|-] [--no-kernels] [--no-frames]
+// Run from BasicOpenGL-main: the kernels use ../scene2.txt and the frames
+// ../scene1.txt to ../scene6.txt unless told otherwise.
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Renderer.h"
+#include "SceneReader.h"
+#include "phong.h"
+
+struct BenchResult
+{
+    std::string group; // "kernel" or "frame"
+    std::string name;
+    uint64_t calls = 0;   // kernel calls (kernel) or camera rays (frame) per run
+    uint64_t rays = 0;    // rays traced per run, shadow and secondary rays included
+    double seconds = 0.0; // best run
+    double hitRate = -1.0;
+
+    double nsPerRay() const { return rays > 0 ? seconds * 1e9 / rays : 0.0; }
+    double mraysPerSecond() const { return seconds > 0.0 ? rays / seconds * 1e-6 : 0.0; }
+};
+
+// Keeps the results of the timed calls alive so the compiler cannot drop them
+static volatile float sink;
+
+static uint64_t totalRays(const RenderStats &stats)
+{
+    return stats.cameraRays + stats.secondaryRays + stats.shadowRays;
+}
+
+// Best time of runs calls of body
+template <typename Fn>
+static double bestOf(int runs, Fn &&body)
+{
+    double best = 1e30;
+    for (int run = 0; run < runs; run++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+// Rays from around (0, 0, 4) towards random points of the square |x|, |y| <= 2 at z = -2
+static std::vector<Ray> makeRays(int count, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> jitter(-0.1f, 0.1f), target(-2.0f, 2.0f);
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        glm::vec3 origin(jitter(rng), jitter(rng), 4.0f + jitter(rng));
+        glm::vec3 to(target(rng), target(rng), -2.0f);
+        rays.emplace_back(origin, glm::normalize(to - origin));
+    }
+    return rays;
+}
+
+// Camera rays of scene through random points of the image
+static std::vector<Ray> makeCameraRays(Scene &scene, int count, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> x(0.0f, static_cast<float>(WIDTH)), y(0.0f, static_cast<float>(HEIGHT));
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++)
+        rays.push_back(SceneReader::ConstructRayThroughPoint(x(rng), y(rng), scene));
+    return rays;
+}
+
+static BenchResult benchPrimitive(const std::string &name, Object &object, std::vector<Ray> &rays, int runs)
+{
+    BenchResult result;
+    result.group = "kernel";
+    result.name = name;
+    result.calls = result.rays = rays.size();
+
+    uint64_t hits = 0;
+    result.seconds = bestOf(runs, [&]()
+                            {
+        float sum = 0.0f;
+        hits = 0;
+        for (Ray &ray : rays)
+        {
+            float t = 0.0f;
+            if (object.Intersect(ray, t))
+            {
+                sum += t;
+                hits++;
+            }
+        }
+        sink = sum; });
+    result.hitRate = static_cast<double>(hits) / rays.size();
+    return result;
+}
+
+static void benchKernels(const std::string &sceneFile, int numRays, int runs, std::vector<BenchResult> &results)
+{
+    std::mt19937 rng(1);
+
+    std::vector<Ray> rays = makeRays(numRays, rng);
+    Sphere sphere(Material(glm::vec3(0.5f)), 0, glm::vec3(0.0f, 0.0f, -1.0f), 1.0f);
+    Plane plane(Material(glm::vec3(0.5f)), 0, glm::vec4(0.0f, 1.0f, 0.0f, 1.0f));
+    results.push_back(benchPrimitive("Sphere::Intersect", sphere, rays, runs));
+    results.push_back(benchPrimitive("Plane::Intersect", plane, rays, runs));
+
+    std::unique_ptr<Scene> scene(SceneReader().readScene(sceneFile));
+    scene->updateAccelerationStructure();
+    std::vector<Ray> cameraRays = makeCameraRays(*scene, numRays, rng);
+
+    BenchResult getHit;
+    getHit.group = "kernel";
+    getHit.name = "Scene::GetHit";
+    getHit.calls = getHit.rays = cameraRays.size();
+    getHit.seconds = bestOf(runs, [&]()
+                            {
+        float sum = 0.0f;
+        for (Ray &ray : cameraRays)
+        {
+            Intersection hit = scene->GetHit(ray);
+            if (hit.hitObject)
+                sum += hit.t;
+        }
+        sink = sum; });
+
+    // The hits are the starting points of the shadow rays below
+    std::vector<Intersection> hits;
+    for (Ray &ray : cameraRays)
+    {
+        Intersection hit = scene->GetHit(ray);
+        if (hit.hitObject)
+            hits.push_back(hit);
+    }
+    getHit.hitRate = static_cast<double>(hits.size()) / cameraRays.size();
+    results.push_back(getHit);
+
+    // Phong::occluded: one shadow ray per hit and light
+    BenchResult occluded;
+    occluded.group = "kernel";
+    occluded.name = "Phong::occluded";
+    occluded.calls = occluded.rays = hits.size() * scene->lights.size();
+    uint64_t blocked = 0;
+    occluded.seconds = bestOf(runs, [&]()
+                              {
+        blocked = 0;
+        for (Intersection &hit : hits)
+        {
+            for (LightSource *light : scene->lights)
+                blocked += Phong::occluded(*scene, hit, light);
+        }
+        sink = static_cast<float>(blocked); });
+    occluded.hitRate = occluded.calls > 0 ? static_cast<double>(blocked) / occluded.calls : 0.0;
+    results.push_back(occluded);
+
+    // Phong::calcColor: whole paths, so a call traces several rays
+    BenchResult calcColor;
+    calcColor.group = "kernel";
+    calcColor.name = "Phong::calcColor";
+    calcColor.calls = cameraRays.size();
+    RenderStats before = threadRenderStats();
+    calcColor.seconds = bestOf(runs, [&]()
+                               {
+        glm::vec3 sum(0.0f);
+        for (Ray &ray : cameraRays)
+            sum += Phong::calcColor(*scene, ray, 0);
+        sink = sum.x + sum.y + sum.z; });
+    // Shadow and secondary rays counted during the runs, plus the camera rays
+    RenderStats traced = threadRenderStats() - before;
+    calcColor.rays = (traced.secondaryRays + traced.shadowRays) / runs + cameraRays.size();
+    results.push_back(calcColor);
+}
+
+static BenchResult benchFrame(const std::string &sceneFile, int samples, int runs, ThreadPool &pool)
+{
+    std::unique_ptr<Scene> scene(SceneReader().readScene(sceneFile));
+    RenderSettings settings;
+    settings.samplesPerPixel = samples;
+
+    BenchResult result;
+    result.group = "frame";
+    result.name = sceneFile;
+    Framebuffer framebuffer;
+    Renderer renderer(*scene, settings, &pool);
+    result.seconds = bestOf(runs, [&]()
+                            { renderer.Render(framebuffer); });
+    result.calls = renderer.getStats().cameraRays;
+    result.rays = totalRays(renderer.getStats());
+    return result;
+}
+
+static void printResult(const BenchResult &result)
+{
+    std::cout << std::left << std::setw(24) << result.name << std::right << std::fixed
+              << std::setw(12) << result.rays << " rays"
+              << std::setprecision(2) << std::setw(10) << result.nsPerRay() << " ns/ray"
+              << std::setw(10) << result.mraysPerSecond() << " Mrays/s";
+    if (result.hitRate >= 0.0)
+        std::cout << std::setprecision(1) << "   " << result.hitRate * 100.0 << "% hit";
+    std::cout << std::endl;
+}
+
+static std::string jsonString(const std::string &text)
+{
+    std::string quoted = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// {"threads": N, "samples": N, "runs": N, "kernel_rays": N,
+//  "results": [{"group": "kernel"|"frame", "name": ..., "calls": N, "rays": N,
+//               "seconds": S, "ns_per_ray": X, "mrays_per_second": X[, "hit_rate": X]}, ...]}
+static void writeJson(std::ostream &out, const std::vector<BenchResult> &results, int threads, int samples, int runs, int numRays)
+{
+    out << "{\n  \"threads\": " << threads << ",\n  \"samples\": " << samples << ",\n  \"runs\": " << runs
+        << ",\n  \"kernel_rays\": " << numRays << ",\n  \"results\": [\n";
+    out << std::setprecision(9);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        out << "    {\"group\": " << jsonString(r.group) << ", \"name\": " << jsonString(r.name)
+            << ", \"calls\": " << r.calls << ", \"rays\": " << r.rays << ", \"seconds\": " << r.seconds
+            << ", \"ns_per_ray\": " << r.nsPerRay() << ", \"mrays_per_second\": " << r.mraysPerSecond();
+        if (r.hitRate >= 0.0)
+            out << ", \"hit_rate\": " << r.hitRate;
+        out << (i + 1 < results.size() ? "},\n" : "}\n");
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> frameScenes;
+    std::string kernelScene = "../scene2.txt";
+    std::string jsonFile;
+    int numRays = 1 << 18, runs = 3, samples = 1, threads = 0;
+    bool kernels = true, frames = true;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--scene" && i + 1 < argc)
+            kernelScene = argv[++i];
+        else if (arg == "--rays" && i + 1 < argc)
+            numRays = std::stoi(argv[++i]);
+        else if (arg == "--runs" && i + 1 < argc)
+            runs = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--samples" && i + 1 < argc)
+            samples = std::stoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::stoi(argv[++i]);
+        else if (arg == "--json" && i + 1 < argc)
+            jsonFile = argv[++i];
+        else if (arg == "--no-kernels")
+            kernels = false;
+        else if (arg == "--no-frames")
+            frames = false;
+        else
+            frameScenes.push_back(arg);
+    }
+    if (frameScenes.empty())
+    {
+        for (int i = 1; i <= 6; i++)
+            frameScenes.push_back("../scene" + std::to_string(i) + ".txt");
+    }
+
+    // With --json - the table goes to stderr, so stdout holds the JSON only
+    std::ostream &log = jsonFile == "-" ? std::cerr : std::cout;
+    std::streambuf *coutBuffer = std::cout.rdbuf(log.rdbuf());
+
+    ThreadPool pool(threads);
+    std::vector<BenchResult> results;
+    if (kernels)
+    {
+        std::cout << "kernels: " << numRays << " rays, " << kernelScene << ", best of " << runs << " runs, 1 thread" << std::endl;
+        benchKernels(kernelScene, numRays, runs, results);
+        for (const BenchResult &result : results)
+            printResult(result);
+    }
+    if (frames)
+    {
+        std::cout << "frames: " << samples << " samples per pixel, best of " << runs << " runs, " << pool.size() << " threads" << std::endl;
+        for (const std::string &file : frameScenes)
+        {
+            results.push_back(benchFrame(file, samples, runs, pool));
+            printResult(results.back());
+        }
+    }
+    std::cout.rdbuf(coutBuffer);
+
+    if (jsonFile == "-")
+        writeJson(std::cout, results, pool.size(), samples, runs, numRays);
+    else if (!jsonFile.empty())
+    {
+        std::ofstream out(jsonFile);
+        writeJson(out, results, pool.size(), samples, runs, numRays);
+        if (!out)
+        {
+            std::cerr << "Failed to write " << jsonFile << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include "Animation.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+static float lerp(float a, float b, float w) { return a + w * (b - a); }
+static glm::vec3 lerp(const glm::vec3 &a, const glm::vec3 &b, float w) { return glm::mix(a, b, w); }
+static glm::vec4 lerp(const glm::vec4 &a, const glm::vec4 &b, float w) { return glm::mix(a, b, w); }
+
+static ObjectPose lerp(const ObjectPose &a, const ObjectPose &b, float w)
+{
+    ObjectPose pose;
+    pose.position = lerp(a.position, b.position, w);
+    pose.scale = lerp(a.scale, b.scale, w);
+    pose.rotation = lerp(a.rotation, b.rotation, w);
+    return pose;
+}
+
+template <typename T>
+void Track<T>::set(int frame, const T &value)
+{
+    auto key = std::lower_bound(keys.begin(), keys.end(), frame, [](const std::pair<int, T> &k, int f)
+                                { return k.first < f; });
+    if (key != keys.end() && key->first == frame)
+        key->second = value;
+    else
+        keys.insert(key, {frame, value});
+}
+
+template <typename T>
+T Track<T>::at(int frame) const
+{
+    if (frame <= keys.front().first)
+        return keys.front().second;
+    if (frame >= keys.back().first)
+        return keys.back().second;
+
+    auto next = std::upper_bound(keys.begin(), keys.end(), frame, [](int f, const std::pair<int, T> &k)
+                                 { return f < k.first; });
+    auto previous = next - 1;
+    // Exactly the key value on a key frame
+    if (previous->first == frame)
+        return previous->second;
+    float w = static_cast<float>(frame - previous->first) / (next->first - previous->first);
+    return lerp(previous->second, next->second, w);
+}
+
+Animation Animation::load(const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+        throw std::runtime_error("Failed to open animation file " + filename);
+
+    Animation animation;
+    int frame = 0;
+    int lastKey = 0;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string type;
+        if (!(fields >> type))
+            continue;
+
+        if (type == "f")
+            fields >> animation.frameCount;
+        else if (type == "k")
+        {
+            fields >> frame;
+            lastKey = std::max(lastKey, frame);
+        }
+        else if (type == "e")
+        {
+            glm::vec3 position(0.0f);
+            fields >> position.x >> position.y >> position.z;
+            animation.eyePosition.set(frame, position);
+        }
+        else if (type == "d" || type == "i")
+        {
+            int light = 0;
+            glm::vec3 value(0.0f);
+            fields >> light >> value.x >> value.y >> value.z;
+            (type == "d" ? animation.lightDirection : animation.lightIntensity)[light].set(frame, value);
+        }
+        else if (type == "p")
+        {
+            int light = 0;
+            glm::vec4 value(0.0f);
+            fields >> light >> value.x >> value.y >> value.z >> value.w;
+            animation.spotlightPosition[light].set(frame, value);
+        }
+        else if (type == "o")
+        {
+            int object = 0;
+            ObjectPose pose;
+            fields >> object >> pose.position.x >> pose.position.y >> pose.position.z;
+            if (!(fields >> pose.scale))
+                pose.scale = 1.0f;
+            else if (!(fields >> pose.rotation.x >> pose.rotation.y >> pose.rotation.z))
+                pose.rotation = glm::vec3(0.0f);
+            animation.objectPose[object].set(frame, pose);
+        }
+    }
+
+    if (animation.frameCount <= 0)
+        animation.frameCount = lastKey + 1;
+    return animation;
+}
+
+void Animation::apply(Scene &scene, int frame)
+{
+    if (!eyePosition.keys.empty())
+        scene.eye.position = eyePosition.at(frame);
+
+    for (const auto &track : lightDirection)
+        scene.lights.at(track.first)->direction = track.second.at(frame);
+    for (const auto &track : lightIntensity)
+        scene.lights.at(track.first)->intensity = track.second.at(frame);
+    for (const auto &track : spotlightPosition)
+    {
+        Spotlight *spotlight = dynamic_cast<Spotlight *>(scene.lights.at(track.first));
+        if (spotlight == nullptr)
+            throw std::out_of_range("Light " + std::to_string(track.first) + " is not a spotlight");
+        glm::vec4 value = track.second.at(frame);
+        spotlight->position = glm::vec3(value);
+        spotlight->cutoff = value.w;
+    }
+
+    // Lights and the eye are read directly by the shading, only objects touch the acceleration structure
+    for (const auto &track : objectPose)
+    {
+        ObjectPose pose = track.second.at(frame);
+        auto applied = appliedPose.find(track.first);
+        if (applied != appliedPose.end() && applied->second == pose)
+            continue;
+        scene.setObjectTransform(track.first, Instance::placement(pose.position, pose.scale, pose.rotation));
+        appliedPose[track.first] = pose;
+    }
+}
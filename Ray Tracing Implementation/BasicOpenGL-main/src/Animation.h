@@ -0,0 +1,76 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Scene.h"
+
+// Placement of an animated object: moved to position, scaled uniformly and
+// rotated by rotation (degrees about x, then y, then z), see Instance::placement
+struct ObjectPose
+{
+    glm::vec3 position = glm::vec3(0.0f);
+    float scale = 1.0f;
+    glm::vec3 rotation = glm::vec3(0.0f);
+
+    bool operator==(const ObjectPose &other) const
+    {
+        return position == other.position && scale == other.scale && rotation == other.rotation;
+    }
+    bool operator!=(const ObjectPose &other) const { return !(*this == other); }
+};
+
+// Values of one parameter at key frames, linearly interpolated in between and
+// held before the first and after the last key
+template <typename T>
+struct Track
+{
+    std::vector<std::pair<int, T>> keys; // sorted by frame
+
+    void set(int frame, const T &value);
+    T at(int frame) const;
+};
+
+// Keyframes for a scene, read from a text file in the style of the scene files:
+//
+//   f count                     frames to render (default: up to the last key)
+//   k frame                     the lines below are keys at this frame (from 0)
+//   e x y z                     eye position
+//   d light x y z               light direction
+//   i light r g b               light intensity
+//   p light x y z cutoff        spotlight position and cutoff
+//   o object x y z scale [rx ry rz]
+//                               object placement, see Scene::setObjectTransform
+//
+// Lights count from 0 in the order of the d lines of the scene, objects from 0
+// in the order of the object lines. Parameters without keys keep their scene value.
+class Animation
+{
+public:
+    // Throws std::runtime_error if the file cannot be read
+    static Animation load(const std::string &filename);
+
+    int numFrames() const { return frameCount; }
+
+    // Sets the eye, lights and object placements of frame. Objects are only
+    // moved if their placement differs from the frame applied before, so the
+    // next render refits just the moved instances. Throws std::out_of_range for
+    // a light or object index the scene does not have.
+    void apply(Scene &scene, int frame);
+
+private:
+    int frameCount = 0;
+
+    Track<glm::vec3> eyePosition;
+    std::map<int, Track<glm::vec3>> lightDirection;
+    std::map<int, Track<glm::vec3>> lightIntensity;
+    std::map<int, Track<glm::vec4>> spotlightPosition; // x, y, z, cutoff
+    std::map<int, Track<ObjectPose>> objectPose;
+
+    std::map<int, ObjectPose> appliedPose; // object placements already in the scene
+};
+
+#endif // ANIMATION_H
@@ -0,0 +1,237 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <cmath>
+
+// AABB class
+void AABB::expand(const glm::vec3 &point)
+{
+    min = glm::min(min, point);
+    max = glm::max(max, point);
+}
+
+void AABB::expand(const AABB &box)
+{
+    min = glm::min(min, box.min);
+    max = glm::max(max, box.max);
+}
+
+float AABB::surfaceArea() const
+{
+    if (isEmpty())
+        return 0.0f;
+    glm::vec3 extent = max - min;
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+bool AABB::intersect(const glm::vec3 &origin, const glm::vec3 &invDirection, float tMax, float &tEntry) const
+{
+    glm::vec3 t1 = (min - origin) * invDirection;
+    glm::vec3 t2 = (max - origin) * invDirection;
+    glm::vec3 tSmall = glm::min(t1, t2);
+    glm::vec3 tLarge = glm::max(t1, t2);
+
+    float tNear = glm::max(glm::max(tSmall.x, tSmall.y), tSmall.z);
+    float tFar = glm::min(glm::min(tLarge.x, tLarge.y), tLarge.z);
+
+    tEntry = glm::max(tNear, 0.0f);
+    return tNear <= tFar && tFar >= 0.0f && tEntry <= tMax;
+}
+
+AABB transformBounds(const AABB &box, const glm::mat4x3 &transform)
+{
+    AABB bounds;
+    if (box.isEmpty())
+        return bounds;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        glm::vec3 point((corner & 1) ? box.max.x : box.min.x, (corner & 2) ? box.max.y : box.min.y, (corner & 4) ? box.max.z : box.min.z);
+        bounds.expand(transform * glm::vec4(point, 1.0f));
+    }
+    float padding = 1e-5f * (glm::length(bounds.max - bounds.min) + glm::length(bounds.centroid()));
+    bounds.min -= glm::vec3(padding);
+    bounds.max += glm::vec3(padding);
+    return bounds;
+}
+
+// BVH class
+void BVH::clear()
+{
+    nodes.clear();
+    primIndices.clear();
+}
+
+void BVH::refit(const std::vector<AABB> &primBounds)
+{
+    // Children come after their parent, so going backwards finishes them first
+    for (size_t i = nodes.size(); i-- > 0;)
+    {
+        BVHNode &node = nodes[i];
+        node.bounds = AABB();
+        if (node.isLeaf())
+        {
+            for (int j = node.first; j < node.first + node.count; j++)
+                node.bounds.expand(primBounds[primIndices[j]]);
+        }
+        else
+        {
+            node.bounds.expand(nodes[node.first].bounds);
+            node.bounds.expand(nodes[node.first + 1].bounds);
+        }
+    }
+}
+
+float BVH::cost() const
+{
+    if (nodes.empty())
+        return 0.0f;
+    float rootArea = nodes[0].bounds.surfaceArea();
+    if (rootArea <= 0.0f)
+        return 0.0f;
+
+    float total = 0.0f;
+    for (const BVHNode &node : nodes)
+        total += node.bounds.surfaceArea() * (node.isLeaf() ? groups(node.count) : 1);
+    return total / rootArea;
+}
+
+void BVH::build(const std::vector<AABB> &primBounds, int maxLeafSize, int groupSize)
+{
+    clear();
+    this->maxLeafSize = std::max(1, maxLeafSize);
+    this->groupSize = std::max(1, groupSize);
+    int numPrims = static_cast<int>(primBounds.size());
+    if (numPrims == 0)
+        return;
+
+    std::vector<glm::vec3> centroids(numPrims);
+    primIndices.resize(numPrims);
+    for (int i = 0; i < numPrims; i++)
+    {
+        centroids[i] = primBounds[i].centroid();
+        primIndices[i] = i;
+    }
+
+    // A binary tree with n leaves at most has 2n - 1 nodes
+    nodes.reserve(2 * numPrims - 1);
+
+    BVHNode root;
+    root.first = 0;
+    root.count = numPrims;
+    for (const AABB &box : primBounds)
+        root.bounds.expand(box);
+    nodes.push_back(root);
+
+    subdivide(0, 0, primBounds, centroids);
+}
+
+void BVH::subdivide(int nodeIndex, int depth, const std::vector<AABB> &primBounds, const std::vector<glm::vec3> &centroids)
+{
+    int first = nodes[nodeIndex].first;
+    int count = nodes[nodeIndex].count;
+
+    if (count <= std::max(1, maxLeafSize / 2) || depth >= MAX_DEPTH - 1)
+        return;
+
+    AABB centroidBounds;
+    for (int i = first; i < first + count; i++)
+        centroidBounds.expand(centroids[primIndices[i]]);
+    glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+
+    // Find the cheapest split plane among the bin boundaries of all three axes
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1;
+    int bestSplit = 0;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (extent[axis] <= 0.0f)
+            continue;
+
+        AABB binBounds[NUM_BINS];
+        int binCount[NUM_BINS] = {0};
+        float scale = NUM_BINS / extent[axis];
+
+        for (int i = first; i < first + count; i++)
+        {
+            int prim = primIndices[i];
+            int bin = std::min(NUM_BINS - 1, static_cast<int>((centroids[prim][axis] - centroidBounds.min[axis]) * scale));
+            binCount[bin]++;
+            binBounds[bin].expand(primBounds[prim]);
+        }
+
+        // Sweep from both sides to get the cost of every split between bins
+        float leftArea[NUM_BINS - 1], rightArea[NUM_BINS - 1];
+        int leftCount[NUM_BINS - 1], rightCount[NUM_BINS - 1];
+        AABB leftBox, rightBox;
+        int leftSum = 0, rightSum = 0;
+        for (int i = 0; i < NUM_BINS - 1; i++)
+        {
+            leftSum += binCount[i];
+            leftCount[i] = leftSum;
+            leftBox.expand(binBounds[i]);
+            leftArea[i] = leftBox.surfaceArea();
+
+            rightSum += binCount[NUM_BINS - 1 - i];
+            rightCount[NUM_BINS - 2 - i] = rightSum;
+            rightBox.expand(binBounds[NUM_BINS - 1 - i]);
+            rightArea[NUM_BINS - 2 - i] = rightBox.surfaceArea();
+        }
+
+        for (int i = 0; i < NUM_BINS - 1; i++)
+        {
+            if (leftCount[i] == 0 || rightCount[i] == 0)
+                continue;
+            float cost = groups(leftCount[i]) * leftArea[i] + groups(rightCount[i]) * rightArea[i];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+
+    // Costs are relative to the node area; traversing a node costs as much as one primitive test
+    float nodeArea = nodes[nodeIndex].bounds.surfaceArea();
+    float leafCost = groups(count) * nodeArea;
+    float splitCost = nodeArea + bestCost;
+    if (splitCost >= leafCost && count <= maxLeafSize)
+        return;
+
+    int middle;
+    if (bestAxis >= 0)
+    {
+        float scale = NUM_BINS / extent[bestAxis];
+        float minCentroid = centroidBounds.min[bestAxis];
+        int *splitPoint = std::partition(primIndices.data() + first, primIndices.data() + first + count, [&](int prim)
+                                         {
+            int bin = std::min(NUM_BINS - 1, static_cast<int>((centroids[prim][bestAxis] - minCentroid) * scale));
+            return bin <= bestSplit; });
+        middle = static_cast<int>(splitPoint - primIndices.data());
+    }
+    else
+    {
+        // All centroids coincide, just halve the list
+        middle = first + count / 2;
+    }
+
+    int leftIndex = static_cast<int>(nodes.size());
+    BVHNode left, right;
+    left.first = first;
+    left.count = middle - first;
+    right.first = middle;
+    right.count = first + count - middle;
+    for (int i = left.first; i < left.first + left.count; i++)
+        left.bounds.expand(primBounds[primIndices[i]]);
+    for (int i = right.first; i < right.first + right.count; i++)
+        right.bounds.expand(primBounds[primIndices[i]]);
+    nodes.push_back(left);
+    nodes.push_back(right);
+
+    nodes[nodeIndex].first = leftIndex;
+    nodes[nodeIndex].count = 0;
+
+    subdivide(leftIndex, depth + 1, primBounds, centroids);
+    subdivide(leftIndex + 1, depth + 1, primBounds, centroids);
+}
@@ -0,0 +1,158 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <glm/glm.hpp>
+#include <limits>
+#include <vector>
+#include "FlatArray.h"
+
+// Axis aligned bounding box
+struct AABB
+{
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::infinity());
+    glm::vec3 max = glm::vec3(-std::numeric_limits<float>::infinity());
+
+    AABB() = default;
+    AABB(const glm::vec3 &min, const glm::vec3 &max) : min(min), max(max) {}
+
+    void expand(const glm::vec3 &point);
+    void expand(const AABB &box);
+    bool isEmpty() const { return min.x > max.x; }
+    glm::vec3 centroid() const { return 0.5f * (min + max); }
+    float surfaceArea() const;
+
+    // Slab test; tEntry is the distance where the ray enters the box (0 if it starts inside)
+    bool intersect(const glm::vec3 &origin, const glm::vec3 &invDirection, float tMax, float &tEntry) const;
+};
+
+// Box around box after an affine transform (the 8 corners moved), padded a
+// little so rounding in the transform never loses a hit on the box
+AABB transformBounds(const AABB &box, const glm::mat4x3 &transform);
+
+// 1 / direction for the slab test. Zero components become huge instead of
+// infinite, so a ray starting exactly on a slab gives 0 * huge, not a NaN.
+inline glm::vec3 safeInverse(const glm::vec3 &direction)
+{
+    glm::vec3 inverse;
+    for (int axis = 0; axis < 3; axis++)
+        inverse[axis] = 1.0f / (direction[axis] != 0.0f ? direction[axis] : 1e-30f);
+    return inverse;
+}
+
+// Node of a flattened BVH.
+// Leaf: count > 0, its primitives are primIndices[first .. first + count).
+// Inner node: count == 0, children are nodes[first] and nodes[first + 1].
+// Children are always stored after their parent.
+struct BVHNode
+{
+    AABB bounds;
+    int first = 0;
+    int count = 0;
+
+    bool isLeaf() const { return count > 0; }
+};
+
+// Bounding volume hierarchy over a list of boxes, built with the binned
+// surface area heuristic. The BVH only knows about boxes: the caller keeps the
+// primitives and tests them in the leaves.
+class BVH
+{
+public:
+    FlatArray<BVHNode> nodes;
+    FlatArray<int> primIndices; // leaf ranges index into this, it holds indices of the input boxes
+
+    // Leaves hold at most maxLeafSize primitives unless MAX_DEPTH is reached.
+    // groupSize is how many primitives the leaf test handles in one step (the SIMD
+    // width), the SAH charges a leaf per started group instead of per primitive.
+    void build(const std::vector<AABB> &primBounds, int maxLeafSize = 4, int groupSize = 1);
+    void clear();
+    bool isEmpty() const { return nodes.empty(); }
+
+    // Recomputes the node boxes bottom-up after primitives moved (primBounds as
+    // for build). The tree keeps its shape, so it gets slower to traverse the
+    // further the primitives move from where they were at the build.
+    void refit(const std::vector<AABB> &primBounds);
+
+    // Expected cost of a ray through the tree by the surface area heuristic,
+    // relative to the root box: one per node visited, one per leaf group tested
+    float cost() const;
+
+    // Visits every leaf the ray reaches at a distance <= tMax, nearest child first.
+    // hitLeaf(first, count) tests the primitives of a leaf, it may lower tMax and
+    // returns true to stop the traversal (e.g. for shadow rays).
+    template <typename LeafFn>
+    void traverse(const glm::vec3 &origin, const glm::vec3 &direction, float &tMax, LeafFn &&hitLeaf) const;
+
+    static const int MAX_DEPTH = 64; // deeper nodes are turned into leaves, this bounds the traversal stack
+
+private:
+    static const int NUM_BINS = 16;
+    int maxLeafSize = 4;
+    int groupSize = 1;
+
+    int groups(int count) const { return (count + groupSize - 1) / groupSize; }
+
+    void subdivide(int nodeIndex, int depth, const std::vector<AABB> &primBounds, const std::vector<glm::vec3> &centroids);
+};
+
+template <typename LeafFn>
+void BVH::traverse(const glm::vec3 &origin, const glm::vec3 &direction, float &tMax, LeafFn &&hitLeaf) const
+{
+    if (nodes.empty())
+        return;
+
+    glm::vec3 invDirection = safeInverse(direction);
+    float tEntry;
+    if (!nodes[0].bounds.intersect(origin, invDirection, tMax, tEntry))
+        return;
+
+    // Nodes are pushed with their entry distance so they can be skipped once a closer hit is known
+    struct StackEntry
+    {
+        int node;
+        float tEntry;
+    };
+    StackEntry stack[MAX_DEPTH + 1];
+    int stackSize = 0;
+    stack[stackSize++] = {0, tEntry};
+
+    while (stackSize > 0)
+    {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tEntry > tMax)
+            continue;
+
+        const BVHNode &node = nodes[entry.node];
+        if (node.isLeaf())
+        {
+            if (hitLeaf(node.first, node.count))
+                return;
+            continue;
+        }
+
+        float tLeft, tRight;
+        bool hitLeft = nodes[node.first].bounds.intersect(origin, invDirection, tMax, tLeft);
+        bool hitRight = nodes[node.first + 1].bounds.intersect(origin, invDirection, tMax, tRight);
+
+        // Push the far child first so the near one is popped next
+        if (hitLeft && hitRight)
+        {
+            if (tLeft <= tRight)
+            {
+                stack[stackSize++] = {node.first + 1, tRight};
+                stack[stackSize++] = {node.first, tLeft};
+            }
+            else
+            {
+                stack[stackSize++] = {node.first, tLeft};
+                stack[stackSize++] = {node.first + 1, tRight};
+            }
+        }
+        else if (hitLeft)
+            stack[stackSize++] = {node.first, tLeft};
+        else if (hitRight)
+            stack[stackSize++] = {node.first + 1, tRight};
+    }
+}
+
+#endif // BVH_H
@@ -0,0 +1,223 @@
+#include "BatchRenderer.h"
+#include "SceneReader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <stb/stb_image_write.h>
+
+BatchRenderer::BatchRenderer(ThreadPool &pool, int maxConcurrentJobs)
+    : pool(pool), maxConcurrentJobs(std::max(1, maxConcurrentJobs))
+{
+}
+
+std::vector<RenderJobResult> BatchRenderer::run(const std::vector<RenderJob> &jobs, const JobCallback &onDone)
+{
+    std::vector<RenderJobResult> results(jobs.size());
+    std::atomic<int> next{0};
+
+    // Job threads only load scenes and wait for their tiles, the pool does the tracing
+    auto runJobs = [&]
+    {
+        for (int job = next++; job < static_cast<int>(jobs.size()); job = next++)
+        {
+            results[job] = runJob(jobs[job], pool);
+            if (onDone)
+                onDone(job, results[job]);
+        }
+    };
+
+    int numThreads = std::min(maxConcurrentJobs, static_cast<int>(jobs.size()));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++)
+        threads.emplace_back(runJobs);
+    runJobs();
+    for (std::thread &thread : threads)
+        thread.join();
+    return results;
+}
+
+RenderJobResult BatchRenderer::runJob(const RenderJob &job, ThreadPool &pool)
+{
+    RenderJobResult result;
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+        // Loading and saving are measured like the tiles, so tiles of other jobs
+        // that this thread runs while it waits for the pool are not counted here
+        RenderStatsAccumulator ownWork;
+        std::unique_ptr<Scene> scene;
+        ownWork.measure([&]
+                        {
+            SceneReader reader;
+            scene.reset(reader.readScene(job.sceneFile, &pool));
+            scene->updateAccelerationStructure(); });
+        auto loaded = std::chrono::steady_clock::now();
+        result.loadSeconds = std::chrono::duration<double>(loaded - start).count();
+
+        Framebuffer image;
+        renderScene(job, *scene, pool, image, result);
+
+        std::filesystem::path directory = std::filesystem::path(job.imageFile).parent_path();
+        std::error_code error;
+        if (!directory.empty())
+            std::filesystem::create_directories(directory, error);
+        bool saved = false;
+        ownWork.measure([&]
+                        {
+            RENDER_STAGE(STAGE_SAVE);
+            saved = stbi_write_png(job.imageFile.c_str(), image.getWidth(), image.getHeight(), Framebuffer::CHANNELS, image.pixels(), image.getRowStride()) != 0; });
+        if (!saved)
+            throw std::runtime_error("Failed to save the image to " + job.imageFile);
+        result.stats += ownWork.total();
+#ifdef RT_RENDER_COUNTERS
+        if (!writeRenderStatsJson(renderStatsFile(job.imageFile), result.stats))
+            throw std::runtime_error("Failed to save the render counters to " + renderStatsFile(job.imageFile));
+#endif
+        result.ok = true;
+    }
+    catch (const std::exception &e)
+    {
+        result.error = e.what();
+    }
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+void BatchRenderer::renderScene(const RenderJob &job, Scene &scene, ThreadPool &pool, Framebuffer &image, RenderJobResult &result)
+{
+    RenderSettings settings = job.settings;
+    if (job.adaptiveFromScene)
+        settings.adaptive = scene.eye.modeFlag != 0;
+    if (settings.adaptive && !job.samplesGiven)
+        settings.samplesPerPixel = 16;
+    settings.progressive = false;
+
+    auto start = std::chrono::steady_clock::now();
+    Renderer renderer(scene, settings, &pool);
+    renderer.Render(image);
+    result.renderSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.stats = renderer.getStats();
+}
+
+// Paths that differ only in spelling (./a.png, dir/../a.png) name the same image
+static std::string imageKey(const std::string &imageFile)
+{
+    return std::filesystem::absolute(imageFile).lexically_normal().string();
+}
+
+void assignImageFiles(std::vector<RenderJob> &jobs, const std::string &outputDirectory)
+{
+    std::set<std::string> taken;
+    for (const RenderJob &job : jobs)
+    {
+        if (!job.imageFile.empty() && !taken.insert(imageKey(job.imageFile)).second)
+            throw std::runtime_error("Two jobs write " + job.imageFile);
+    }
+
+    for (RenderJob &job : jobs)
+    {
+        if (!job.imageFile.empty())
+            continue;
+        std::string stem = std::filesystem::path(job.sceneFile).stem().string();
+        for (int copy = 1; job.imageFile.empty() || !taken.insert(imageKey(job.imageFile)).second; copy++)
+        {
+            std::string name = copy == 1 ? stem + ".png" : stem + "-" + std::to_string(copy) + ".png";
+            job.imageFile = (std::filesystem::path(outputDirectory) / name).string();
+        }
+    }
+}
+
+bool setJobOption(RenderJob &job, const std::string &key, const std::string &value)
+{
+    RenderSettings &settings = job.settings;
+    if (key == "width")
+        settings.width = std::stoi(value);
+    else if (key == "height")
+        settings.height = std::stoi(value);
+    else if (key == "samples")
+    {
+        settings.samplesPerPixel = std::stoi(value);
+        job.samplesGiven = true;
+    }
+    else if (key == "depth")
+        settings.maxDepth = std::stoi(value);
+    else if (key == "seed")
+        settings.seed = static_cast<unsigned int>(std::stoul(value));
+    else if (key == "sampler")
+    {
+        if (!parseSamplerType(value, settings.sampler))
+            throw std::invalid_argument("unknown sampler " + value);
+    }
+    else if (key == "adaptive")
+    {
+        if (value != "scene" && value != "on" && value != "off")
+            throw std::invalid_argument("adaptive must be scene, on or off");
+        job.adaptiveFromScene = value == "scene";
+        settings.adaptive = value == "on";
+    }
+    else
+        return false;
+
+    if (settings.width <= 0 || settings.height <= 0 || settings.samplesPerPixel <= 0 || settings.maxDepth < 0)
+        throw std::invalid_argument(key + " is out of range");
+    return true;
+}
+
+std::vector<RenderJob> readManifest(const std::string &filename, const RenderJob &defaults, const std::string &outputDirectory)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+        throw std::runtime_error("Failed to open " + filename);
+
+    std::filesystem::path directory = std::filesystem::path(filename).parent_path();
+    auto resolve = [&](const std::string &path)
+    { return std::filesystem::path(path).is_absolute() ? path : (directory / path).string(); };
+
+    std::vector<RenderJob> jobs;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        std::istringstream words(line);
+        std::string word;
+        if (!(words >> word) || word[0] == '#')
+            continue;
+
+        RenderJob job = defaults;
+        job.sceneFile = resolve(word);
+        while (words >> word)
+        {
+            size_t equals = word.find('=');
+            try
+            {
+                if (equals == std::string::npos && job.imageFile.empty())
+                    job.imageFile = resolve(word);
+                else if (equals == std::string::npos || !setJobOption(job, word.substr(0, equals), word.substr(equals + 1)))
+                    throw std::invalid_argument("unknown option " + word);
+            }
+            catch (const std::exception &e)
+            {
+                throw std::runtime_error(filename + ":" + std::to_string(lineNumber) + ": " + e.what());
+            }
+        }
+        jobs.push_back(job);
+    }
+    try
+    {
+        assignImageFiles(jobs, outputDirectory);
+    }
+    catch (const std::exception &e)
+    {
+        throw std::runtime_error(filename + ": " + e.what());
+    }
+    return jobs;
+}
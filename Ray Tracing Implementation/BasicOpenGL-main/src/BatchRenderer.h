@@ -0,0 +1,82 @@
+#ifndef BATCH_RENDERER_H
+#define BATCH_RENDERER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "Renderer.h"
+#include "ThreadPool.h"
+
+// One scene to render and where the image goes
+struct RenderJob
+{
+    std::string sceneFile;
+    std::string imageFile;
+    RenderSettings settings;
+
+    // As in main: a non-zero Eye::modeFlag turns on adaptive anti-aliasing,
+    // with 16 samples per pixel unless the job sets its own sample count
+    bool adaptiveFromScene = true;
+    bool samplesGiven = false;
+};
+
+struct RenderJobResult
+{
+    bool ok = false;
+    std::string error;    // when not ok
+    double loadSeconds = 0.0;   // reading the scene and building its BVH
+    double renderSeconds = 0.0;
+    double wallSeconds = 0.0;   // from start to saved image
+    RenderStats stats;          // rays of this job only
+
+    uint64_t rays() const { return stats.cameraRays + stats.secondaryRays + stats.shadowRays; }
+    double raysPerSecond() const { return renderSeconds > 0.0 ? rays() / renderSeconds : 0.0; }
+};
+
+// Renders a list of jobs, up to maxConcurrentJobs at a time. All of them share
+// one thread pool: the tiles of the jobs in flight are spread over the same
+// workers, so a job with few tiles left does not leave threads idle.
+class BatchRenderer
+{
+public:
+    // Called once per job as soon as it is done, from the thread that ran it
+    typedef std::function<void(int job, const RenderJobResult &result)> JobCallback;
+
+    BatchRenderer(ThreadPool &pool, int maxConcurrentJobs = 2);
+
+    // Results in the order of jobs. A failing job (unreadable scene, image that
+    // cannot be written) does not stop the others.
+    std::vector<RenderJobResult> run(const std::vector<RenderJob> &jobs, const JobCallback &onDone = nullptr);
+
+    static RenderJobResult runJob(const RenderJob &job, ThreadPool &pool);
+
+    // Renders a scene that is already loaded with the settings of job (the scene
+    // and image files are not used). Sets renderSeconds and stats of result.
+    static void renderScene(const RenderJob &job, Scene &scene, ThreadPool &pool, Framebuffer &image, RenderJobResult &result);
+
+private:
+    ThreadPool &pool;
+    int maxConcurrentJobs;
+};
+
+// Reads a job list, one job per line:
+//
+//   scene.txt [image.png] [width=N] [height=N] [samples=N] [depth=N] [seed=N]
+//             [sampler=random|stratified|sobol|r2] [adaptive=scene|on|off]
+//
+// Relative paths are relative to the manifest. Jobs without an image get one
+// in outputDirectory from assignImageFiles. Options not given are taken from
+// defaults; blank lines and lines starting with # are skipped. Throws
+// std::runtime_error on unreadable files, unknown options and images named twice.
+std::vector<RenderJob> readManifest(const std::string &filename, const RenderJob &defaults, const std::string &outputDirectory);
+
+// Gives every job without an image outputDirectory/<scene name>.png, or
+// <scene name>-2.png and so on if another job writes that file already, so
+// jobs running at the same time never write the same image (or stats file).
+// Throws std::runtime_error if two jobs name the same image themselves.
+void assignImageFiles(std::vector<RenderJob> &jobs, const std::string &outputDirectory);
+
+// Sets one key=value option of a job, false if the key is unknown
+bool setJobOption(RenderJob &job, const std::string &key, const std::string &value);
+
+#endif // BATCH_RENDERER_H
@@ -0,0 +1,418 @@
+#include "BinaryScene.h"
+#include "RenderStats.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#include <new>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+static const uint64_t SECTION_ALIGNMENT = 64;
+static const uint32_t FLAG_HAS_BVH = 1;
+
+enum SectionId
+{
+    SECTION_SPHERE_CENTER_X,
+    SECTION_SPHERE_CENTER_Y,
+    SECTION_SPHERE_CENTER_Z,
+    SECTION_SPHERE_RADIUS2,
+    SECTION_SPHERE_MATERIAL,
+    SECTION_SPHERE_OBJECT,
+    SECTION_PLANE_NORMAL_X,
+    SECTION_PLANE_NORMAL_Y,
+    SECTION_PLANE_NORMAL_Z,
+    SECTION_PLANE_OFFSET,
+    SECTION_PLANE_MATERIAL,
+    SECTION_PLANE_OBJECT,
+    SECTION_TRIANGLE_VERTICES,
+    SECTION_TRIANGLE_MATERIAL,
+    SECTION_TRIANGLE_OBJECT,
+    SECTION_MATERIAL_COLOR,
+    SECTION_MATERIAL_SHININESS,
+    SECTION_MATERIAL_STATUS,
+    SECTION_OBJECT_IDS,
+    SECTION_BVH_NODES,
+    SECTION_BVH_PRIM_INDICES,
+    SECTION_TRIANGLE_BVH_NODES,
+    SECTION_TRIANGLE_BVH_PRIM_INDICES,
+    SECTION_LIGHTS,
+    NUM_SECTIONS
+};
+
+struct BinarySection
+{
+    uint64_t offset; // from the start of the file
+    uint64_t count;  // elements
+    uint32_t elementSize;
+    uint32_t reserved;
+};
+
+struct BinarySceneHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t flags;
+    int32_t sphereCount; // without the padding
+    int32_t planeCount;
+    int32_t triangleCount;
+    int32_t objectCount;
+    int32_t materialCount; // objects + face materials of the meshes
+    float eyePosition[3];
+    int32_t eyeModeFlag;
+    float ambient[3];
+    int32_t lightCount;
+    BinarySection sections[NUM_SECTIONS];
+};
+
+struct BinaryLight
+{
+    int32_t spotlight; // 0 => directional
+    float intensity[3];
+    float direction[3];
+    float position[3];
+    float cutoff;
+};
+
+// The arrays are used in place, so their element layout is part of the format
+static_assert(sizeof(glm::vec3) == 12, "material colors are stored as 3 floats");
+static_assert(sizeof(BVHNode) == 32, "BVH nodes are stored as 2 x 3 floats + 2 ints");
+
+void BinaryScene::write(Scene &scene, const std::string &filename, bool includeBVH)
+{
+    if (!scene.isCompiled())
+        scene.buildAccelerationStructure();
+    const CompiledScene &compiled = scene.compiled;
+    // Instances point at geometry compiled in memory, the format has no sections for it
+    if (compiled.numInstances() > 0)
+        throw std::runtime_error("Scenes with instances cannot be written as binary scene files");
+
+    std::vector<BinaryLight> lights;
+    for (LightSource *light : scene.lights)
+    {
+        BinaryLight record = {};
+        record.spotlight = light->isSpotlight() ? 1 : 0;
+        std::memcpy(record.intensity, &light->intensity[0], sizeof(record.intensity));
+        std::memcpy(record.direction, &light->direction[0], sizeof(record.direction));
+        if (light->isSpotlight())
+        {
+            Spotlight *spotlight = dynamic_cast<Spotlight *>(light);
+            std::memcpy(record.position, &spotlight->position[0], sizeof(record.position));
+            record.cutoff = spotlight->cutoff;
+        }
+        lights.push_back(record);
+    }
+
+    BinarySceneHeader header = {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.flags = includeBVH ? FLAG_HAS_BVH : 0;
+    header.sphereCount = compiled.sphereCount;
+    header.planeCount = compiled.planeCount;
+    header.triangleCount = compiled.triangleCount;
+    header.objectCount = static_cast<int32_t>(compiled.objectIds.size());
+    header.materialCount = static_cast<int32_t>(compiled.materialColor.size());
+    std::memcpy(header.eyePosition, &scene.eye.position[0], sizeof(header.eyePosition));
+    header.eyeModeFlag = scene.eye.modeFlag;
+    std::memcpy(header.ambient, &scene.ambient.intensity[0], sizeof(header.ambient));
+    header.lightCount = static_cast<int32_t>(lights.size());
+
+    struct Payload
+    {
+        const void *data;
+        size_t count;
+        size_t elementSize;
+    };
+    auto payload = [](const auto &values)
+    {
+        return Payload{values.data(), values.size(), sizeof(values[0])};
+    };
+    Payload payloads[NUM_SECTIONS] = {
+        payload(compiled.sphereCenterX),
+        payload(compiled.sphereCenterY),
+        payload(compiled.sphereCenterZ),
+        payload(compiled.sphereRadius2),
+        payload(compiled.sphereMaterial),
+        payload(compiled.sphereObject),
+        payload(compiled.planeNormalX),
+        payload(compiled.planeNormalY),
+        payload(compiled.planeNormalZ),
+        payload(compiled.planeOffset),
+        payload(compiled.planeMaterial),
+        payload(compiled.planeObject),
+        payload(compiled.triangleVertices),
+        payload(compiled.triangleMaterial),
+        payload(compiled.triangleObject),
+        payload(compiled.materialColor),
+        payload(compiled.materialShininess),
+        payload(compiled.materialStatus),
+        payload(compiled.objectIds),
+        payload(compiled.sphereBVH.nodes),
+        payload(compiled.sphereBVH.primIndices),
+        payload(compiled.triangleBVH.nodes),
+        payload(compiled.triangleBVH.primIndices),
+        payload(lights),
+    };
+    if (!(header.flags & FLAG_HAS_BVH))
+    {
+        payloads[SECTION_BVH_NODES].count = 0;
+        payloads[SECTION_BVH_PRIM_INDICES].count = 0;
+        payloads[SECTION_TRIANGLE_BVH_NODES].count = 0;
+        payloads[SECTION_TRIANGLE_BVH_PRIM_INDICES].count = 0;
+    }
+
+    uint64_t offset = sizeof(BinarySceneHeader);
+    for (int i = 0; i < NUM_SECTIONS; i++)
+    {
+        offset = (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+        header.sections[i] = {offset, payloads[i].count, static_cast<uint32_t>(payloads[i].elementSize), 0};
+        offset += payloads[i].count * payloads[i].elementSize;
+    }
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open())
+        throw std::runtime_error("Failed to create binary scene file " + filename);
+
+    static const char zeros[SECTION_ALIGNMENT] = {};
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    uint64_t written = sizeof(header);
+    for (int i = 0; i < NUM_SECTIONS; i++)
+    {
+        file.write(zeros, header.sections[i].offset - written);
+        file.write(static_cast<const char *>(payloads[i].data), payloads[i].count * payloads[i].elementSize);
+        written = header.sections[i].offset + payloads[i].count * payloads[i].elementSize;
+    }
+    if (!file)
+        throw std::runtime_error("Failed to write binary scene file " + filename);
+}
+
+bool BinaryScene::isBinarySceneFile(const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    char magic[sizeof(MAGIC)] = {};
+    file.read(magic, sizeof(magic));
+    return file && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+// Throws unless the section holds expectedCount elements of elementSize inside the file
+static void checkSection(const BinarySceneHeader &header, int section, size_t elementSize, uint64_t expectedCount, size_t fileSize)
+{
+    const BinarySection &entry = header.sections[section];
+    if (entry.elementSize != elementSize || entry.count != expectedCount || entry.offset % SECTION_ALIGNMENT != 0 ||
+        entry.offset > fileSize || entry.count > (fileSize - entry.offset) / elementSize)
+        throw std::runtime_error("Binary scene file has a damaged section " + std::to_string(section));
+}
+
+// Throws unless the first count entries of indices lie in [0, limit)
+static void checkIndices(const FlatArray<int> &indices, int count, int limit, const char *what)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (indices[i] < 0 || indices[i] >= limit)
+            throw std::runtime_error(std::string("Binary scene file has a ") + what + " index out of range");
+    }
+}
+
+// Throws unless the nodes form a tree the traversal can walk: children come after
+// their parent and inside the node array, leaves cover entries of primIndices,
+// no path is deeper than MAX_DEPTH and primIndices only names primitives below primCount
+static void checkBVH(const BVH &bvh, int primCount, const char *what)
+{
+    int numNodes = static_cast<int>(bvh.nodes.size());
+    int numIndices = static_cast<int>(bvh.primIndices.size());
+    std::vector<int> depth(numNodes, 0);
+    for (int i = 0; i < numNodes; i++)
+    {
+        const BVHNode &node = bvh.nodes[i];
+        bool valid;
+        if (node.isLeaf())
+            valid = node.first >= 0 && node.first <= numIndices - node.count;
+        else
+            valid = node.count == 0 && node.first > i && node.first < numNodes - 1 && depth[i] < static_cast<int>(BVH::MAX_DEPTH);
+        if (!valid)
+            throw std::runtime_error(std::string("Binary scene file has a damaged ") + what + " BVH");
+        if (!node.isLeaf())
+            depth[node.first] = depth[node.first + 1] = depth[i] + 1;
+    }
+    checkIndices(bvh.primIndices, numIndices, primCount, what);
+}
+
+// Maps the whole file copy-on-write: pages are shared with the page cache until
+// something writes to them. The returned pointer owns the mapping.
+static std::shared_ptr<const void> mapFile(const std::string &filename, size_t &size)
+{
+#ifdef _WIN32
+    // No mmap here: read the file into one aligned block instead
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        throw std::runtime_error("Failed to open binary scene file " + filename);
+    size = static_cast<size_t>(file.tellg());
+    std::align_val_t alignment(SECTION_ALIGNMENT);
+    void *data = ::operator new(size > 0 ? size : 1, alignment);
+    std::shared_ptr<const void> block(data, [alignment](const void *p)
+                                      { ::operator delete(const_cast<void *>(p), alignment); });
+    file.seekg(0);
+    file.read(static_cast<char *>(data), size);
+    if (!file)
+        throw std::runtime_error("Failed to read binary scene file " + filename);
+    return block;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open binary scene file " + filename);
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        throw std::runtime_error("Failed to read binary scene file " + filename);
+    }
+    size = static_cast<size_t>(info.st_size);
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (data == MAP_FAILED)
+        throw std::runtime_error("Failed to map binary scene file " + filename);
+    return std::shared_ptr<const void>(data, [size](const void *p)
+                                       { munmap(const_cast<void *>(p), size); });
+#endif
+}
+
+Scene *BinaryScene::read(const std::string &filename)
+{
+    RENDER_STAGE(STAGE_PARSE);
+    size_t size = 0;
+    std::shared_ptr<const void> storage = mapFile(filename, size);
+    const unsigned char *base = static_cast<const unsigned char *>(storage.get());
+
+    if (size < sizeof(BinarySceneHeader))
+        throw std::runtime_error("Binary scene file " + filename + " is truncated");
+    const BinarySceneHeader &header = *reinterpret_cast<const BinarySceneHeader *>(base);
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw std::runtime_error(filename + " is not a binary scene file");
+    if (header.byteOrder != BYTE_ORDER_MARK)
+        throw std::runtime_error("Binary scene file " + filename + " was written with another byte order");
+    if (header.version != VERSION)
+        throw std::runtime_error("Binary scene file " + filename + " has version " + std::to_string(header.version) +
+                                 ", expected " + std::to_string(VERSION));
+
+    Scene *scene = new Scene(Eye(glm::vec3(header.eyePosition[0], header.eyePosition[1], header.eyePosition[2]), header.eyeModeFlag),
+                             Ambient(glm::vec3(header.ambient[0], header.ambient[1], header.ambient[2])));
+    try
+    {
+        bindArrays(scene->compiled, base, size);
+    }
+    catch (...)
+    {
+        delete scene;
+        throw;
+    }
+
+    const BinaryLight *lights = reinterpret_cast<const BinaryLight *>(base + header.sections[SECTION_LIGHTS].offset);
+    for (int i = 0; i < header.lightCount; i++)
+    {
+        const BinaryLight &light = lights[i];
+        glm::vec3 intensity(light.intensity[0], light.intensity[1], light.intensity[2]);
+        glm::vec3 direction(light.direction[0], light.direction[1], light.direction[2]);
+        if (light.spotlight)
+            scene->addLight(new Spotlight(intensity, direction, light.cutoff, glm::vec3(light.position[0], light.position[1], light.position[2])));
+        else
+            scene->addLight(new DirectionalLight(intensity, direction));
+    }
+
+    scene->compiled.storage = storage;
+    scene->accelerationBuilt = true;
+    return scene;
+}
+
+void BinaryScene::bindArrays(CompiledScene &compiled, const unsigned char *base, size_t size)
+{
+    const BinarySceneHeader &header = *reinterpret_cast<const BinarySceneHeader *>(base);
+    if (header.sphereCount < 0 || header.planeCount < 0 || header.triangleCount < 0 || header.objectCount < 0 ||
+        header.materialCount < 0 || header.lightCount < 0)
+        throw std::runtime_error("Binary scene file has negative counts");
+
+    uint64_t sphereEntries = static_cast<uint64_t>(header.sphereCount) + CompiledScene::PADDING;
+    uint64_t planeEntries = static_cast<uint64_t>(header.planeCount) + CompiledScene::PADDING;
+    uint64_t triangleEntries = static_cast<uint64_t>(header.triangleCount);
+    uint64_t objectEntries = static_cast<uint64_t>(header.objectCount);
+    uint64_t materialEntries = static_cast<uint64_t>(header.materialCount);
+    bool hasBVH = (header.flags & FLAG_HAS_BVH) != 0;
+
+    // The mapping is copy-on-write, so handing out writable pointers is safe
+    unsigned char *writableBase = const_cast<unsigned char *>(base);
+    auto bind = [&](auto &values, int section, uint64_t expectedCount)
+    {
+        typedef std::remove_reference_t<decltype(values[0])> Element;
+        checkSection(header, section, sizeof(Element), expectedCount, size);
+        values.borrow(reinterpret_cast<Element *>(writableBase + header.sections[section].offset), expectedCount);
+    };
+
+    compiled.clear();
+    bind(compiled.sphereCenterX, SECTION_SPHERE_CENTER_X, sphereEntries);
+    bind(compiled.sphereCenterY, SECTION_SPHERE_CENTER_Y, sphereEntries);
+    bind(compiled.sphereCenterZ, SECTION_SPHERE_CENTER_Z, sphereEntries);
+    bind(compiled.sphereRadius2, SECTION_SPHERE_RADIUS2, sphereEntries);
+    bind(compiled.sphereMaterial, SECTION_SPHERE_MATERIAL, sphereEntries);
+    bind(compiled.sphereObject, SECTION_SPHERE_OBJECT, sphereEntries);
+    bind(compiled.planeNormalX, SECTION_PLANE_NORMAL_X, planeEntries);
+    bind(compiled.planeNormalY, SECTION_PLANE_NORMAL_Y, planeEntries);
+    bind(compiled.planeNormalZ, SECTION_PLANE_NORMAL_Z, planeEntries);
+    bind(compiled.planeOffset, SECTION_PLANE_OFFSET, planeEntries);
+    bind(compiled.planeMaterial, SECTION_PLANE_MATERIAL, planeEntries);
+    bind(compiled.planeObject, SECTION_PLANE_OBJECT, planeEntries);
+    bind(compiled.triangleVertices, SECTION_TRIANGLE_VERTICES, 3 * triangleEntries);
+    bind(compiled.triangleMaterial, SECTION_TRIANGLE_MATERIAL, triangleEntries);
+    bind(compiled.triangleObject, SECTION_TRIANGLE_OBJECT, triangleEntries);
+    bind(compiled.materialColor, SECTION_MATERIAL_COLOR, materialEntries);
+    bind(compiled.materialShininess, SECTION_MATERIAL_SHININESS, materialEntries);
+    bind(compiled.materialStatus, SECTION_MATERIAL_STATUS, materialEntries);
+    bind(compiled.objectIds, SECTION_OBJECT_IDS, objectEntries);
+    checkSection(header, SECTION_LIGHTS, sizeof(BinaryLight), static_cast<uint64_t>(header.lightCount), size);
+    compiled.sphereCount = header.sphereCount;
+    compiled.planeCount = header.planeCount;
+    compiled.triangleCount = header.triangleCount;
+
+    // The kernels index with these unchecked, so a damaged file is turned away here
+    checkIndices(compiled.sphereMaterial, header.sphereCount, header.materialCount, "sphere material");
+    checkIndices(compiled.planeMaterial, header.planeCount, header.materialCount, "plane material");
+    checkIndices(compiled.triangleMaterial, header.triangleCount, header.materialCount, "triangle material");
+    checkIndices(compiled.sphereObject, header.sphereCount, header.objectCount, "sphere object");
+    checkIndices(compiled.planeObject, header.planeCount, header.objectCount, "plane object");
+    checkIndices(compiled.triangleObject, header.triangleCount, header.objectCount, "triangle object");
+
+    if (hasBVH)
+    {
+        // An empty BVH has no nodes, any other has at least the root
+        const BinarySection &sphereNodes = header.sections[SECTION_BVH_NODES];
+        const BinarySection &triangleNodes = header.sections[SECTION_TRIANGLE_BVH_NODES];
+        if ((sphereNodes.count == 0) != (header.sphereCount == 0) || (triangleNodes.count == 0) != (header.triangleCount == 0))
+            throw std::runtime_error("Binary scene file has a damaged BVH");
+        bind(compiled.sphereBVH.nodes, SECTION_BVH_NODES, sphereNodes.count);
+        bind(compiled.sphereBVH.primIndices, SECTION_BVH_PRIM_INDICES, static_cast<uint64_t>(header.sphereCount));
+        bind(compiled.triangleBVH.nodes, SECTION_TRIANGLE_BVH_NODES, triangleNodes.count);
+        bind(compiled.triangleBVH.primIndices, SECTION_TRIANGLE_BVH_PRIM_INDICES, triangleEntries);
+        checkBVH(compiled.sphereBVH, header.sphereCount, "sphere");
+        checkBVH(compiled.triangleBVH, header.triangleCount, "triangle");
+        return;
+    }
+
+    // No prebuilt BVH: build them over the mapped primitives (sorts them in place)
+    std::vector<AABB> sphereBounds;
+    sphereBounds.reserve(header.sphereCount);
+    for (int i = 0; i < header.sphereCount; i++)
+        sphereBounds.push_back(Sphere(0, compiled.sphereCenter(i), std::sqrt(compiled.sphereRadius2[i])).getBounds());
+    compiled.buildSphereBVH(sphereBounds);
+    compiled.buildTriangleBVH();
+}
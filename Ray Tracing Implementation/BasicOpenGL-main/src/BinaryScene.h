@@ -0,0 +1,37 @@
+#ifndef BINARY_SCENE_H
+#define BINARY_SCENE_H
+
+#include <cstdint>
+#include <string>
+#include "Scene.h"
+
+// Precompiled scene file: the flattened arrays of a CompiledScene (padding
+// included), the eye, ambient and lights, and optionally the sphere and triangle BVHs.
+// Loading maps the file copy-on-write and the compiled scene borrows its arrays
+// in place, so nothing is parsed or copied per primitive. A loaded scene has no
+// Scene::objects; it renders from the compiled arrays only.
+//
+// Layout (native byte order, checked on load): BinarySceneHeader at offset 0,
+// then the sections, each starting on a 64-byte boundary.
+class BinaryScene
+{
+public:
+    static const uint32_t VERSION = 2; // 2: mesh triangles
+    static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    // Writes a compiled scene. Without the BVHs the loader rebuilds them (and
+    // sorts the mapped arrays in place) but still skips all parsing.
+    static void write(Scene &scene, const std::string &filename, bool includeBVH = true);
+
+    // Throws std::runtime_error on files of another version, byte order or a
+    // damaged layout
+    static Scene *read(const std::string &filename);
+
+    // True if the file starts with the binary scene magic
+    static bool isBinarySceneFile(const std::string &filename);
+
+private:
+    static void bindArrays(CompiledScene &compiled, const unsigned char *base, size_t size);
+};
+
+#endif // BINARY_SCENE_H
@@ -0,0 +1,556 @@
+#include "CompiledScene.h"
+#include "IntersectKernels.h"
+#include "RayPacket.h"
+#include "RenderStats.h"
+#include "Scene.h"
+#include "TriangleMesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
+void CompiledScene::clear()
+{
+    sphereCenterX.clear();
+    sphereCenterY.clear();
+    sphereCenterZ.clear();
+    sphereRadius2.clear();
+    sphereMaterial.clear();
+    sphereObject.clear();
+
+    planeNormalX.clear();
+    planeNormalY.clear();
+    planeNormalZ.clear();
+    planeOffset.clear();
+    planeMaterial.clear();
+    planeObject.clear();
+
+    triangleVertices.clear();
+    triangleMaterial.clear();
+    triangleObject.clear();
+
+    materialColor.clear();
+    materialShininess.clear();
+    materialStatus.clear();
+    objectIds.clear();
+
+    geometries.clear();
+    instanceGeometry.clear();
+    instanceWorldToObject.clear();
+    instanceObjectToWorld.clear();
+    instanceMaterial.clear();
+    instanceObject.clear();
+
+    sphereBVH.clear();
+    triangleBVH.clear();
+    instanceBVH.clear();
+    instanceBounds.clear();
+    objectInstance.clear();
+    instancesMoved = false;
+    sphereCount = 0;
+    planeCount = 0;
+    triangleCount = 0;
+    instanceCount = 0;
+    storage.reset();
+}
+
+void CompiledScene::build(const std::vector<Object *> &objects)
+{
+    clear();
+
+    std::vector<AABB> sphereBounds;
+    std::vector<std::pair<const Mesh *, int>> meshes; // with their object index
+    std::unordered_map<const InstanceGeometry *, int> geometryIndex;
+
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        Object *obj = objects[i];
+        int objectIndex = static_cast<int>(i);
+
+        // Every object gets its own material entry
+        materialColor.push_back(obj->material.color);
+        materialShininess.push_back(obj->material.shininess);
+        materialStatus.push_back(obj->status);
+        objectIds.push_back(obj->ObjectId);
+
+        if (obj->isSphere())
+        {
+            Sphere *sphere = dynamic_cast<Sphere *>(obj);
+            sphereCenterX.push_back(sphere->center.x);
+            sphereCenterY.push_back(sphere->center.y);
+            sphereCenterZ.push_back(sphere->center.z);
+            sphereRadius2.push_back(sphere->radius * sphere->radius);
+            sphereMaterial.push_back(objectIndex);
+            sphereObject.push_back(objectIndex);
+            sphereBounds.push_back(obj->getBounds());
+        }
+        else if (obj->isPlane())
+        {
+            Plane *plane = dynamic_cast<Plane *>(obj);
+            planeNormalX.push_back(plane->coefficients.x);
+            planeNormalY.push_back(plane->coefficients.y);
+            planeNormalZ.push_back(plane->coefficients.z);
+            planeOffset.push_back(plane->coefficients.w);
+            planeMaterial.push_back(objectIndex);
+            planeObject.push_back(objectIndex);
+        }
+        else if (obj->isMesh())
+        {
+            meshes.push_back({dynamic_cast<const Mesh *>(obj), objectIndex});
+        }
+        else if (obj->isInstance())
+        {
+            // Only the placement is copied, the geometry stays shared
+            const Instance *instance = dynamic_cast<const Instance *>(obj);
+            auto found = geometryIndex.emplace(instance->geometry.get(), static_cast<int>(geometries.size()));
+            if (found.second)
+                geometries.push_back(instance->geometry);
+            instanceGeometry.push_back(found.first->second);
+            instanceWorldToObject.push_back(glm::mat4x3(instance->worldToObject));
+            instanceObjectToWorld.push_back(glm::mat4x3(instance->objectToWorld));
+            instanceMaterial.push_back(instance->overrideMaterial ? objectIndex : -1);
+            instanceObject.push_back(objectIndex);
+            instanceBounds.push_back(obj->getBounds());
+        }
+    }
+
+    // Mesh triangles in world space; face materials get entries after the objects
+    size_t numTriangles = 0;
+    for (const auto &mesh : meshes)
+        numTriangles += mesh.first->mesh->numTriangles();
+    triangleVertices.reserve(3 * numTriangles);
+    triangleMaterial.reserve(numTriangles);
+    triangleObject.reserve(numTriangles);
+    for (const auto &entry : meshes)
+    {
+        const Mesh &mesh = *entry.first;
+        int firstMaterial = static_cast<int>(materialColor.size());
+        for (const MeshMaterial &material : mesh.mesh->materials)
+        {
+            materialColor.push_back(material.color);
+            materialShininess.push_back(material.shininess);
+            materialStatus.push_back(mesh.status);
+        }
+        for (int i = 0; i < mesh.mesh->numTriangles(); i++)
+        {
+            for (int corner = 0; corner < 3; corner++)
+                triangleVertices.push_back(mesh.triangleVertex(i, corner));
+            int face = mesh.mesh->faceMaterials[i];
+            triangleMaterial.push_back(face < 0 ? entry.second : firstMaterial + face);
+            triangleObject.push_back(entry.second);
+        }
+    }
+
+    sphereCount = static_cast<int>(sphereBounds.size());
+    planeCount = static_cast<int>(planeOffset.size());
+    triangleCount = static_cast<int>(numTriangles);
+    instanceCount = static_cast<int>(instanceBounds.size());
+    buildSphereBVH(sphereBounds);
+    buildTriangleBVH();
+    objectInstance.assign(objects.size(), -1);
+    buildInstanceBVH();
+    addPadding();
+}
+
+// Sorts values (stride entries per primitive) into the order of the BVH leaves.
+// In place, so borrowed arrays stay borrowed (a mapped file is mapped copy-on-write).
+template <typename Array>
+static void reorder(Array &values, const FlatArray<int> &order, int stride = 1)
+{
+    std::vector<typename std::decay<decltype(values[0])>::type> sorted(order.size() * stride);
+    for (size_t i = 0; i < order.size(); i++)
+        for (int k = 0; k < stride; k++)
+            sorted[i * stride + k] = values[order[i] * stride + k];
+    std::copy(sorted.begin(), sorted.end(), values.begin());
+}
+
+void CompiledScene::buildSphereBVH(const std::vector<AABB> &sphereBounds)
+{
+    // Lay the spheres out in BVH leaf order so every leaf is one contiguous range
+    sphereBVH.build(sphereBounds, SPHERE_LEAF_SIZE, getIntersectKernels().width);
+    if (sphereBVH.primIndices.empty())
+        return;
+
+    reorder(sphereCenterX, sphereBVH.primIndices);
+    reorder(sphereCenterY, sphereBVH.primIndices);
+    reorder(sphereCenterZ, sphereBVH.primIndices);
+    reorder(sphereRadius2, sphereBVH.primIndices);
+    reorder(sphereMaterial, sphereBVH.primIndices);
+    reorder(sphereObject, sphereBVH.primIndices);
+
+    for (size_t i = 0; i < sphereBVH.primIndices.size(); i++)
+        sphereBVH.primIndices[i] = static_cast<int>(i);
+}
+
+void CompiledScene::buildTriangleBVH()
+{
+    std::vector<AABB> triangleBounds(triangleCount);
+    for (int i = 0; i < triangleCount; i++)
+    {
+        AABB &bounds = triangleBounds[i];
+        for (int corner = 0; corner < 3; corner++)
+            bounds.expand(triangleVertex(i, corner));
+        // Padded a little so rounding in the box test never loses a hit on an edge
+        float padding = 1e-5f * (glm::length(bounds.max - bounds.min) + glm::length(bounds.centroid()));
+        bounds.min -= glm::vec3(padding);
+        bounds.max += glm::vec3(padding);
+    }
+
+    triangleBVH.build(triangleBounds, TRIANGLE_LEAF_SIZE);
+    if (triangleBVH.primIndices.empty())
+        return;
+
+    reorder(triangleVertices, triangleBVH.primIndices, 3);
+    reorder(triangleMaterial, triangleBVH.primIndices);
+    reorder(triangleObject, triangleBVH.primIndices);
+
+    for (size_t i = 0; i < triangleBVH.primIndices.size(); i++)
+        triangleBVH.primIndices[i] = static_cast<int>(i);
+}
+
+void CompiledScene::buildInstanceBVH()
+{
+    instanceBVH.build(instanceBounds, INSTANCE_LEAF_SIZE);
+    instanceBVHCost = instanceBVH.cost();
+    if (instanceBVH.primIndices.empty())
+        return;
+
+    reorder(instanceGeometry, instanceBVH.primIndices);
+    reorder(instanceWorldToObject, instanceBVH.primIndices);
+    reorder(instanceObjectToWorld, instanceBVH.primIndices);
+    reorder(instanceMaterial, instanceBVH.primIndices);
+    reorder(instanceObject, instanceBVH.primIndices);
+    reorder(instanceBounds, instanceBVH.primIndices);
+
+    for (size_t i = 0; i < instanceBVH.primIndices.size(); i++)
+    {
+        instanceBVH.primIndices[i] = static_cast<int>(i);
+        objectInstance[instanceObject[i]] = static_cast<int>(i);
+    }
+}
+
+void CompiledScene::setInstanceTransform(int object, const glm::mat4 &objectToWorld, const glm::mat4 &worldToObject)
+{
+    int i = objectInstance.at(object);
+    if (i < 0)
+        throw std::runtime_error("Object " + std::to_string(object) + " is not an instance");
+    instanceObjectToWorld[i] = glm::mat4x3(objectToWorld);
+    instanceWorldToObject[i] = glm::mat4x3(worldToObject);
+    instanceBounds[i] = transformBounds(geometries[instanceGeometry[i]]->bounds, instanceObjectToWorld[i]);
+    instancesMoved = true;
+}
+
+void CompiledScene::updateInstances()
+{
+    if (!instancesMoved)
+        return;
+    instancesMoved = false;
+
+    instanceBVH.refit(instanceBounds);
+    if (instanceBVH.cost() > INSTANCE_REBUILD_COST * instanceBVHCost)
+        buildInstanceBVH();
+}
+
+void CompiledScene::addPadding()
+{
+    // Dead spheres have an infinite negative squared radius: the discriminant is never >= 0
+    for (int i = 0; i < PADDING; i++)
+    {
+        sphereCenterX.push_back(0.0f);
+        sphereCenterY.push_back(0.0f);
+        sphereCenterZ.push_back(0.0f);
+        sphereRadius2.push_back(-std::numeric_limits<float>::infinity());
+        sphereMaterial.push_back(0);
+        sphereObject.push_back(std::numeric_limits<int>::max());
+
+        // Dead planes have a zero normal: every ray is parallel to them
+        planeNormalX.push_back(0.0f);
+        planeNormalY.push_back(0.0f);
+        planeNormalZ.push_back(0.0f);
+        planeOffset.push_back(0.0f);
+        planeMaterial.push_back(0);
+        planeObject.push_back(std::numeric_limits<int>::max());
+    }
+}
+
+SphereArrays CompiledScene::sphereArrays() const
+{
+    return {sphereCenterX.data(), sphereCenterY.data(), sphereCenterZ.data(), sphereRadius2.data(), sphereObject.data()};
+}
+
+PlaneArrays CompiledScene::planeArrays() const
+{
+    return {planeNormalX.data(), planeNormalY.data(), planeNormalZ.data(), planeOffset.data(), planeObject.data()};
+}
+
+const CompiledScene &CompiledScene::instanceScene(int i) const
+{
+    return geometries[instanceGeometry[i]]->compiled;
+}
+
+PrimitiveHit CompiledScene::closestHit(const glm::vec3 &origin, const glm::vec3 &direction) const
+{
+    PrimitiveHit hit = {std::numeric_limits<float>::infinity(), PRIMITIVE_NONE, -1, -1};
+    closestHit(origin, direction, hit);
+    return hit;
+}
+
+void CompiledScene::closestHit(const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const
+{
+    const IntersectKernels &kernels = getIntersectKernels();
+    SphereArrays spheres = sphereArrays();
+
+    if (planeCount > 0)
+        kernels.intersectPlanes(planeArrays(), 0, planeCount, origin, direction, hit);
+
+    if (sphereCount < MIN_BVH_SPHERES)
+    {
+        kernels.intersectSpheres(spheres, 0, sphereCount, origin, direction, hit);
+    }
+    else
+    {
+        // hit.t doubles as the traversal limit, it shrinks as closer spheres are found
+        sphereBVH.traverse(origin, direction, hit.t, [&](int first, int count)
+                           {
+            kernels.intersectSpheres(spheres, first, count, origin, direction, hit);
+            return false; });
+    }
+
+    closestTriangle(origin, direction, hit);
+    closestInstance(origin, direction, hit);
+}
+
+void CompiledScene::intersectTriangles(int first, int count, const WatertightRay &ray, PrimitiveHit &hit) const
+{
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_TRIANGLE, count));
+    for (int i = first; i < first + count; i++)
+    {
+        float t;
+        if (intersectTriangle(ray, triangleVertices[3 * i], triangleVertices[3 * i + 1], triangleVertices[3 * i + 2], t) &&
+            (t < hit.t || (t == hit.t && triangleObject[i] < hit.object)))
+            hit = {t, PRIMITIVE_TRIANGLE, i, triangleObject[i]};
+    }
+}
+
+void CompiledScene::closestTriangle(const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const
+{
+    if (triangleCount == 0)
+        return;
+    WatertightRay ray(origin, direction);
+    triangleBVH.traverse(origin, direction, hit.t, [&](int first, int count)
+                         {
+        intersectTriangles(first, count, ray, hit);
+        return false; });
+}
+
+void CompiledScene::intersectInstance(int i, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const
+{
+    glm::vec3 localOrigin = instanceWorldToObject[i] * glm::vec4(origin, 1.0f);
+    glm::vec3 localDirection = instanceWorldToObject[i] * glm::vec4(direction, 0.0f);
+
+    // Object indices inside the geometry are its own. A tie with the current hit
+    // goes to the instance if it comes first in the scene: start above or below
+    // every local index accordingly.
+    PrimitiveHit local = {hit.t, PRIMITIVE_NONE, -1, instanceObject[i] < hit.object ? std::numeric_limits<int>::max() : -1};
+    instanceScene(i).closestHit(localOrigin, localDirection, local);
+    if (local.type != PRIMITIVE_NONE)
+        hit = {local.t, local.type, local.index, instanceObject[i], i};
+}
+
+bool CompiledScene::instanceOccludes(int i, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const
+{
+    glm::vec3 localOrigin = instanceWorldToObject[i] * glm::vec4(origin, 1.0f);
+    glm::vec3 localDirection = instanceWorldToObject[i] * glm::vec4(direction, 0.0f);
+
+    PrimitiveHit local = {hit.t, PRIMITIVE_NONE, -1, -1};
+    if (!instanceScene(i).anyHit(localOrigin, localDirection, local))
+        return false;
+    hit = {local.t, local.type, local.index, instanceObject[i], i};
+    return true;
+}
+
+void CompiledScene::closestInstance(const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const
+{
+    if (instanceCount == 0)
+        return;
+    instanceBVH.traverse(origin, direction, hit.t, [&](int first, int count)
+                         {
+        for (int i = first; i < first + count; i++)
+            intersectInstance(i, origin, direction, hit);
+        return false; });
+}
+
+bool CompiledScene::occluded(const glm::vec3 &origin, const glm::vec3 &direction, float tMax, PrimitiveHit *hint) const
+{
+    // Starting from t = tMax the kernels only report hits strictly closer than tMax
+    PrimitiveHit hit = {tMax, PRIMITIVE_NONE, -1, -1};
+
+    // The last occluder often blocks the next shadow ray as well
+    if (hint != nullptr)
+    {
+        const IntersectKernels &kernels = getIntersectKernels();
+        // For an occluder inside an instance, test the whole instance
+        if (hint->instance >= 0)
+        {
+            if (hint->instance < instanceCount)
+                instanceOccludes(hint->instance, origin, direction, hit);
+        }
+        else if (hint->type == PRIMITIVE_SPHERE && hint->index < sphereCount)
+            kernels.intersectSpheres(sphereArrays(), hint->index, 1, origin, direction, hit);
+        else if (hint->type == PRIMITIVE_PLANE && hint->index < planeCount)
+            kernels.intersectPlanes(planeArrays(), hint->index, 1, origin, direction, hit);
+        else if (hint->type == PRIMITIVE_TRIANGLE && hint->index < triangleCount)
+            intersectTriangles(hint->index, 1, WatertightRay(origin, direction), hit);
+        if (hit.type != PRIMITIVE_NONE)
+        {
+            countOccluderCacheHit();
+            return true;
+        }
+    }
+
+    if (!anyHit(origin, direction, hit))
+        return false;
+
+    if (hint != nullptr)
+        *hint = hit;
+    return true;
+}
+
+bool CompiledScene::anyHit(const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const
+{
+    const IntersectKernels &kernels = getIntersectKernels();
+    SphereArrays spheres = sphereArrays();
+
+    if (planeCount > 0)
+        kernels.intersectPlanes(planeArrays(), 0, planeCount, origin, direction, hit);
+
+    if (hit.type == PRIMITIVE_NONE)
+    {
+        if (sphereCount < MIN_BVH_SPHERES)
+        {
+            kernels.intersectSpheres(spheres, 0, sphereCount, origin, direction, hit);
+        }
+        else
+        {
+            sphereBVH.traverse(origin, direction, hit.t, [&](int first, int count)
+                               {
+                kernels.intersectSpheres(spheres, first, count, origin, direction, hit);
+                return hit.type != PRIMITIVE_NONE; });
+        }
+    }
+
+    if (hit.type == PRIMITIVE_NONE && triangleCount > 0)
+    {
+        WatertightRay ray(origin, direction);
+        triangleBVH.traverse(origin, direction, hit.t, [&](int first, int count)
+                             {
+            intersectTriangles(first, count, ray, hit);
+            return hit.type != PRIMITIVE_NONE; });
+    }
+
+    if (hit.type == PRIMITIVE_NONE && instanceCount > 0)
+    {
+        instanceBVH.traverse(origin, direction, hit.t, [&](int first, int count)
+                             {
+            for (int i = first; i < first + count; i++)
+                if (instanceOccludes(i, origin, direction, hit))
+                    return true;
+            return false; });
+    }
+
+    return hit.type != PRIMITIVE_NONE;
+}
+
+void CompiledScene::closestHitPacket(const RayPacket &packet, PrimitiveHit *hits) const
+{
+    const IntersectKernels &kernels = getIntersectKernels();
+    SphereArrays spheres = sphereArrays();
+    PlaneArrays planes = planeArrays();
+
+    for (int i = 0; i < packet.count; i++)
+    {
+        hits[i] = {std::numeric_limits<float>::infinity(), PRIMITIVE_NONE, -1, -1};
+        if (planeCount > 0)
+            kernels.intersectPlanes(planes, 0, planeCount, packet.origin, packet.directions[i], hits[i]);
+    }
+
+    Frustum frustum;
+    if (sphereCount < MIN_BVH_SPHERES || !frustum.build(packet))
+    {
+        for (int i = 0; i < packet.count; i++)
+        {
+            if (sphereCount < MIN_BVH_SPHERES)
+                kernels.intersectSpheres(spheres, 0, sphereCount, packet.origin, packet.directions[i], hits[i]);
+            else
+                sphereBVH.traverse(packet.origin, packet.directions[i], hits[i].t, [&](int first, int count)
+                                   {
+                    kernels.intersectSpheres(spheres, first, count, packet.origin, packet.directions[i], hits[i]);
+                    return false; });
+        }
+    }
+    else
+    {
+        closestSpheresFrustum(packet, frustum, hits);
+    }
+
+    // Triangles and instances ray by ray, the spheres already bound how far each ray has to look
+    for (int i = 0; i < packet.count; i++)
+    {
+        closestTriangle(packet.origin, packet.directions[i], hits[i]);
+        closestInstance(packet.origin, packet.directions[i], hits[i]);
+    }
+}
+
+void CompiledScene::closestSpheresFrustum(const RayPacket &packet, const Frustum &frustum, PrimitiveHit *hits) const
+{
+    const IntersectKernels &kernels = getIntersectKernels();
+    SphereArrays spheres = sphereArrays();
+
+    glm::vec3 invDirections[RayPacket::MAX_RAYS];
+    for (int i = 0; i < packet.count; i++)
+        invDirections[i] = safeInverse(packet.directions[i]);
+
+    // Nothing beyond the furthest current hit of the packet can matter
+    auto furthestHit = [&]()
+    {
+        float furthest = 0.0f;
+        for (int i = 0; i < packet.count; i++)
+            furthest = glm::max(furthest, hits[i].t);
+        return furthest;
+    };
+    float maxT = furthestHit();
+
+    int stack[BVH::MAX_DEPTH + 1];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BVHNode &node = sphereBVH.nodes[stack[--stackSize]];
+        if (!frustum.intersects(node.bounds) || distanceToBox(packet.origin, node.bounds) > maxT)
+            continue;
+
+        if (!node.isLeaf())
+        {
+            // Push the far child first so the near one is popped next
+            const BVHNode &left = sphereBVH.nodes[node.first];
+            const BVHNode &right = sphereBVH.nodes[node.first + 1];
+            bool leftFirst = glm::dot(left.bounds.centroid() - right.bounds.centroid(), frustum.axis) <= 0.0f;
+            stack[stackSize++] = leftFirst ? node.first + 1 : node.first;
+            stack[stackSize++] = leftFirst ? node.first : node.first + 1;
+            continue;
+        }
+
+        for (int i = 0; i < packet.count; i++)
+        {
+            float tEntry;
+            if (node.bounds.intersect(packet.origin, invDirections[i], hits[i].t, tEntry))
+                kernels.intersectSpheres(spheres, node.first, node.count, packet.origin, packet.directions[i], hits[i]);
+        }
+        maxT = furthestHit();
+    }
+}
@@ -0,0 +1,186 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+#include "BVH.h"
+#include "FlatArray.h"
+
+class Object;
+class InstanceGeometry;
+
+// Primitive types of the compiled scene
+enum PrimitiveType
+{
+    PRIMITIVE_NONE = -1,
+    PRIMITIVE_SPHERE = 0,
+    PRIMITIVE_PLANE = 1,
+    PRIMITIVE_TRIANGLE = 2,
+};
+
+// Result of a hit query on the compiled scene
+struct PrimitiveHit
+{
+    float t;
+    int type;   // PrimitiveType
+    int index;  // index in the arrays of that type
+    int object; // index of the source object in Scene::objects
+    int instance = -1; // index in the instance arrays if the primitive belongs to an instance's geometry
+};
+
+struct SphereArrays;
+struct PlaneArrays;
+struct RayPacket;
+struct WatertightRay;
+class Frustum;
+
+// Flattened copy of the scene geometry for the hit queries.
+// Primitives are sorted by type and stored as structure-of-arrays, so the hot
+// loops run over contiguous floats without virtual calls or casts. Spheres are
+// stored in BVH leaf order: a leaf covers the spheres [first, first + count).
+// Mesh triangles get a BVH of their own and are stored the same way.
+// Instances are not flattened: each one points at the compiled scene of its
+// shared geometry, and rays are moved into object space to test it, so the
+// geometry exists once however many instances there are.
+// The primitive arrays end with PADDING dead entries so SIMD kernels can always
+// load 8 lanes. A scene loaded from a binary scene file borrows all arrays from
+// the mapped file, see BinaryScene.
+class CompiledScene
+{
+public:
+    static const int PADDING = 8;
+
+    // Spheres
+    FlatArray<float> sphereCenterX, sphereCenterY, sphereCenterZ;
+    FlatArray<float> sphereRadius2; // squared radius
+    FlatArray<int> sphereMaterial;  // index in materials
+    FlatArray<int> sphereObject;    // index of the source object
+
+    // Planes: a*x + b*y + c*z + d = 0
+    FlatArray<float> planeNormalX, planeNormalY, planeNormalZ;
+    FlatArray<float> planeOffset; // d
+    FlatArray<int> planeMaterial;
+    FlatArray<int> planeObject;
+
+    // Triangles of all meshes in world space, 3 vertices per triangle
+    FlatArray<glm::vec3> triangleVertices;
+    FlatArray<int> triangleMaterial;
+    FlatArray<int> triangleObject;
+
+    // Materials, one entry per source object followed by the face materials of the meshes
+    FlatArray<glm::vec3> materialColor;
+    FlatArray<float> materialShininess;
+    FlatArray<int> materialStatus; // (0,1,2) =>(regular , reflective , tranparent)
+
+    FlatArray<int> objectIds; // Object::ObjectId by object index
+
+    // Instances, in instance BVH leaf order. A hit on an instance reports the
+    // primitive of the geometry's compiled scene and the instance it was found in.
+    std::vector<std::shared_ptr<const InstanceGeometry>> geometries;
+    FlatArray<int> instanceGeometry; // index in geometries
+    FlatArray<glm::mat4x3> instanceWorldToObject; // affine, the last row is (0, 0, 0, 1)
+    FlatArray<glm::mat4x3> instanceObjectToWorld;
+    FlatArray<int> instanceMaterial; // index in materials, -1 => the geometry's own materials
+    FlatArray<int> instanceObject;
+
+    BVH sphereBVH;
+    BVH triangleBVH;
+    BVH instanceBVH;
+
+    void build(const std::vector<Object *> &objects);
+    void clear();
+
+    // True if the arrays are borrowed from a mapped scene file
+    bool isMapped() const { return storage != nullptr; }
+
+    // Two-level updates for animation. An instance's geometry is its bottom
+    // level and never changes; moving instances only touches the top level.
+    // Moves the instance of the given object index (it must be an instance).
+    void setInstanceTransform(int object, const glm::mat4 &objectToWorld, const glm::mat4 &worldToObject);
+    // Brings the instance BVH up to date after setInstanceTransform: refits it in
+    // O(n), or rebuilds it in O(n log n) once refitting has made it
+    // INSTANCE_REBUILD_COST times more expensive to traverse than a fresh build
+    void updateInstances();
+    bool hasMovedInstances() const { return instancesMoved; }
+
+    int numSpheres() const { return sphereCount; }
+    int numPlanes() const { return planeCount; }
+    int numTriangles() const { return triangleCount; }
+    int numInstances() const { return instanceCount; }
+
+    // Closest hit with t >= 0; on a tie the object listed first in the scene wins
+    PrimitiveHit closestHit(const glm::vec3 &origin, const glm::vec3 &direction) const;
+
+    // True if any primitive is hit with 0 <= t < tMax. Stops at the first one found.
+    // If hint is given, the primitive it names (a previous occluder) is tested first
+    // and it is updated to the occluder found.
+    bool occluded(const glm::vec3 &origin, const glm::vec3 &direction, float tMax, PrimitiveHit *hint = nullptr) const;
+
+    // closestHit for every ray of the packet (hits[i] belongs to ray i). The packet
+    // walks the BVH as one frustum, so nodes no ray can reach are skipped for all
+    // rays at once. Gives exactly the same hits as closestHit.
+    void closestHitPacket(const RayPacket &packet, PrimitiveHit *hits) const;
+
+    glm::vec3 sphereCenter(int i) const { return glm::vec3(sphereCenterX[i], sphereCenterY[i], sphereCenterZ[i]); }
+    glm::vec3 planeNormal(int i) const { return glm::vec3(planeNormalX[i], planeNormalY[i], planeNormalZ[i]); }
+    glm::vec3 triangleVertex(int i, int corner) const { return triangleVertices[3 * i + corner]; }
+    // Compiled scene of the geometry instance i refers to
+    const CompiledScene &instanceScene(int i) const;
+
+    SphereArrays sphereArrays() const;
+    PlaneArrays planeArrays() const;
+
+    // True if the spheres are traversed through the BVH rather than one flat loop
+    bool usesBVH() const { return sphereCount >= MIN_BVH_SPHERES; }
+
+private:
+    friend class BinaryScene;
+
+    // Spheres below this count are tested in one flat loop instead of through the BVH
+    static const int MIN_BVH_SPHERES = 16;
+    // Leaf size of the sphere BVH, one step of the 8-wide kernels
+    static const int SPHERE_LEAF_SIZE = 8;
+    static const int TRIANGLE_LEAF_SIZE = 4;
+    static const int INSTANCE_LEAF_SIZE = 2;
+    static constexpr float INSTANCE_REBUILD_COST = 1.5f;
+
+    int sphereCount = 0;
+    int planeCount = 0;
+    int triangleCount = 0;
+    int instanceCount = 0;
+
+    std::vector<AABB> instanceBounds; // world space, in instance order
+    std::vector<int> objectInstance;  // index in the instance arrays by object index, -1 if not an instance
+    float instanceBVHCost = 0.0f;     // BVH::cost right after the last build
+    bool instancesMoved = false;
+
+    // Memory the borrowed arrays point into (a mapped scene file), null if all are owned
+    std::shared_ptr<const void> storage;
+
+    void addPadding();
+    // Builds the sphere BVH over sphereBounds (one box per sphere in array order)
+    // and sorts the sphere arrays into leaf order
+    void buildSphereBVH(const std::vector<AABB> &sphereBounds);
+    // Same for the triangles, their boxes come from the vertices
+    void buildTriangleBVH();
+    // Same for the instances over instanceBounds
+    void buildInstanceBVH();
+
+    // closestHit starting from hit: only hits closer than hit (or tied with a lower object) replace it
+    void closestHit(const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const;
+    // occluded without the hint, hit.t is tMax; true with hit set to the first occluder found
+    bool anyHit(const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const;
+
+    // Replace hit if one of the triangles [first, first + count) is hit closer
+    void intersectTriangles(int first, int count, const WatertightRay &ray, PrimitiveHit &hit) const;
+    void closestTriangle(const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const;
+    // Same for instance i: the ray is moved into object space, so t is the same in both spaces
+    void intersectInstance(int i, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const;
+    bool instanceOccludes(int i, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const;
+    void closestInstance(const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit) const;
+    // Sphere part of closestHitPacket: the packet walks the sphere BVH as one frustum
+    void closestSpheresFrustum(const RayPacket &packet, const Frustum &frustum, PrimitiveHit *hits) const;
+};
+
+#endif // COMPILED_SCENE_H
@@ -0,0 +1,116 @@
+#ifndef FLAT_ARRAY_H
+#define FLAT_ARRAY_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Contiguous array of plain data that either owns its elements or borrows them
+// from memory owned by someone else (a memory-mapped scene file). Reads work
+// the same either way. Anything that changes the size first copies borrowed
+// elements into owned storage, clear() simply drops them.
+template <typename T>
+class FlatArray
+{
+public:
+    FlatArray() = default;
+    FlatArray(const FlatArray &other) { *this = other; }
+    FlatArray(FlatArray &&other) noexcept { *this = std::move(other); }
+
+    FlatArray &operator=(const FlatArray &other)
+    {
+        if (this == &other)
+            return *this;
+        if (other.borrowed)
+        {
+            borrow(other.items, other.count);
+            return *this;
+        }
+        owned = other.owned;
+        borrowed = false;
+        sync();
+        return *this;
+    }
+
+    FlatArray &operator=(FlatArray &&other) noexcept
+    {
+        owned = std::move(other.owned);
+        items = other.items;
+        count = other.count;
+        borrowed = other.borrowed;
+        other.owned.clear();
+        other.borrowed = false;
+        other.sync();
+        return *this;
+    }
+
+    // Uses items[0 .. count) in place, they must outlive this array (or its next clear)
+    void borrow(T *items, size_t count)
+    {
+        owned.clear();
+        owned.shrink_to_fit();
+        this->items = items;
+        this->count = count;
+        borrowed = true;
+    }
+    bool isBorrowed() const { return borrowed; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T *data() { return items; }
+    const T *data() const { return items; }
+    T &operator[](size_t i) { return items[i]; }
+    const T &operator[](size_t i) const { return items[i]; }
+    T *begin() { return items; }
+    T *end() { return items + count; }
+    const T *begin() const { return items; }
+    const T *end() const { return items + count; }
+
+    void clear()
+    {
+        owned.clear();
+        borrowed = false;
+        sync();
+    }
+    void reserve(size_t capacity)
+    {
+        own();
+        owned.reserve(capacity);
+        sync();
+    }
+    void resize(size_t size)
+    {
+        own();
+        owned.resize(size);
+        sync();
+    }
+    void push_back(const T &value)
+    {
+        own();
+        owned.push_back(value);
+        sync();
+    }
+
+private:
+    std::vector<T> owned;
+    T *items = nullptr;
+    size_t count = 0;
+    bool borrowed = false;
+
+    void own()
+    {
+        if (!borrowed)
+            return;
+        owned.assign(items, items + count);
+        borrowed = false;
+        sync();
+    }
+    void sync()
+    {
+        items = owned.data();
+        count = owned.size();
+    }
+};
+
+#endif // FLAT_ARRAY_H
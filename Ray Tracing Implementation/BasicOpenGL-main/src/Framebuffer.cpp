@@ -0,0 +1,74 @@
+#include "Framebuffer.h"
+#include "RenderStats.h"
+
+#include <cstring>
+#include <new>
+
+static void *allocateAligned(size_t bytes)
+{
+    return ::operator new(bytes == 0 ? Framebuffer::ALIGNMENT : bytes, std::align_val_t(Framebuffer::ALIGNMENT));
+}
+
+void Framebuffer::AlignedDelete::operator()(void *p) const
+{
+    ::operator delete(p, std::align_val_t(Framebuffer::ALIGNMENT));
+}
+
+Framebuffer::Framebuffer(int width, int height)
+{
+    resize(width, height);
+}
+
+void Framebuffer::resize(int newWidth, int newHeight)
+{
+    if (!accum || newWidth != width || newHeight != height)
+    {
+        width = newWidth;
+        height = newHeight;
+        size_t values = static_cast<size_t>(width) * height * CHANNELS;
+        accum.reset(static_cast<float *>(allocateAligned(values * sizeof(float))));
+        ldr.reset(static_cast<unsigned char *>(allocateAligned(values)));
+    }
+    clear();
+}
+
+void Framebuffer::clear()
+{
+    size_t values = static_cast<size_t>(width) * height * CHANNELS;
+    std::memset(accum.get(), 0, values * sizeof(float));
+    std::memset(ldr.get(), 0, values);
+}
+
+glm::vec3 Framebuffer::getAccumulated(int x, int y) const
+{
+    const float *p = accum.get() + index(x, y);
+    return glm::vec3(p[0], p[1], p[2]);
+}
+
+void Framebuffer::setAccumulated(int x, int y, const glm::vec3 &sum)
+{
+    float *p = accum.get() + index(x, y);
+    p[0] = sum.r;
+    p[1] = sum.g;
+    p[2] = sum.b;
+}
+
+void Framebuffer::accumulate(int x, int y, const glm::vec3 &color)
+{
+    float *p = accum.get() + index(x, y);
+    p[0] += color.r;
+    p[1] += color.g;
+    p[2] += color.b;
+}
+
+void Framebuffer::resolve(int x0, int y0, int x1, int y1, float sampleCount)
+{
+    RENDER_STAGE(STAGE_RESOLVE);
+    for (int y = y0; y < y1; y++)
+    {
+        const float *in = accum.get() + index(x0, y);
+        unsigned char *out = ldr.get() + index(x0, y);
+        for (int i = 0; i < (x1 - x0) * CHANNELS; i++)
+            out[i] = static_cast<unsigned char>(255 * glm::clamp(in[i] / sampleCount, 0.0f, 1.0f));
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <cstddef>
+#include <memory>
+#include <glm/glm.hpp>
+
+// Render target: one contiguous float RGB plane holding the (unclamped) sum of
+// all samples per pixel, and the final 8-bit RGB plane for output.
+// Both planes are row-major with row 0 at the top of the picture, tightly packed
+// (3 values per pixel) and start on a cache line, so the 8-bit plane can be
+// handed to stbi_write_png as is.
+class Framebuffer
+{
+public:
+    static const int CHANNELS = 3;
+    static const size_t ALIGNMENT = 64; // cache line
+
+    Framebuffer(int width = 0, int height = 0);
+
+    // Reallocates only when the size changes; both planes are cleared to 0
+    void resize(int width, int height);
+    void clear();
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getRowStride() const { return width * CHANNELS; } // bytes per row of the 8-bit plane
+
+    // Accumulation plane
+    glm::vec3 getAccumulated(int x, int y) const;
+    void setAccumulated(int x, int y, const glm::vec3 &sum);
+    void accumulate(int x, int y, const glm::vec3 &color);
+
+    // Divides the sums in [x0, x1) x [y0, y1) by sampleCount and stores
+    // 255 * clamp(value, 0, 1) in the 8-bit plane
+    void resolve(int x0, int y0, int x1, int y1, float sampleCount);
+    void resolve(float sampleCount) { resolve(0, 0, width, height, sampleCount); }
+
+    const float *accumulation() const { return accum.get(); }
+    unsigned char *pixels() { return ldr.get(); }
+    const unsigned char *pixels() const { return ldr.get(); }
+
+private:
+    struct AlignedDelete
+    {
+        void operator()(void *p) const;
+    };
+
+    int width = 0;
+    int height = 0;
+    std::unique_ptr<float[], AlignedDelete> accum;
+    std::unique_ptr<unsigned char[], AlignedDelete> ldr;
+
+    size_t index(int x, int y) const { return (static_cast<size_t>(y) * width + x) * CHANNELS; }
+};
+
+#endif // FRAMEBUFFER_H
@@ -0,0 +1,421 @@
+#include "IntersectKernels.h"
+#include "RenderStats.h"
+
+#include <atomic>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RT_HAS_AVX2_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define RT_HAS_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+// Plane::Intersect rejects |denominator| < 1e-6 in double precision. For a
+// float x that is the same as x <= the largest float below 1e-6.
+static float parallelThreshold()
+{
+    float threshold = static_cast<float>(1e-6);
+    if (threshold >= 1e-6)
+        threshold = std::nextafter(threshold, 0.0f);
+    return threshold;
+}
+
+static const float PARALLEL_THRESHOLD = parallelThreshold();
+
+static inline bool isCloser(float t, int object, const PrimitiveHit &hit)
+{
+    return t < hit.t || (t == hit.t && object < hit.object);
+}
+
+/////////////////////
+// Scalar kernels  //
+/////////////////////
+
+static void intersectSpheresScalar(const SphereArrays &s, int first, int count, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit)
+{
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_SPHERE, count));
+    float a = direction.x * direction.x + direction.y * direction.y + direction.z * direction.z;
+
+    for (int i = first; i < first + count; i++)
+    {
+        float ocx = origin.x - s.centerX[i];
+        float ocy = origin.y - s.centerY[i];
+        float ocz = origin.z - s.centerZ[i];
+
+        float b = 2.0f * (ocx * direction.x + ocy * direction.y + ocz * direction.z);
+        float c = (ocx * ocx + ocy * ocy + ocz * ocz) - s.radius2[i];
+        float discriminant = b * b - 4.0f * a * c;
+        if (discriminant < 0)
+            continue;
+
+        float sqrtDiscriminant = std::sqrt(discriminant);
+        float t1 = (-b - sqrtDiscriminant) / (2.0f * a);
+        float t2 = (-b + sqrtDiscriminant) / (2.0f * a);
+
+        // t1 <= t2, take the nearest one in front of the origin
+        float t = t1 >= 0 ? t1 : t2;
+        if (t >= 0 && isCloser(t, s.object[i], hit))
+            hit = {t, PRIMITIVE_SPHERE, i, s.object[i]};
+    }
+}
+
+static void intersectPlanesScalar(const PlaneArrays &p, int first, int count, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit)
+{
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_PLANE, count));
+    for (int i = first; i < first + count; i++)
+    {
+        float denominator = p.normalX[i] * direction.x + p.normalY[i] * direction.y + p.normalZ[i] * direction.z;
+
+        // The ray is parallel to the plane
+        if (std::fabs(denominator) <= PARALLEL_THRESHOLD)
+            continue;
+
+        float numerator = -((p.normalX[i] * origin.x + p.normalY[i] * origin.y + p.normalZ[i] * origin.z) + p.offset[i]);
+        float t = numerator / denominator;
+        if (t >= 0 && isCloser(t, p.object[i], hit))
+            hit = {t, PRIMITIVE_PLANE, i, p.object[i]};
+    }
+}
+
+// Picks the best lane after a SIMD loop. Lanes start out as a copy of hit, so
+// any lane with an index found something closer than hit.
+static void reduceLanes(const float *laneT, const int *laneIndex, const int *laneObject, int lanes, int type, PrimitiveHit &hit)
+{
+    for (int lane = 0; lane < lanes; lane++)
+    {
+        if (laneIndex[lane] >= 0 && isCloser(laneT[lane], laneObject[lane], hit))
+            hit = {laneT[lane], type, laneIndex[lane], laneObject[lane]};
+    }
+}
+
+/////////////////////
+// AVX2 kernels    //
+/////////////////////
+
+#ifdef RT_HAS_AVX2_KERNELS
+
+__attribute__((target("avx2"))) static void intersectSpheresAVX2(const SphereArrays &s, int first, int count, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit)
+{
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_SPHERE, count));
+    float a = direction.x * direction.x + direction.y * direction.y + direction.z * direction.z;
+
+    const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+    const __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 fourA = _mm256_set1_ps(4.0f * a);
+    const __m256 twoA = _mm256_set1_ps(2.0f * a);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    const __m256i laneOffsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i end = _mm256_set1_epi32(first + count);
+
+    __m256 bestT = _mm256_set1_ps(hit.t);
+    __m256i bestIndex = _mm256_set1_epi32(-1);
+    __m256i bestObject = _mm256_set1_epi32(hit.object);
+
+    for (int i = first; i < first + count; i += 8)
+    {
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(s.centerX + i));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(s.centerY + i));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(s.centerZ + i));
+
+        __m256 dotOD = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        __m256 dotOO = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz));
+        __m256 b = _mm256_mul_ps(two, dotOD);
+        __m256 c = _mm256_sub_ps(dotOO, _mm256_loadu_ps(s.radius2 + i));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(fourA, c));
+
+        // Most spheres are missed, skip the square root and divisions when all 8 are
+        if (_mm256_movemask_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ)) == 0)
+            continue;
+
+        __m256 sqrtDiscriminant = _mm256_sqrt_ps(discriminant);
+        __m256 minusB = _mm256_xor_ps(b, signBit);
+        __m256 t1 = _mm256_div_ps(_mm256_sub_ps(minusB, sqrtDiscriminant), twoA);
+        __m256 t2 = _mm256_div_ps(_mm256_add_ps(minusB, sqrtDiscriminant), twoA);
+        __m256 t = _mm256_blendv_ps(t2, t1, _mm256_cmp_ps(t1, zero, _CMP_GE_OQ));
+
+        // A negative discriminant gives NaN roots, which fail t >= 0
+        __m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), laneOffsets);
+        __m256i object = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s.object + i));
+        __m256 valid = _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GE_OQ), _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, index)));
+
+        __m256 closer = _mm256_or_ps(_mm256_cmp_ps(t, bestT, _CMP_LT_OQ),
+                                     _mm256_and_ps(_mm256_cmp_ps(t, bestT, _CMP_EQ_OQ), _mm256_castsi256_ps(_mm256_cmpgt_epi32(bestObject, object))));
+        __m256 take = _mm256_and_ps(valid, closer);
+        __m256i takeInt = _mm256_castps_si256(take);
+
+        bestT = _mm256_blendv_ps(bestT, t, take);
+        bestIndex = _mm256_blendv_epi8(bestIndex, index, takeInt);
+        bestObject = _mm256_blendv_epi8(bestObject, object, takeInt);
+    }
+
+    // No lane found anything closer
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(bestIndex, _mm256_set1_epi32(-1))) == -1)
+        return;
+
+    alignas(32) float laneT[8];
+    alignas(32) int laneIndex[8], laneObject[8];
+    _mm256_store_ps(laneT, bestT);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(laneIndex), bestIndex);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(laneObject), bestObject);
+    reduceLanes(laneT, laneIndex, laneObject, 8, PRIMITIVE_SPHERE, hit);
+}
+
+__attribute__((target("avx2"))) static void intersectPlanesAVX2(const PlaneArrays &p, int first, int count, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit)
+{
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_PLANE, count));
+    const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+    const __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    const __m256 threshold = _mm256_set1_ps(PARALLEL_THRESHOLD);
+    const __m256i laneOffsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i end = _mm256_set1_epi32(first + count);
+
+    __m256 bestT = _mm256_set1_ps(hit.t);
+    __m256i bestIndex = _mm256_set1_epi32(-1);
+    __m256i bestObject = _mm256_set1_epi32(hit.object);
+
+    for (int i = first; i < first + count; i += 8)
+    {
+        __m256 nx = _mm256_loadu_ps(p.normalX + i);
+        __m256 ny = _mm256_loadu_ps(p.normalY + i);
+        __m256 nz = _mm256_loadu_ps(p.normalZ + i);
+
+        __m256 denominator = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, dx), _mm256_mul_ps(ny, dy)), _mm256_mul_ps(nz, dz));
+        __m256 dotNO = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, ox), _mm256_mul_ps(ny, oy)), _mm256_mul_ps(nz, oz));
+        __m256 numerator = _mm256_xor_ps(_mm256_add_ps(dotNO, _mm256_loadu_ps(p.offset + i)), signBit);
+        __m256 t = _mm256_div_ps(numerator, denominator);
+
+        __m256 notParallel = _mm256_cmp_ps(_mm256_andnot_ps(signBit, denominator), threshold, _CMP_GT_OQ);
+        __m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), laneOffsets);
+        __m256i object = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p.object + i));
+        __m256 valid = _mm256_and_ps(_mm256_and_ps(notParallel, _mm256_cmp_ps(t, zero, _CMP_GE_OQ)),
+                                     _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, index)));
+
+        __m256 closer = _mm256_or_ps(_mm256_cmp_ps(t, bestT, _CMP_LT_OQ),
+                                     _mm256_and_ps(_mm256_cmp_ps(t, bestT, _CMP_EQ_OQ), _mm256_castsi256_ps(_mm256_cmpgt_epi32(bestObject, object))));
+        __m256 take = _mm256_and_ps(valid, closer);
+        __m256i takeInt = _mm256_castps_si256(take);
+
+        bestT = _mm256_blendv_ps(bestT, t, take);
+        bestIndex = _mm256_blendv_epi8(bestIndex, index, takeInt);
+        bestObject = _mm256_blendv_epi8(bestObject, object, takeInt);
+    }
+
+    // No lane found anything closer
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(bestIndex, _mm256_set1_epi32(-1))) == -1)
+        return;
+
+    alignas(32) float laneT[8];
+    alignas(32) int laneIndex[8], laneObject[8];
+    _mm256_store_ps(laneT, bestT);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(laneIndex), bestIndex);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(laneObject), bestObject);
+    reduceLanes(laneT, laneIndex, laneObject, 8, PRIMITIVE_PLANE, hit);
+}
+
+#endif // RT_HAS_AVX2_KERNELS
+
+/////////////////////
+// NEON kernels    //
+/////////////////////
+
+#ifdef RT_HAS_NEON_KERNELS
+
+// Lane state of the NEON kernels: 8 primitives per step as two 4-wide halves
+struct NeonBest
+{
+    float32x4_t t[2];
+    int32x4_t index[2];
+    int32x4_t object[2];
+};
+
+static inline void neonKeepCloser(NeonBest &best, int half, float32x4_t t, uint32x4_t valid, int32x4_t index, int32x4_t object)
+{
+    uint32x4_t closer = vorrq_u32(vcltq_f32(t, best.t[half]),
+                                  vandq_u32(vceqq_f32(t, best.t[half]), vcltq_s32(object, best.object[half])));
+    uint32x4_t take = vandq_u32(valid, closer);
+
+    best.t[half] = vbslq_f32(take, t, best.t[half]);
+    best.index[half] = vbslq_s32(take, index, best.index[half]);
+    best.object[half] = vbslq_s32(take, object, best.object[half]);
+}
+
+static void neonReduce(const NeonBest &best, int type, PrimitiveHit &hit)
+{
+    float laneT[8];
+    int laneIndex[8], laneObject[8];
+    for (int half = 0; half < 2; half++)
+    {
+        vst1q_f32(laneT + 4 * half, best.t[half]);
+        vst1q_s32(laneIndex + 4 * half, best.index[half]);
+        vst1q_s32(laneObject + 4 * half, best.object[half]);
+    }
+    reduceLanes(laneT, laneIndex, laneObject, 8, type, hit);
+}
+
+static void intersectSpheresNEON(const SphereArrays &s, int first, int count, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit)
+{
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_SPHERE, count));
+    float a = direction.x * direction.x + direction.y * direction.y + direction.z * direction.z;
+
+    const float32x4_t ox = vdupq_n_f32(origin.x), oy = vdupq_n_f32(origin.y), oz = vdupq_n_f32(origin.z);
+    const float32x4_t dx = vdupq_n_f32(direction.x), dy = vdupq_n_f32(direction.y), dz = vdupq_n_f32(direction.z);
+    const float32x4_t two = vdupq_n_f32(2.0f);
+    const float32x4_t fourA = vdupq_n_f32(4.0f * a);
+    const float32x4_t twoA = vdupq_n_f32(2.0f * a);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const int32_t offsets[4] = {0, 1, 2, 3};
+    const int32x4_t laneOffsets = vld1q_s32(offsets);
+    const int32x4_t end = vdupq_n_s32(first + count);
+
+    NeonBest best;
+    for (int half = 0; half < 2; half++)
+    {
+        best.t[half] = vdupq_n_f32(hit.t);
+        best.index[half] = vdupq_n_s32(-1);
+        best.object[half] = vdupq_n_s32(hit.object);
+    }
+
+    for (int i = first; i < first + count; i += 8)
+    {
+        for (int half = 0; half < 2; half++)
+        {
+            int j = i + 4 * half;
+            // vmulq/vaddq separately: a fused multiply-add would round differently from the scalar code
+            float32x4_t ocx = vsubq_f32(ox, vld1q_f32(s.centerX + j));
+            float32x4_t ocy = vsubq_f32(oy, vld1q_f32(s.centerY + j));
+            float32x4_t ocz = vsubq_f32(oz, vld1q_f32(s.centerZ + j));
+
+            float32x4_t dotOD = vaddq_f32(vaddq_f32(vmulq_f32(ocx, dx), vmulq_f32(ocy, dy)), vmulq_f32(ocz, dz));
+            float32x4_t dotOO = vaddq_f32(vaddq_f32(vmulq_f32(ocx, ocx), vmulq_f32(ocy, ocy)), vmulq_f32(ocz, ocz));
+            float32x4_t b = vmulq_f32(two, dotOD);
+            float32x4_t c = vsubq_f32(dotOO, vld1q_f32(s.radius2 + j));
+            float32x4_t discriminant = vsubq_f32(vmulq_f32(b, b), vmulq_f32(fourA, c));
+
+            // Most spheres are missed, skip the square root and divisions when all 4 are
+            if (vmaxvq_u32(vcgeq_f32(discriminant, zero)) == 0)
+                continue;
+
+            float32x4_t sqrtDiscriminant = vsqrtq_f32(discriminant);
+            float32x4_t minusB = vnegq_f32(b);
+            float32x4_t t1 = vdivq_f32(vsubq_f32(minusB, sqrtDiscriminant), twoA);
+            float32x4_t t2 = vdivq_f32(vaddq_f32(minusB, sqrtDiscriminant), twoA);
+            float32x4_t t = vbslq_f32(vcgeq_f32(t1, zero), t1, t2);
+
+            int32x4_t index = vaddq_s32(vdupq_n_s32(j), laneOffsets);
+            uint32x4_t valid = vandq_u32(vcgeq_f32(t, zero), vcltq_s32(index, end));
+            neonKeepCloser(best, half, t, valid, index, vld1q_s32(s.object + j));
+        }
+    }
+
+    neonReduce(best, PRIMITIVE_SPHERE, hit);
+}
+
+static void intersectPlanesNEON(const PlaneArrays &p, int first, int count, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit)
+{
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_PLANE, count));
+    const float32x4_t ox = vdupq_n_f32(origin.x), oy = vdupq_n_f32(origin.y), oz = vdupq_n_f32(origin.z);
+    const float32x4_t dx = vdupq_n_f32(direction.x), dy = vdupq_n_f32(direction.y), dz = vdupq_n_f32(direction.z);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t threshold = vdupq_n_f32(PARALLEL_THRESHOLD);
+    const int32_t offsets[4] = {0, 1, 2, 3};
+    const int32x4_t laneOffsets = vld1q_s32(offsets);
+    const int32x4_t end = vdupq_n_s32(first + count);
+
+    NeonBest best;
+    for (int half = 0; half < 2; half++)
+    {
+        best.t[half] = vdupq_n_f32(hit.t);
+        best.index[half] = vdupq_n_s32(-1);
+        best.object[half] = vdupq_n_s32(hit.object);
+    }
+
+    for (int i = first; i < first + count; i += 8)
+    {
+        for (int half = 0; half < 2; half++)
+        {
+            int j = i + 4 * half;
+            float32x4_t nx = vld1q_f32(p.normalX + j);
+            float32x4_t ny = vld1q_f32(p.normalY + j);
+            float32x4_t nz = vld1q_f32(p.normalZ + j);
+
+            float32x4_t denominator = vaddq_f32(vaddq_f32(vmulq_f32(nx, dx), vmulq_f32(ny, dy)), vmulq_f32(nz, dz));
+            float32x4_t dotNO = vaddq_f32(vaddq_f32(vmulq_f32(nx, ox), vmulq_f32(ny, oy)), vmulq_f32(nz, oz));
+            float32x4_t numerator = vnegq_f32(vaddq_f32(dotNO, vld1q_f32(p.offset + j)));
+            float32x4_t t = vdivq_f32(numerator, denominator);
+
+            int32x4_t index = vaddq_s32(vdupq_n_s32(j), laneOffsets);
+            uint32x4_t valid = vandq_u32(vandq_u32(vcgtq_f32(vabsq_f32(denominator), threshold), vcgeq_f32(t, zero)),
+                                         vcltq_s32(index, end));
+            neonKeepCloser(best, half, t, valid, index, vld1q_s32(p.object + j));
+        }
+    }
+
+    neonReduce(best, PRIMITIVE_PLANE, hit);
+}
+
+#endif // RT_HAS_NEON_KERNELS
+
+/////////////////////
+// Dispatch        //
+/////////////////////
+
+static const IntersectKernels SCALAR_KERNELS = {"scalar", 1, intersectSpheresScalar, intersectPlanesScalar};
+#ifdef RT_HAS_AVX2_KERNELS
+static const IntersectKernels AVX2_KERNELS = {"avx2", 8, intersectSpheresAVX2, intersectPlanesAVX2};
+#endif
+#ifdef RT_HAS_NEON_KERNELS
+static const IntersectKernels NEON_KERNELS = {"neon", 8, intersectSpheresNEON, intersectPlanesNEON};
+#endif
+
+static const IntersectKernels *findKernels(const std::string &name)
+{
+    if (name == "scalar")
+        return &SCALAR_KERNELS;
+#ifdef RT_HAS_AVX2_KERNELS
+    if (name == "avx2" && __builtin_cpu_supports("avx2"))
+        return &AVX2_KERNELS;
+#endif
+#ifdef RT_HAS_NEON_KERNELS
+    if (name == "neon")
+        return &NEON_KERNELS; // NEON is part of every AArch64 CPU
+#endif
+    return nullptr;
+}
+
+static const IntersectKernels *detectKernels()
+{
+    const IntersectKernels *kernels = findKernels("avx2");
+    if (!kernels)
+        kernels = findKernels("neon");
+    return kernels ? kernels : &SCALAR_KERNELS;
+}
+
+static std::atomic<const IntersectKernels *> activeKernels{nullptr};
+
+const IntersectKernels &getIntersectKernels()
+{
+    const IntersectKernels *kernels = activeKernels.load(std::memory_order_acquire);
+    if (!kernels)
+    {
+        kernels = detectKernels();
+        activeKernels.store(kernels, std::memory_order_release);
+    }
+    return *kernels;
+}
+
+bool selectIntersectKernels(const std::string &name)
+{
+    const IntersectKernels *kernels = findKernels(name);
+    if (!kernels)
+        return false;
+    activeKernels.store(kernels, std::memory_order_release);
+    return true;
+}
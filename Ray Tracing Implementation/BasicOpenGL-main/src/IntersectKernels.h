@@ -0,0 +1,49 @@
+#ifndef INTERSECT_KERNELS_H
+#define INTERSECT_KERNELS_H
+
+#include <glm/glm.hpp>
+#include <string>
+#include "CompiledScene.h"
+
+// Ray vs. many primitives kernels.
+// The SIMD kernels test one ray against 8 spheres (or planes) per step and keep
+// the closest hit per lane with blends instead of branches. All kernels use the
+// same arithmetic as Sphere::Intersect / Plane::Intersect, so every kernel
+// returns the same hit bit for bit.
+//
+// The arrays must be readable 8 entries past the last primitive (CompiledScene
+// pads them with dead entries).
+
+struct SphereArrays
+{
+    const float *centerX, *centerY, *centerZ, *radius2;
+    const int *object;
+};
+
+struct PlaneArrays
+{
+    const float *normalX, *normalY, *normalZ, *offset;
+    const int *object;
+};
+
+// Replace hit if one of the primitives [first, first + count) is hit closer
+// (on a tie the lower object index wins)
+typedef void (*SphereKernel)(const SphereArrays &spheres, int first, int count, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit);
+typedef void (*PlaneKernel)(const PlaneArrays &planes, int first, int count, const glm::vec3 &origin, const glm::vec3 &direction, PrimitiveHit &hit);
+
+struct IntersectKernels
+{
+    const char *name;
+    int width; // primitives per step
+    SphereKernel intersectSpheres;
+    PlaneKernel intersectPlanes;
+};
+
+// Kernels in use, by default the widest ones this CPU supports
+const IntersectKernels &getIntersectKernels();
+
+// Forces a kernel set: "scalar", "avx2" or "neon". Returns false if this CPU or
+// build does not have it.
+bool selectIntersectKernels(const std::string &name);
+
+#endif // INTERSECT_KERNELS_H
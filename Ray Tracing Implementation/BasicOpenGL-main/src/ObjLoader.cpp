@@ -0,0 +1,201 @@
+#include "ObjLoader.h"
+
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+
+static const size_t BLOCK_SIZE = 1 << 20;
+
+static bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static const char *skipBlanks(const char *p, const char *end)
+{
+    while (p < end && isBlank(*p))
+        p++;
+    return p;
+}
+
+// The rest of the line without surrounding blanks (names, file names)
+static std::string restOfLine(const char *p, const char *end)
+{
+    p = skipBlanks(p, end);
+    while (end > p && isBlank(end[-1]))
+        end--;
+    return std::string(p, end);
+}
+
+static void parseFloats(const char *p, const char *end, float *values, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        p = skipBlanks(p, end);
+        if (p < end && *p == '+')
+            p++;
+        std::from_chars_result result = std::from_chars(p, end, values[i]);
+        if (result.ec != std::errc())
+            values[i] = 0.0f;
+        else
+            p = result.ptr;
+    }
+}
+
+// Calls onLine(begin, end) for every line of the file, reading one block at a time
+template <typename LineFn>
+static void forEachLine(const std::string &filename, LineFn &&onLine)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+        throw std::runtime_error("Failed to open " + filename);
+
+    std::vector<char> buffer(BLOCK_SIZE);
+    size_t kept = 0; // start of a line carried over from the previous block
+    while (true)
+    {
+        file.read(buffer.data() + kept, buffer.size() - kept);
+        bool endOfFile = static_cast<size_t>(file.gcount()) < buffer.size() - kept;
+        const char *line = buffer.data();
+        const char *end = line + kept + file.gcount();
+
+        while (const char *lineEnd = static_cast<const char *>(std::memchr(line, '\n', end - line)))
+        {
+            onLine(line, lineEnd);
+            line = lineEnd + 1;
+        }
+        if (endOfFile)
+        {
+            if (line < end)
+                onLine(line, end);
+            return;
+        }
+
+        kept = end - line;
+        std::memmove(buffer.data(), line, kept);
+        if (kept == buffer.size()) // one line longer than the block
+            buffer.resize(2 * buffer.size());
+    }
+}
+
+static bool isToken(const char *begin, const char *end, const char *token)
+{
+    size_t length = std::strlen(token);
+    return static_cast<size_t>(end - begin) == length && std::memcmp(begin, token, length) == 0;
+}
+
+static void loadMtl(const std::string &filename, TriangleMesh &mesh, std::unordered_map<std::string, int> &materialIndex)
+{
+    forEachLine(filename, [&](const char *line, const char *end)
+                {
+        const char *token = skipBlanks(line, end);
+        const char *tokenEnd = token;
+        while (tokenEnd < end && !isBlank(*tokenEnd))
+            tokenEnd++;
+
+        if (isToken(token, tokenEnd, "newmtl"))
+        {
+            MeshMaterial material;
+            material.name = restOfLine(tokenEnd, end);
+            materialIndex[material.name] = static_cast<int>(mesh.materials.size());
+            mesh.materials.push_back(material);
+        }
+        else if (mesh.materials.empty())
+            return;
+        else if (isToken(token, tokenEnd, "Kd"))
+            parseFloats(tokenEnd, end, &mesh.materials.back().color[0], 3);
+        else if (isToken(token, tokenEnd, "Ns"))
+            parseFloats(tokenEnd, end, &mesh.materials.back().shininess, 1); });
+}
+
+std::shared_ptr<TriangleMesh> loadObj(const std::string &filename)
+{
+    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>();
+    std::filesystem::path directory = std::filesystem::path(filename).parent_path();
+
+    // Rough guess for the buffers: about 30 bytes per line, a third of them vertices
+    std::error_code error;
+    uintmax_t fileSize = std::filesystem::file_size(filename, error);
+    if (!error)
+    {
+        mesh->vertices.reserve(fileSize / 90);
+        mesh->indices.reserve(fileSize / 15);
+        mesh->faceMaterials.reserve(fileSize / 45);
+    }
+
+    std::unordered_map<std::string, int> materialIndex;
+    int currentMaterial = -1;
+    std::vector<int> polygon;
+    long long lineNumber = 0;
+
+    forEachLine(filename, [&](const char *line, const char *end)
+                {
+        lineNumber++;
+        const char *token = skipBlanks(line, end);
+        const char *tokenEnd = token;
+        while (tokenEnd < end && !isBlank(*tokenEnd))
+            tokenEnd++;
+
+        if (isToken(token, tokenEnd, "v"))
+        {
+            glm::vec3 vertex;
+            parseFloats(tokenEnd, end, &vertex[0], 3);
+            mesh->vertices.push_back(vertex);
+        }
+        else if (isToken(token, tokenEnd, "f"))
+        {
+            // Each corner is v, v/vt, v//vn or v/vt/vn; only v is used
+            polygon.clear();
+            const char *p = tokenEnd;
+            while ((p = skipBlanks(p, end)) < end)
+            {
+                int index = 0;
+                std::from_chars_result result = std::from_chars(p, end, index);
+                if (result.ec != std::errc() || index == 0)
+                    throw std::runtime_error(filename + ":" + std::to_string(lineNumber) + ": bad face index");
+                // Negative indices count back from the last vertex read so far
+                polygon.push_back(index > 0 ? index - 1 : static_cast<int>(mesh->vertices.size()) + index);
+                p = result.ptr;
+                while (p < end && !isBlank(*p))
+                    p++;
+            }
+            for (size_t i = 2; i < polygon.size(); i++)
+            {
+                mesh->indices.push_back(polygon[0]);
+                mesh->indices.push_back(polygon[i - 1]);
+                mesh->indices.push_back(polygon[i]);
+                mesh->faceMaterials.push_back(currentMaterial);
+            }
+        }
+        else if (isToken(token, tokenEnd, "usemtl"))
+        {
+            auto found = materialIndex.find(restOfLine(tokenEnd, end));
+            currentMaterial = found != materialIndex.end() ? found->second : -1;
+        }
+        else if (isToken(token, tokenEnd, "mtllib"))
+        {
+            std::string library = (directory / restOfLine(tokenEnd, end)).string();
+            try
+            {
+                loadMtl(library, *mesh, materialIndex);
+            }
+            catch (const std::runtime_error &e)
+            {
+                std::cerr << filename << ": " << e.what() << ", faces keep the object material" << std::endl;
+            }
+        } });
+
+    // Positive indices may point at vertices defined later, so check at the end
+    int numVertices = static_cast<int>(mesh->vertices.size());
+    for (int index : mesh->indices)
+    {
+        if (index < 0 || index >= numVertices)
+            throw std::runtime_error(filename + ": face index " + std::to_string(index + 1) + " is out of range");
+    }
+
+    return mesh;
+}
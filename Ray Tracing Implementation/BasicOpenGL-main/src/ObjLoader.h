@@ -0,0 +1,15 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include <memory>
+#include <string>
+#include "TriangleMesh.h"
+
+// Wavefront OBJ reader. The file is streamed in blocks, so memory use is the
+// mesh itself plus one block. Reads v, f (any of the v, v/vt, v//vn, v/vt/vn
+// forms, negative indices, polygons are split into fans), usemtl and mtllib
+// (newmtl, Kd, Ns); everything else is skipped.
+// Throws std::runtime_error if the file cannot be read or a face index is invalid.
+std::shared_ptr<TriangleMesh> loadObj(const std::string &filename);
+
+#endif // OBJ_LOADER_H
@@ -0,0 +1,84 @@
+#include "RayPacket.h"
+
+bool Frustum::build(const RayPacket &packet)
+{
+    if (packet.count == 0)
+        return false;
+
+    origin = packet.origin;
+
+    glm::vec3 sum(0.0f);
+    for (int i = 0; i < packet.count; i++)
+        sum += packet.directions[i];
+    if (glm::dot(sum, sum) == 0.0f)
+        return false;
+    axis = glm::normalize(sum);
+
+    // Basis of the plane perpendicular to the axis
+    glm::vec3 helper = glm::abs(axis.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 u = glm::normalize(glm::cross(axis, helper));
+    glm::vec3 v = glm::cross(axis, u);
+
+    // Bound the points where the rays cross the plane at distance 1 along the axis
+    float uMin = std::numeric_limits<float>::infinity(), uMax = -uMin;
+    float vMin = uMin, vMax = -uMin;
+    for (int i = 0; i < packet.count; i++)
+    {
+        float along = glm::dot(packet.directions[i], axis);
+        if (along < 0.1f)
+            return false; // more than ~84 degrees off the axis
+
+        glm::vec3 p = packet.directions[i] / along;
+        float pu = glm::dot(p, u), pv = glm::dot(p, v);
+        uMin = glm::min(uMin, pu);
+        uMax = glm::max(uMax, pu);
+        vMin = glm::min(vMin, pv);
+        vMax = glm::max(vMax, pv);
+    }
+
+    // Widen a little so rays on the boundary stay inside despite rounding
+    float margin = 1e-4f * (1.0f + (uMax - uMin) + (vMax - vMin));
+    uMin -= margin;
+    uMax += margin;
+    vMin -= margin;
+    vMax += margin;
+
+    glm::vec3 corners[4] = {
+        axis + uMin * u + vMin * v,
+        axis + uMax * u + vMin * v,
+        axis + uMax * u + vMax * v,
+        axis + uMin * u + vMax * v,
+    };
+    glm::vec3 center = axis + 0.5f * (uMin + uMax) * u + 0.5f * (vMin + vMax) * v;
+
+    for (int i = 0; i < 4; i++)
+    {
+        glm::vec3 normal = glm::cross(corners[i], corners[(i + 1) % 4]);
+        if (glm::dot(normal, center) < 0.0f)
+            normal = -normal;
+        normals[i] = normal;
+    }
+    normals[4] = axis;
+
+    return true;
+}
+
+bool Frustum::intersects(const AABB &box) const
+{
+    for (const glm::vec3 &normal : normals)
+    {
+        // The box corner furthest along the normal
+        glm::vec3 positive(normal.x >= 0.0f ? box.max.x : box.min.x,
+                           normal.y >= 0.0f ? box.max.y : box.min.y,
+                           normal.z >= 0.0f ? box.max.z : box.min.z);
+        if (glm::dot(normal, positive - origin) < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+float distanceToBox(const glm::vec3 &point, const AABB &box)
+{
+    glm::vec3 outside = glm::max(glm::max(box.min - point, point - box.max), glm::vec3(0.0f));
+    return glm::length(outside);
+}
@@ -0,0 +1,39 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <glm/glm.hpp>
+#include "BVH.h"
+
+// A bundle of coherent rays with a common origin, e.g. the primary rays of an
+// 8x8 block of pixels. Directions must be normalized.
+struct RayPacket
+{
+    static const int MAX_RAYS = 64;
+
+    glm::vec3 origin;
+    glm::vec3 directions[MAX_RAYS];
+    int count = 0;
+};
+
+// Pyramid with its apex at the packet origin that contains every ray of the
+// packet: four side planes plus a near plane through the origin. A box outside
+// the frustum cannot be hit by any ray of the packet.
+class Frustum
+{
+public:
+    // Returns false when the rays spread too far apart to be bounded this way
+    bool build(const RayPacket &packet);
+
+    // Conservative: may keep some boxes that no ray hits, never drops one that is hit
+    bool intersects(const AABB &box) const;
+
+    glm::vec3 origin;
+    glm::vec3 axis;       // mean direction of the packet
+    glm::vec3 normals[5]; // inward normals, the last one is the near plane
+};
+
+// Smallest distance from point to box (0 inside). A ray with a normalized
+// direction cannot hit anything in the box before this distance.
+float distanceToBox(const glm::vec3 &point, const AABB &box);
+
+#endif // RAY_PACKET_H
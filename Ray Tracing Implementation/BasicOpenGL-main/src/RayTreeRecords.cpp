@@ -0,0 +1,91 @@
+#include "RayTreeRecords.h"
+#include "BVH.h"
+#include "Scene.h"
+#include "SceneDiff.h"
+
+thread_local std::vector<RayRecord> *RayTreeRecording::current = nullptr;
+
+bool RayTreeRecords::matches(int width, int height, int tileSize) const
+{
+    return !tiles.empty() && this->width == width && this->height == height && this->tileSize == tileSize;
+}
+
+size_t RayTreeRecords::numRecords() const
+{
+    size_t count = 0;
+    for (const Tile &tile : tiles)
+        count += tile.records.size();
+    return count;
+}
+
+bool RayTreeRecords::isDirty(const Tile &tile, int x, int y, const SceneChanges &changes)
+{
+    int pixel = tile.pixelIndex(x, y);
+    for (int i = tile.first[pixel]; i < tile.first[pixel + 1]; i++)
+    {
+        const RayRecord &record = tile.records[i];
+
+        if (record.light < 0)
+        {
+            // A new material or place of the object changes the color of the rays that hit it
+            if (record.object >= 0 && (changes.materialChanged[record.object] || changes.objectMoved[record.object]))
+                return true;
+        }
+        else
+        {
+            if (changes.lightMoved[record.light])
+                return true;
+            // Only the intensity of unblocked lights shows
+            if (changes.intensityChanged[record.light] && record.object < 0 && record.tMax >= 0.0f)
+                return true;
+            // The material of a blocker does not matter, its place does. A blocker
+            // that stays where it is keeps the ray blocked, whatever else moves.
+            if (record.object >= 0)
+            {
+                if (changes.objectMoved[record.object])
+                    return true;
+                continue;
+            }
+        }
+
+        // A moved object may now be in front of what the ray hit or reached
+        if (record.tMax < 0.0f)
+            continue;
+        glm::vec3 invDirection = safeInverse(record.direction);
+        for (int object : changes.movedObjects)
+        {
+            float tEntry;
+            if (changes.movedBounds[object].intersect(record.origin, invDirection, record.tMax, tEntry))
+                return true;
+        }
+    }
+    return false;
+}
+
+RayTreeRecording::RayTreeRecording(std::vector<RayRecord> &records) : previous(current)
+{
+    current = &records;
+}
+
+RayTreeRecording::~RayTreeRecording()
+{
+    current = previous;
+}
+
+void RayTreeRecording::recordRay(const Ray &ray, float tMax, int object)
+{
+    if (current)
+        current->push_back({ray.origin, ray.direction, tMax, object, -1});
+}
+
+void RayTreeRecording::recordShadowRay(const Ray &ray, float tMax, int blocker, int light)
+{
+    if (current)
+        current->push_back({ray.origin, ray.direction, tMax, blocker, light});
+}
+
+void RayTreeRecording::recordOutsideCone(int light)
+{
+    if (current)
+        current->push_back({glm::vec3(0.0f), glm::vec3(0.0f), -1.0f, -1, light});
+}
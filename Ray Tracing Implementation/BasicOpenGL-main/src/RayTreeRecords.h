@@ -0,0 +1,70 @@
+#ifndef RAY_TREE_RECORDS_H
+#define RAY_TREE_RECORDS_H
+
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+
+class Ray;
+struct SceneChanges;
+
+// One ray of a pixel's ray tree
+struct RayRecord
+{
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float tMax;  // hit distance (infinity for a miss), light distance for shadow rays, -1 outside a spotlight cone
+    int object;  // object hit, or blocking the shadow ray; -1 for none
+    int light;   // shadow rays: the light, -1 for camera, reflected and refracted rays
+};
+
+// What the rays of every pixel touched in the last render, for re-tracing only
+// the pixels an edit of the scene can change (see Renderer::Rerender). Stored
+// per render tile, so tiles can be recorded and rewritten in parallel.
+class RayTreeRecords
+{
+public:
+    struct Tile
+    {
+        int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+        std::vector<int> first; // first record of every pixel (row-major), plus the end
+        std::vector<RayRecord> records;
+
+        int pixelIndex(int x, int y) const { return (y - y0) * (x1 - x0) + (x - x0); }
+    };
+
+    int width = 0;
+    int height = 0;
+    int tileSize = 0; // 0 => the whole frame is one tile (serial render)
+    std::vector<Tile> tiles;
+
+    void clear() { width = height = tileSize = 0; tiles.clear(); }
+    bool matches(int width, int height, int tileSize) const;
+    size_t numRecords() const;
+
+    // True if a change can alter the color of pixel (x, y) of tile
+    static bool isDirty(const Tile &tile, int x, int y, const SceneChanges &changes);
+};
+
+// Phong reports the rays it traces while a recording is active on the thread.
+// Without one every hook is a single test of a thread-local pointer.
+class RayTreeRecording
+{
+public:
+    explicit RayTreeRecording(std::vector<RayRecord> &records);
+    ~RayTreeRecording();
+
+    RayTreeRecording(const RayTreeRecording &) = delete;
+    RayTreeRecording &operator=(const RayTreeRecording &) = delete;
+
+    static bool isActive() { return current != nullptr; }
+    static void recordRay(const Ray &ray, float tMax, int object);
+    static void recordShadowRay(const Ray &ray, float tMax, int blocker, int light);
+    static void recordOutsideCone(int light);
+
+private:
+    static thread_local std::vector<RayRecord> *current;
+    std::vector<RayRecord> *previous;
+};
+
+#endif // RAY_TREE_RECORDS_H
@@ -0,0 +1,328 @@
+#include "RenderStats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace
+{
+    // Only the owning thread writes its counters, other threads only read them,
+    // so plain relaxed loads and stores are enough (no locked increments).
+    struct ThreadCounters
+    {
+        std::atomic<uint64_t> cameraRays{0};
+        std::atomic<uint64_t> secondaryRays{0};
+        std::atomic<uint64_t> shadowRays{0};
+        std::atomic<uint64_t> occluderCacheHits{0};
+#ifdef RT_RENDER_COUNTERS
+        std::atomic<uint64_t> reflectionRays{0};
+        std::atomic<uint64_t> refractionRays{0};
+        std::atomic<uint64_t> coneRejections{0};
+        std::atomic<uint64_t> intersectionTests[RenderStats::PRIMITIVE_TYPES] = {};
+        std::atomic<uint64_t> pathDepths[RenderStats::DEPTH_BINS] = {};
+        std::atomic<uint64_t> stageNanoseconds[RENDER_STAGE_COUNT] = {};
+
+        // Stage timers, used by the owning thread only
+        int stage = -1;
+        uint64_t stageStart = 0; // threadCpuNanoseconds() at the last switch
+#endif
+
+        ThreadCounters();
+        ~ThreadCounters();
+
+        RenderStats snapshot() const
+        {
+            RenderStats stats;
+            stats.cameraRays = cameraRays.load(std::memory_order_relaxed);
+            stats.secondaryRays = secondaryRays.load(std::memory_order_relaxed);
+            stats.shadowRays = shadowRays.load(std::memory_order_relaxed);
+            stats.occluderCacheHits = occluderCacheHits.load(std::memory_order_relaxed);
+#ifdef RT_RENDER_COUNTERS
+            stats.reflectionRays = reflectionRays.load(std::memory_order_relaxed);
+            stats.refractionRays = refractionRays.load(std::memory_order_relaxed);
+            stats.coneRejections = coneRejections.load(std::memory_order_relaxed);
+            for (int i = 0; i < RenderStats::PRIMITIVE_TYPES; i++)
+                stats.intersectionTests[i] = intersectionTests[i].load(std::memory_order_relaxed);
+            for (int i = 0; i < RenderStats::DEPTH_BINS; i++)
+                stats.pathDepths[i] = pathDepths[i].load(std::memory_order_relaxed);
+            for (int i = 0; i < RENDER_STAGE_COUNT; i++)
+                stats.stageNanoseconds[i] = stageNanoseconds[i].load(std::memory_order_relaxed);
+#endif
+            return stats;
+        }
+    };
+
+    struct Registry
+    {
+        std::mutex mutex;
+        std::vector<ThreadCounters *> threads;
+        RenderStats exited; // totals of threads that are gone
+    };
+
+    Registry &registry()
+    {
+        // Never destroyed, threads may still exit after static destruction has begun
+        static Registry *instance = new Registry();
+        return *instance;
+    }
+
+    ThreadCounters::ThreadCounters()
+    {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.threads.push_back(this);
+    }
+
+    ThreadCounters::~ThreadCounters()
+    {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.exited += snapshot();
+        r.threads.erase(std::find(r.threads.begin(), r.threads.end(), this));
+    }
+
+    thread_local ThreadCounters counters;
+
+    void increment(std::atomic<uint64_t> &counter, uint64_t amount = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+#ifdef RT_RENDER_COUNTERS
+    // CPU time of the calling thread. Unlike a wall clock it stops while the
+    // thread is preempted, so threads sharing a core are not charged twice.
+    uint64_t threadCpuNanoseconds()
+    {
+#ifdef _WIN32
+        FILETIME creation, exit, kernel, user;
+        GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+        uint64_t ticks = (static_cast<uint64_t>(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) +
+                         (static_cast<uint64_t>(user.dwHighDateTime) << 32 | user.dwLowDateTime);
+        return ticks * 100; // 100 ns ticks
+#else
+        timespec now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+#endif
+    }
+
+    // Charges the CPU time since the last switch to the running stage, if any
+    void switchStage(ThreadCounters &c, int stage)
+    {
+        uint64_t now = threadCpuNanoseconds();
+        if (c.stage >= 0)
+            increment(c.stageNanoseconds[c.stage], now - c.stageStart);
+        c.stage = stage;
+        c.stageStart = now;
+    }
+#endif
+}
+
+const char *renderStageName(int stage)
+{
+    static const char *const names[RENDER_STAGE_COUNT] = {"parse", "build", "trace", "resolve", "save"};
+    return stage >= 0 && stage < RENDER_STAGE_COUNT ? names[stage] : "unknown";
+}
+
+double RenderStats::occluderCacheHitRate() const
+{
+    return shadowRays == 0 ? 0.0 : static_cast<double>(occluderCacheHits) / static_cast<double>(shadowRays);
+}
+
+RenderStats &RenderStats::operator+=(const RenderStats &other)
+{
+    cameraRays += other.cameraRays;
+    secondaryRays += other.secondaryRays;
+    shadowRays += other.shadowRays;
+    occluderCacheHits += other.occluderCacheHits;
+#ifdef RT_RENDER_COUNTERS
+    reflectionRays += other.reflectionRays;
+    refractionRays += other.refractionRays;
+    coneRejections += other.coneRejections;
+    for (int i = 0; i < PRIMITIVE_TYPES; i++)
+        intersectionTests[i] += other.intersectionTests[i];
+    for (int i = 0; i < DEPTH_BINS; i++)
+        pathDepths[i] += other.pathDepths[i];
+    for (int i = 0; i < RENDER_STAGE_COUNT; i++)
+        stageNanoseconds[i] += other.stageNanoseconds[i];
+#endif
+    return *this;
+}
+
+RenderStats RenderStats::operator-(const RenderStats &other) const
+{
+    RenderStats stats;
+    stats.cameraRays = cameraRays - other.cameraRays;
+    stats.secondaryRays = secondaryRays - other.secondaryRays;
+    stats.shadowRays = shadowRays - other.shadowRays;
+    stats.occluderCacheHits = occluderCacheHits - other.occluderCacheHits;
+#ifdef RT_RENDER_COUNTERS
+    stats.reflectionRays = reflectionRays - other.reflectionRays;
+    stats.refractionRays = refractionRays - other.refractionRays;
+    stats.coneRejections = coneRejections - other.coneRejections;
+    for (int i = 0; i < PRIMITIVE_TYPES; i++)
+        stats.intersectionTests[i] = intersectionTests[i] - other.intersectionTests[i];
+    for (int i = 0; i < DEPTH_BINS; i++)
+        stats.pathDepths[i] = pathDepths[i] - other.pathDepths[i];
+    for (int i = 0; i < RENDER_STAGE_COUNT; i++)
+        stats.stageNanoseconds[i] = stageNanoseconds[i] - other.stageNanoseconds[i];
+#endif
+    return stats;
+}
+
+void countCameraRay()
+{
+    increment(counters.cameraRays);
+}
+
+void countSecondaryRay()
+{
+    increment(counters.secondaryRays);
+}
+
+void countShadowRay()
+{
+    increment(counters.shadowRays);
+}
+
+void countOccluderCacheHit()
+{
+    increment(counters.occluderCacheHits);
+}
+
+#ifdef RT_RENDER_COUNTERS
+void countReflectionRay()
+{
+    increment(counters.reflectionRays);
+}
+
+void countRefractionRay()
+{
+    increment(counters.refractionRays);
+}
+
+void countConeRejection()
+{
+    increment(counters.coneRejections);
+}
+
+void countIntersectionTests(int primitiveType, int count)
+{
+    increment(counters.intersectionTests[primitiveType], static_cast<uint64_t>(count));
+}
+
+void countPathDepth(int level)
+{
+    increment(counters.pathDepths[std::min(level, RenderStats::DEPTH_BINS - 1)]);
+}
+
+RenderStageTimer::RenderStageTimer(RenderStage stage) : previous(counters.stage)
+{
+    switchStage(counters, stage);
+}
+
+RenderStageTimer::~RenderStageTimer()
+{
+    switchStage(counters, previous);
+}
+#endif
+
+RenderStats threadRenderStats()
+{
+    return counters.snapshot();
+}
+
+// Sum of what the measures finished on this thread took (a nested measure is part of the one around it)
+static thread_local RenderStats measuredOnThread;
+
+RenderStatsAccumulator::MeasureStart RenderStatsAccumulator::beginMeasure()
+{
+    return {threadRenderStats(), measuredOnThread};
+}
+
+void RenderStatsAccumulator::endMeasure(const MeasureStart &start)
+{
+    RenderStats counted = threadRenderStats() - start.counted;
+    add(counted - (measuredOnThread - start.measured));
+    measuredOnThread = start.measured;
+    measuredOnThread += counted;
+}
+
+void RenderStatsAccumulator::add(const RenderStats &stats)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    sum += stats;
+}
+
+RenderStats RenderStatsAccumulator::total() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return sum;
+}
+
+void RenderStatsAccumulator::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    sum = RenderStats();
+}
+
+RenderStats collectRenderStats()
+{
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    RenderStats total = r.exited;
+    for (const ThreadCounters *thread : r.threads)
+        total += thread->snapshot();
+    return total;
+}
+
+bool writeRenderStatsJson(const std::string &filename, const RenderStats &stats)
+{
+    std::ofstream out(filename);
+    out << "{\n";
+#ifdef RT_RENDER_COUNTERS
+    out << "  \"counters\": true,\n";
+#else
+    out << "  \"counters\": false,\n";
+#endif
+    out << "  \"rays\": {\"primary\": " << stats.cameraRays << ", \"shadow\": " << stats.shadowRays
+        << ", \"reflection\": " << stats.reflectionRays << ", \"refraction\": " << stats.refractionRays
+        << ", \"secondary\": " << stats.secondaryRays << "},\n";
+    out << "  \"occluder_cache_hits\": " << stats.occluderCacheHits << ",\n";
+    out << "  \"spotlight_cone_rejections\": " << stats.coneRejections << ",\n";
+    out << "  \"intersection_tests\": {\"sphere\": " << stats.intersectionTests[0] << ", \"plane\": " << stats.intersectionTests[1]
+        << ", \"triangle\": " << stats.intersectionTests[2] << "},\n";
+
+    // Bins past the deepest level reached are left out
+    int depths = RenderStats::DEPTH_BINS;
+    while (depths > 1 && stats.pathDepths[depths - 1] == 0)
+        depths--;
+    out << "  \"depth_histogram\": [";
+    for (int i = 0; i < depths; i++)
+        out << (i > 0 ? ", " : "") << stats.pathDepths[i];
+    out << "],\n";
+
+    out << "  \"stage_seconds\": {";
+    for (int i = 0; i < RENDER_STAGE_COUNT; i++)
+        out << (i > 0 ? ", " : "") << "\"" << renderStageName(i) << "\": " << stats.stageNanoseconds[i] * 1e-9;
+    out << "}\n}\n";
+    return static_cast<bool>(out);
+}
+
+std::string renderStatsFile(const std::string &imageFile)
+{
+    size_t slash = imageFile.find_last_of("/\\");
+    size_t dot = imageFile.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return imageFile + ".stats.json";
+    return imageFile.substr(0, dot) + ".stats.json";
+}
@@ -0,0 +1,134 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Stages of a frame for the stage timers. The times are exclusive (a stage
+// started inside another one stops the clock of the outer one) and are the CPU
+// time of each thread summed over all threads, so a stage spread over N busy
+// cores takes about N times its wall time and preempted threads add nothing.
+enum RenderStage
+{
+    STAGE_PARSE = 0,   // reading scene files
+    STAGE_BUILD = 1,   // building or refitting the acceleration structure
+    STAGE_TRACE = 2,   // tiles and wavefront stages
+    STAGE_RESOLVE = 3, // sums to 8-bit pixels
+    STAGE_SAVE = 4,    // writing images
+    RENDER_STAGE_COUNT = 5
+};
+
+const char *renderStageName(int stage);
+
+// Counters collected while rendering. Every thread counts into its own copy
+// (no shared cache lines on the hot path); collectRenderStats adds them up.
+//
+// The counters below the first four are only counted in builds with
+// RT_RENDER_COUNTERS defined (make COUNTERS=1) and stay 0 otherwise; without
+// it the RENDER_COUNTER and RENDER_STAGE macros compile to nothing.
+struct RenderStats
+{
+    static const int PRIMITIVE_TYPES = 3; // sphere, plane, triangle as in PrimitiveType
+    static const int DEPTH_BINS = 16;     // the last bin also holds all deeper rays
+
+    uint64_t cameraRays = 0;        // primary rays, i.e. samples taken
+    uint64_t secondaryRays = 0;     // reflected and refracted rays
+    uint64_t shadowRays = 0;        // Scene::Occluded queries
+    uint64_t occluderCacheHits = 0; // shadow rays blocked by the cached last occluder of their light
+
+    uint64_t reflectionRays = 0;
+    uint64_t refractionRays = 0;
+    uint64_t coneRejections = 0;                      // shadow rays not traced: the point is outside a spotlight cone
+    uint64_t intersectionTests[PRIMITIVE_TYPES] = {}; // ray-primitive tests, by PrimitiveType
+    uint64_t pathDepths[DEPTH_BINS] = {};             // camera, reflected and refracted rays by bounce level
+    uint64_t stageNanoseconds[RENDER_STAGE_COUNT] = {};
+
+    // Fraction of shadow rays answered by the occluder cache alone
+    double occluderCacheHitRate() const;
+
+    RenderStats &operator+=(const RenderStats &other);
+    RenderStats operator-(const RenderStats &other) const;
+};
+
+void countCameraRay();
+void countSecondaryRay();
+void countShadowRay();
+void countOccluderCacheHit();
+
+#ifdef RT_RENDER_COUNTERS
+void countReflectionRay();
+void countRefractionRay();
+void countConeRejection();
+void countIntersectionTests(int primitiveType, int count);
+void countPathDepth(int level);
+
+// Charges the time until it goes out of scope to stage on the calling thread
+class RenderStageTimer
+{
+public:
+    explicit RenderStageTimer(RenderStage stage);
+    ~RenderStageTimer();
+
+    RenderStageTimer(const RenderStageTimer &) = delete;
+    RenderStageTimer &operator=(const RenderStageTimer &) = delete;
+
+private:
+    int previous;
+};
+
+#define RENDER_COUNTER(call) call
+#define RENDER_STAGE(stage) RenderStageTimer renderStageTimer(stage)
+#else
+#define RENDER_COUNTER(call) ((void)0)
+#define RENDER_STAGE(stage) ((void)0)
+#endif
+
+// Sum over all threads so far, including threads that have exited. Counters
+// are never reset; take the difference of two snapshots to measure one render.
+RenderStats collectRenderStats();
+
+// Counters of the calling thread so far
+RenderStats threadRenderStats();
+
+// Counters of one render while other renders share the thread pool (so the
+// totals of collectRenderStats mix them up). Every piece of work of the render
+// runs inside measure, which adds what its thread counted in the meantime.
+// Measures may nest: work that an inner measure took (e.g. tiles of another
+// render run while waiting in ThreadPool::parallelFor) is left to that one.
+class RenderStatsAccumulator
+{
+public:
+    template <typename Fn>
+    void measure(Fn &&body)
+    {
+        MeasureStart start = beginMeasure();
+        body();
+        endMeasure(start);
+    }
+
+    void add(const RenderStats &stats);
+    RenderStats total() const;
+    void reset();
+
+private:
+    struct MeasureStart
+    {
+        RenderStats counted;  // threadRenderStats() at the start
+        RenderStats measured; // what the measures finished on the thread had taken
+    };
+
+    mutable std::mutex mutex;
+    RenderStats sum;
+
+    static MeasureStart beginMeasure();
+    void endMeasure(const MeasureStart &start);
+};
+
+// Writes stats as a JSON object. Returns false if the file cannot be written.
+bool writeRenderStatsJson(const std::string &filename, const RenderStats &stats);
+
+// Where the counters of an image go: image.png => image.stats.json
+std::string renderStatsFile(const std::string &imageFile);
+
+#endif // RENDER_STATS_H
@@ -0,0 +1,498 @@
+#include "Renderer.h"
+#include "SceneReader.h"
+#include "RayPacket.h"
+#include "phong.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <limits>
+
+Renderer::Renderer(Scene &scene, const RenderSettings &settings, ThreadPool *pool)
+    : scene(scene), settings(settings), pool(pool), sampler(settings.sampler, settings.seed, settings.samplesPerPixel)
+{
+    if (!this->pool && settings.parallel)
+    {
+        ownedPool = std::make_unique<ThreadPool>(settings.numThreads);
+        this->pool = ownedPool.get();
+    }
+}
+
+Ray Renderer::primaryRay(int x, int y, int sample) const
+{
+    int flipped_y = settings.height - 1 - y; // Flip the Y-coordinate to correct vertical orientation
+
+    // A single sample goes through the pixel center, more samples are spread over the pixel
+    glm::vec2 offset(0.5f);
+    if (settings.samplesPerPixel > 1)
+        offset = sampler.pixelOffset(x, y, sample);
+
+    // Construct ray for the sub-pixel
+    countCameraRay();
+    return SceneReader::ConstructRayThroughPoint(x + offset.x, flipped_y + offset.y, scene, settings.width, settings.height);
+}
+
+glm::vec3 Renderer::renderPixel(int x, int y, int firstSample, int endSample) const
+{
+    glm::vec3 accumulatedColor(0.0f);
+
+    // Supersampling: Take multiple samples per pixel
+    for (int sample = firstSample; sample < endSample; sample++)
+    {
+        Ray ray = primaryRay(x, y, sample);
+
+        // Accumulate the color
+        accumulatedColor += Phong::calcColor(scene, ray, 0, settings.maxDepth);
+    }
+
+    // The framebuffer averages the sum when the tile is resolved
+    return accumulatedColor;
+}
+
+void Renderer::renderTile(Framebuffer &framebuffer, int x0, int y0, int x1, int y1, int firstSample, int endSample) const
+{
+    if (settings.packetSize > 1 && scene.isCompiled())
+    {
+        renderTilePackets(framebuffer, x0, y0, x1, y1, firstSample, endSample);
+        return;
+    }
+
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++)
+            framebuffer.accumulate(x, y, renderPixel(x, y, firstSample, endSample));
+
+    framebuffer.resolve(x0, y0, x1, y1, static_cast<float>(endSample));
+}
+
+void Renderer::renderTilePackets(Framebuffer &framebuffer, int x0, int y0, int x1, int y1, int firstSample, int endSample) const
+{
+    int packetSize = std::min(settings.packetSize, 8); // RayPacket holds up to 8x8 rays
+
+    for (int py = y0; py < y1; py += packetSize)
+    {
+        for (int px = x0; px < x1; px += packetSize)
+        {
+            int packetWidth = std::min(packetSize, x1 - px);
+            int packetHeight = std::min(packetSize, y1 - py);
+
+            glm::vec3 accumulatedColor[RayPacket::MAX_RAYS];
+            for (int i = 0; i < packetWidth * packetHeight; i++)
+                accumulatedColor[i] = glm::vec3(0.0f);
+
+            for (int sample = firstSample; sample < endSample; sample++)
+            {
+                // Primary visibility for the whole block at once
+                RayPacket packet;
+                packet.origin = scene.eye.position;
+                Ray rays[RayPacket::MAX_RAYS];
+                for (int y = py; y < py + packetHeight; y++)
+                {
+                    for (int x = px; x < px + packetWidth; x++)
+                    {
+                        rays[packet.count] = primaryRay(x, y, sample);
+                        packet.directions[packet.count] = rays[packet.count].direction;
+                        packet.count++;
+                    }
+                }
+
+                PrimitiveHit hits[RayPacket::MAX_RAYS];
+                scene.compiled.closestHitPacket(packet, hits);
+
+                // Shading and all secondary rays continue one ray at a time
+                for (int i = 0; i < packet.count; i++)
+                {
+                    Intersection hit;
+                    hit.t = std::numeric_limits<float>::infinity();
+                    if (hits[i].type != PRIMITIVE_NONE)
+                        scene.fillIntersection(hit, hits[i], rays[i]);
+                    accumulatedColor[i] += Phong::shadeHit(scene, rays[i], hit, 0, settings.maxDepth);
+                }
+            }
+
+            for (int i = 0; i < packetWidth * packetHeight; i++)
+                framebuffer.accumulate(px + i % packetWidth, py + i / packetWidth, accumulatedColor[i]);
+        }
+    }
+
+    framebuffer.resolve(x0, y0, x1, y1, static_cast<float>(endSample));
+}
+
+void Renderer::Render(Framebuffer &framebuffer, const PreviewCallback &onPreview)
+{
+    counted.reset();
+    counted.measure([&]
+                    { scene.updateAccelerationStructure(); });
+    framebuffer.resize(settings.width, settings.height);
+    stopRequested.store(false, std::memory_order_relaxed);
+
+    // With a single sample per pixel there is nothing to adapt
+    if (settings.adaptive && settings.samplesPerPixel > 1)
+    {
+        renderAdaptive(framebuffer);
+        completedSamples = settings.samplesPerPixel;
+        stats = counted.total();
+        return;
+    }
+
+    if (!settings.progressive)
+    {
+        renderFrame(framebuffer, 0, settings.samplesPerPixel);
+        completedSamples = settings.samplesPerPixel;
+        stats = counted.total();
+        return;
+    }
+
+    // One sample per pixel per pass. Adding the samples to the framebuffer one at
+    // a time sums them in the same order as a normal render does.
+    auto lastPreview = std::chrono::steady_clock::now();
+    completedSamples = 0;
+    while (completedSamples < settings.samplesPerPixel && !stopRequested.load(std::memory_order_relaxed))
+    {
+        renderFrame(framebuffer, completedSamples, completedSamples + 1);
+        completedSamples++;
+
+        // The caller gets the final image anyway
+        if (!onPreview || completedSamples == settings.samplesPerPixel)
+            continue;
+
+        auto now = std::chrono::steady_clock::now();
+        bool passDue = settings.previewPasses > 0 && completedSamples % settings.previewPasses == 0;
+        bool timeDue = settings.previewSeconds > 0.0 && std::chrono::duration<double>(now - lastPreview).count() >= settings.previewSeconds;
+        if (passDue || timeDue)
+        {
+            onPreview(framebuffer, completedSamples);
+            lastPreview = now;
+        }
+    }
+    stats = counted.total();
+}
+
+bool Renderer::useWavefront() const
+{
+    long long pixels = static_cast<long long>(settings.width) * settings.height;
+    return settings.wavefrontMinPixels >= 0 && pixels >= settings.wavefrontMinPixels;
+}
+
+void Renderer::renderWavefront(Framebuffer &framebuffer, int firstSample, int endSample)
+{
+    int width = settings.width;
+    int height = settings.height;
+
+    if (!wavefront)
+        wavefront = std::make_unique<WavefrontTracer>(scene, settings.parallel ? pool : nullptr, settings.maxDepth, settings.packetSize > 1,
+                                                      settings.binSecondaryRays, &counted);
+
+    if (wavefrontOrder.size() != static_cast<size_t>(width) * height)
+    {
+        wavefrontOrder.clear();
+        for (int by = 0; by < height; by += 8)
+            for (int bx = 0; bx < width; bx += 8)
+                for (int y = by; y < std::min(by + 8, height); y++)
+                    for (int x = bx; x < std::min(bx + 8, width); x++)
+                        wavefrontOrder.push_back(y * width + x);
+    }
+
+    int total = static_cast<int>(wavefrontOrder.size());
+    int queueSize = std::max(static_cast<int>(RayPacket::MAX_RAYS), settings.wavefrontQueueSize);
+    wavefrontColors.resize(std::min(total, queueSize));
+
+    // One sample of every pixel after the other: adding one sample at a time
+    // gives the same sums as the tiled path
+    for (int sample = firstSample; sample < endSample; sample++)
+    {
+        for (int first = 0; first < total; first += queueSize)
+        {
+            int count = std::min(queueSize, total - first);
+            wavefront->trace(count, [&](int i)
+                             {
+                int pixel = wavefrontOrder[first + i];
+                return primaryRay(pixel % width, pixel / width, sample); }, wavefrontColors.data());
+
+            for (int i = 0; i < count; i++)
+            {
+                int pixel = wavefrontOrder[first + i];
+                framebuffer.accumulate(pixel % width, pixel / width, wavefrontColors[i]);
+            }
+        }
+    }
+
+    counted.measure([&]
+                    { framebuffer.resolve(static_cast<float>(endSample)); });
+}
+
+void Renderer::renderFrame(Framebuffer &framebuffer, int firstSample, int endSample)
+{
+    if (useWavefront())
+    {
+        renderWavefront(framebuffer, firstSample, endSample);
+        return;
+    }
+
+    forEachTile([&](int x0, int y0, int x1, int y1)
+                { renderTile(framebuffer, x0, y0, x1, y1, firstSample, endSample); });
+}
+
+void Renderer::forEachTile(const std::function<void(int x0, int y0, int x1, int y1)> &body)
+{
+    int width = settings.width;
+    int height = settings.height;
+
+    if (!settings.parallel)
+    {
+        // Iterate over height (Y) first for better cache locality (row-major order)
+        counted.measure([&]
+                        {
+            RENDER_STAGE(STAGE_TRACE);
+            body(0, 0, width, height); });
+        return;
+    }
+
+    int tileSize = std::max(1, settings.tileSize);
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+
+    // Every pixel is computed independently, so the tiles can finish in any order
+    pool->parallelFor(tilesX * tilesY, [&](int tile)
+                      {
+        int x0 = (tile % tilesX) * tileSize;
+        int y0 = (tile / tilesX) * tileSize;
+        counted.measure([&]
+                        {
+            RENDER_STAGE(STAGE_TRACE);
+            body(x0, y0, std::min(x0 + tileSize, width), std::min(y0 + tileSize, height)); }); });
+}
+
+int Renderer::numTiles() const
+{
+    if (!settings.parallel)
+        return 1;
+    int tileSize = std::max(1, settings.tileSize);
+    return ((settings.width + tileSize - 1) / tileSize) * ((settings.height + tileSize - 1) / tileSize);
+}
+
+int Renderer::tileIndex(int x0, int y0) const
+{
+    if (!settings.parallel)
+        return 0;
+    int tileSize = std::max(1, settings.tileSize);
+    int tilesX = (settings.width + tileSize - 1) / tileSize;
+    return (y0 / tileSize) * tilesX + x0 / tileSize;
+}
+
+void Renderer::RenderRecorded(Framebuffer &framebuffer, RayTreeRecords &records)
+{
+    counted.reset();
+    counted.measure([&]
+                    { scene.updateAccelerationStructure(); });
+    framebuffer.resize(settings.width, settings.height);
+
+    records.width = settings.width;
+    records.height = settings.height;
+    records.tileSize = settings.parallel ? std::max(1, settings.tileSize) : 0;
+    records.tiles.assign(numTiles(), RayTreeRecords::Tile());
+    forEachTile([&](int x0, int y0, int x1, int y1)
+                {
+        RayTreeRecords::Tile &tile = records.tiles[tileIndex(x0, y0)];
+        tile.x0 = x0;
+        tile.y0 = y0;
+        tile.x1 = x1;
+        tile.y1 = y1;
+        recordTile(framebuffer, tile, nullptr); });
+
+    completedSamples = settings.samplesPerPixel;
+    stats = counted.total();
+}
+
+size_t Renderer::Rerender(Framebuffer &framebuffer, RayTreeRecords &records, const SceneChanges &changes)
+{
+    int tileSize = settings.parallel ? std::max(1, settings.tileSize) : 0;
+    if (changes.everything || !records.matches(settings.width, settings.height, tileSize) ||
+        framebuffer.getWidth() != settings.width || framebuffer.getHeight() != settings.height)
+    {
+        RenderRecorded(framebuffer, records);
+        return static_cast<size_t>(settings.width) * settings.height;
+    }
+
+    counted.reset();
+    counted.measure([&]
+                    { scene.updateAccelerationStructure(); });
+    std::atomic<size_t> traced{0};
+    forEachTile([&](int x0, int y0, int x1, int y1)
+                { traced += recordTile(framebuffer, records.tiles[tileIndex(x0, y0)], &changes); });
+
+    completedSamples = settings.samplesPerPixel;
+    stats = counted.total();
+    return traced;
+}
+
+size_t Renderer::recordTile(Framebuffer &framebuffer, RayTreeRecords::Tile &tile, const SceneChanges *changes) const
+{
+    // Without changes every pixel is traced, otherwise only those whose records
+    // the changes touch; the others keep their color and records
+    int width = tile.x1 - tile.x0;
+    std::vector<char> dirty(static_cast<size_t>(width) * (tile.y1 - tile.y0), 1);
+    size_t count = dirty.size();
+    if (changes)
+    {
+        count = 0;
+        for (int y = tile.y0; y < tile.y1; y++)
+            for (int x = tile.x0; x < tile.x1; x++)
+            {
+                int pixel = tile.pixelIndex(x, y);
+                dirty[pixel] = RayTreeRecords::isDirty(tile, x, y, *changes);
+                count += dirty[pixel];
+            }
+        if (count == 0)
+            return 0;
+    }
+
+    RayTreeRecords::Tile traced;
+    traced.x0 = tile.x0;
+    traced.y0 = tile.y0;
+    traced.x1 = tile.x1;
+    traced.y1 = tile.y1;
+    traced.first.reserve(dirty.size() + 1);
+    traced.records.reserve(tile.records.size());
+    for (int y = tile.y0; y < tile.y1; y++)
+    {
+        for (int x = tile.x0; x < tile.x1; x++)
+        {
+            int pixel = tile.pixelIndex(x, y);
+            traced.first.push_back(static_cast<int>(traced.records.size()));
+            if (!dirty[pixel])
+            {
+                traced.records.insert(traced.records.end(), tile.records.begin() + tile.first[pixel], tile.records.begin() + tile.first[pixel + 1]);
+                continue;
+            }
+
+            // Same sum as renderTile adds to a cleared framebuffer
+            RayTreeRecording recording(traced.records);
+            framebuffer.setAccumulated(x, y, renderPixel(x, y, 0, settings.samplesPerPixel));
+        }
+    }
+    traced.first.push_back(static_cast<int>(traced.records.size()));
+
+    framebuffer.resolve(tile.x0, tile.y0, tile.x1, tile.y1, static_cast<float>(settings.samplesPerPixel));
+    tile = std::move(traced);
+    return count;
+}
+
+void Renderer::renderAdaptive(Framebuffer &framebuffer)
+{
+    size_t pixels = static_cast<size_t>(settings.width) * settings.height;
+    coarseObject.assign(pixels, -1);
+    coarseFlags.assign(pixels, 0);
+
+    // The refinement pass looks at neighbouring pixels, so the whole coarse pass
+    // has to finish first. Decisions only depend on the coarse results, which
+    // keeps the image independent of the number of threads.
+    forEachTile([&](int x0, int y0, int x1, int y1)
+                { coarseTile(framebuffer, x0, y0, x1, y1); });
+
+    // Mark first, then add samples: refining a pixel changes what its neighbours would see
+    forEachTile([&](int x0, int y0, int x1, int y1)
+                {
+        for (int y = y0; y < y1; y++)
+            for (int x = x0; x < x1; x++)
+                if (needsRefinement(framebuffer, x, y))
+                    coarseFlags[static_cast<size_t>(y) * settings.width + x] |= COARSE_REFINE; });
+    forEachTile([&](int x0, int y0, int x1, int y1)
+                { refineTile(framebuffer, x0, y0, x1, y1); });
+}
+
+void Renderer::coarseTile(Framebuffer &framebuffer, int x0, int y0, int x1, int y1)
+{
+    int coarseSamples = std::max(1, std::min(settings.adaptiveMinSamples, settings.samplesPerPixel));
+
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            size_t pixel = static_cast<size_t>(y) * settings.width + x;
+            glm::vec3 accumulatedColor(0.0f);
+            glm::vec3 minColor(1.0f), maxColor(0.0f);
+            unsigned char flags = 0;
+
+            for (int sample = 0; sample < coarseSamples; sample++)
+            {
+                // Same as Phong::calcColor, but the primary hit is kept for the edge test
+                Ray ray = primaryRay(x, y, sample);
+                Intersection hit = scene.GetHit(ray);
+                glm::vec3 color = Phong::shadeHit(scene, ray, hit, 0, settings.maxDepth);
+                accumulatedColor += color;
+
+                int object = hit.hitObject ? hit.objectId : -1;
+                if (sample == 0)
+                    coarseObject[pixel] = object;
+                else if (object != coarseObject[pixel])
+                    flags |= COARSE_MIXED;
+                if (hit.hitObject && hit.ObjectStatus != 0)
+                    flags |= COARSE_SECONDARY;
+
+                glm::vec3 clamped = glm::clamp(color, 0.0f, 1.0f);
+                minColor = glm::min(minColor, clamped);
+                maxColor = glm::max(maxColor, clamped);
+            }
+
+            glm::vec3 spread = maxColor - minColor;
+            if (coarseSamples > 1 && glm::max(spread.r, glm::max(spread.g, spread.b)) > threshold(flags))
+                flags |= COARSE_NOISY;
+
+            coarseFlags[pixel] = flags;
+            framebuffer.accumulate(x, y, accumulatedColor);
+        }
+    }
+
+    framebuffer.resolve(x0, y0, x1, y1, static_cast<float>(coarseSamples));
+}
+
+float Renderer::threshold(unsigned char flags) const
+{
+    // Reflections and refractions magnify small changes of the primary ray, so
+    // they get a finer threshold instead of the full sample count everywhere
+    return (flags & COARSE_SECONDARY) ? 0.25f * settings.adaptiveThreshold : settings.adaptiveThreshold;
+}
+
+bool Renderer::needsRefinement(const Framebuffer &framebuffer, int x, int y) const
+{
+    size_t pixel = static_cast<size_t>(y) * settings.width + x;
+    if (coarseFlags[pixel] & (COARSE_MIXED | COARSE_NOISY))
+        return true;
+    float contrast = 255.0f * threshold(coarseFlags[pixel]);
+
+    // Silhouettes and hard contrast between neighbours (shadow edges, checkerboard)
+    const unsigned char *center = framebuffer.pixels() + pixel * Framebuffer::CHANNELS;
+    const int offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    for (const auto &offset : offsets)
+    {
+        int nx = x + offset[0], ny = y + offset[1];
+        if (nx < 0 || ny < 0 || nx >= settings.width || ny >= settings.height)
+            continue;
+
+        size_t neighbour = static_cast<size_t>(ny) * settings.width + nx;
+        if (coarseObject[neighbour] != coarseObject[pixel])
+            return true;
+
+        const unsigned char *other = framebuffer.pixels() + neighbour * Framebuffer::CHANNELS;
+        for (int c = 0; c < Framebuffer::CHANNELS; c++)
+            if (std::abs(center[c] - other[c]) > contrast)
+                return true;
+    }
+    return false;
+}
+
+void Renderer::refineTile(Framebuffer &framebuffer, int x0, int y0, int x1, int y1) const
+{
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            if (!(coarseFlags[static_cast<size_t>(y) * settings.width + x] & COARSE_REFINE))
+                continue;
+
+            int coarseSamples = std::max(1, std::min(settings.adaptiveMinSamples, settings.samplesPerPixel));
+            framebuffer.accumulate(x, y, renderPixel(x, y, coarseSamples, settings.samplesPerPixel));
+            framebuffer.resolve(x, y, x + 1, y + 1, static_cast<float>(settings.samplesPerPixel));
+        }
+    }
+}
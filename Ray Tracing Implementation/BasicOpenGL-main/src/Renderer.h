@@ -1,20 +1,143 @@
-/*
-#pragma once 
+#ifndef RENDERER_H
+#define RENDERER_H
 
-#include  "Scene.h"
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <vector>
+#include "Framebuffer.h"
+#include "RayTreeRecords.h"
+#include "RenderStats.h"
+#include "Sampler.h"
+#include "Scene.h"
+#include "SceneDiff.h"
+#include "phong.h"
+#include "ThreadPool.h"
+#include "Wavefront.h"
 
+// Settings for a single render of a scene
+struct RenderSettings
+{
+    int width = WIDTH;
+    int height = HEIGHT;
+    int samplesPerPixel = 1; // Adjust this to control the quality of anti-aliasing
+    unsigned int seed = 0;   // Jitter seed, the same seed always gives the same image
+    SamplerType sampler = SAMPLER_SOBOL;
+    int maxDepth = Phong::DEFAULT_MAX_DEPTH; // reflection/refraction bounces per path
 
-class Renderer  {
+    bool parallel = true; // false => plain serial scanline loop
+    int numThreads = 0;   // 0 => one thread per hardware thread
+    int tileSize = 16;    // Tiles are square, edge tiles are clipped to the frame
 
-public : 
-        Renderer() = default ;
+    // Primary rays of packetSize x packetSize pixel blocks are traced together
+    // (4 or 8; 1 traces every ray on its own)
+    int packetSize = 1;
 
+    // Progressive mode: one sample per pixel per pass until samplesPerPixel is
+    // reached. A preview is handed out every previewPasses passes and/or every
+    // previewSeconds seconds (0 => never). The final image equals a normal render.
+    bool progressive = false;
+    int previewPasses = 0;
+    double previewSeconds = 0.0;
 
-        void Render () ;  
-private : 
-        std :: shared_ptr <
+    // Adaptive anti-aliasing (Eye::modeFlag): every pixel gets adaptiveMinSamples,
+    // then pixels on object edges or with a contrast above adaptiveThreshold (a
+    // quarter of it on reflective/transparent surfaces) get samplesPerPixel.
+    // Takes precedence over progressive and packet tracing.
+    bool adaptive = false;
+    int adaptiveMinSamples = 2;
+    float adaptiveThreshold = 0.05f; // largest channel difference, colors in [0, 1]
 
-} ;
+    // Frames with at least this many pixels are traced breadth-first by the
+    // WavefrontTracer (0 => always, -1 => never). Same image either way.
+    int wavefrontMinPixels = 1920 * 1080;
+    int wavefrontQueueSize = 1 << 16; // paths in flight per wave
+    bool binSecondaryRays = false;    // sort reflected/refracted rays by octant and origin cell
+};
 
-*/
\ No newline at end of file
+class Renderer
+{
+public:
+    // If pool is null and settings.parallel is set, the renderer creates its own pool
+    Renderer(Scene &scene, const RenderSettings &settings, ThreadPool *pool = nullptr);
+
+    // Called with the framebuffer and the samples per pixel it holds so far
+    typedef std::function<void(const Framebuffer &framebuffer, int samples)> PreviewCallback;
+
+    // Renders into framebuffer (resized to the settings if needed). Both planes are
+    // written: the sum of the samples and the final 8-bit color. In progressive
+    // mode onPreview receives the intermediate images.
+    void Render(Framebuffer &framebuffer, const PreviewCallback &onPreview = nullptr);
+
+    // Incremental mode for look-dev: renders all samples of every pixel on the
+    // tiled path (no adaptive, progressive, packet or wavefront tracing) and
+    // keeps in records which objects and lights each pixel's rays touched
+    void RenderRecorded(Framebuffer &framebuffer, RayTreeRecords &records);
+
+    // framebuffer and records hold a RenderRecorded frame of the scene before
+    // changes were made to it (see diffScenes). Traces again only the pixels the
+    // changes can affect and updates their records, which gives the same image
+    // as a full render. Returns the number of pixels traced.
+    size_t Rerender(Framebuffer &framebuffer, RayTreeRecords &records, const SceneChanges &changes);
+
+    // Progressive mode: finish the current pass and return from Render with the
+    // samples so far. Only sets a flag, so it may be called from a signal handler.
+    void Stop() { stopRequested.store(true, std::memory_order_relaxed); }
+
+    // Samples per pixel in the framebuffer after the last Render call
+    int getCompletedSamples() const { return completedSamples; }
+
+    // Counters of the last Render call, updating the acceleration structure
+    // included. Only its own rays are counted, also while other renderers share
+    // the thread pool.
+    const RenderStats &getStats() const { return stats; }
+
+private:
+    Scene &scene;
+    RenderSettings settings;
+    ThreadPool *pool;
+    std::unique_ptr<ThreadPool> ownedPool;
+    Sampler sampler;
+    RenderStats stats;
+    RenderStatsAccumulator counted; // all tiles and wavefront stages of the current call
+    int completedSamples = 0;
+
+    // Adaptive mode, per pixel results of the coarse pass
+    enum CoarseFlags
+    {
+        COARSE_MIXED = 1,     // samples hit different objects
+        COARSE_SECONDARY = 2, // a sample hit a reflective or transparent surface
+        COARSE_NOISY = 4,     // samples differ by more than the threshold
+        COARSE_REFINE = 8     // gets the remaining samples
+    };
+    std::vector<int> coarseObject;    // object seen by the samples, -1 for background
+    std::vector<unsigned char> coarseFlags;
+
+    std::atomic<bool> stopRequested{false};
+
+    // Wavefront mode
+    std::unique_ptr<WavefrontTracer> wavefront;
+    std::vector<int> wavefrontOrder; // pixels in 8x8 blocks, so camera rays form packets
+    std::vector<glm::vec3> wavefrontColors;
+
+    // Adds samples [firstSample, endSample) of every pixel to the framebuffer
+    void renderFrame(Framebuffer &framebuffer, int firstSample, int endSample);
+    void renderWavefront(Framebuffer &framebuffer, int firstSample, int endSample);
+    bool useWavefront() const;
+    void renderTile(Framebuffer &framebuffer, int x0, int y0, int x1, int y1, int firstSample, int endSample) const;
+    void renderTilePackets(Framebuffer &framebuffer, int x0, int y0, int x1, int y1, int firstSample, int endSample) const;
+    glm::vec3 renderPixel(int x, int y, int firstSample, int endSample) const;
+
+    void renderAdaptive(Framebuffer &framebuffer);
+    void coarseTile(Framebuffer &framebuffer, int x0, int y0, int x1, int y1);
+    void refineTile(Framebuffer &framebuffer, int x0, int y0, int x1, int y1) const;
+    float threshold(unsigned char flags) const;
+    bool needsRefinement(const Framebuffer &framebuffer, int x, int y) const;
+    void forEachTile(const std::function<void(int x0, int y0, int x1, int y1)> &body);
+    int numTiles() const;
+    int tileIndex(int x0, int y0) const;
+    size_t recordTile(Framebuffer &framebuffer, RayTreeRecords::Tile &tile, const SceneChanges *changes) const;
+    Ray primaryRay(int x, int y, int sample) const;
+};
+
+#endif // RENDERER_H
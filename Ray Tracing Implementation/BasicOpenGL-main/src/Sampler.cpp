@@ -0,0 +1,177 @@
+#include "Sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+// 2^-24: turns the high 24 bits of an integer into a float in [0, 1)
+static const float FLOAT_FROM_24_BITS = 1.0f / 16777216.0f;
+
+static float toUnitFloat(uint32_t bits)
+{
+    return (bits >> 8) * FLOAT_FROM_24_BITS;
+}
+
+//////////////////
+// PCG32        //
+//////////////////
+
+PCG32::PCG32(uint64_t seed, uint64_t stream)
+    : state(0), increment((stream << 1u) | 1u)
+{
+    nextUint();
+    state += seed;
+    nextUint();
+}
+
+uint32_t PCG32::nextUint()
+{
+    // PCG-XSH-RR
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + increment;
+    uint32_t xorShifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+    uint32_t rotation = static_cast<uint32_t>(old >> 59u);
+    return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+}
+
+float PCG32::nextFloat()
+{
+    return toUnitFloat(nextUint());
+}
+
+//////////////////
+// Sequences    //
+//////////////////
+
+// Sobol (0,2)-sequence: the first dimension is the base 2 radical inverse, the
+// second uses the direction numbers of the polynomial x + 1
+static uint32_t sobolDimension0(uint32_t index)
+{
+    uint32_t bits = index;
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+    bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+    return bits;
+}
+
+static uint32_t sobolDimension1(uint32_t index)
+{
+    uint32_t result = 0;
+    for (uint32_t direction = 1u << 31; index != 0; index >>= 1, direction ^= direction >> 1)
+    {
+        if (index & 1u)
+            result ^= direction;
+    }
+    return result;
+}
+
+// R2 (Roberts 2018): n * (1/g, 1/g^2) mod 1 with g the plastic number
+static glm::vec2 r2(int index)
+{
+    const double g = 1.32471795724474602596;
+    double u = 0.5 + index / g;
+    double v = 0.5 + index / (g * g);
+    return glm::vec2(static_cast<float>(u - std::floor(u)), static_cast<float>(v - std::floor(v)));
+}
+
+//////////////////
+// Sampler      //
+//////////////////
+
+bool parseSamplerType(const std::string &name, SamplerType &type)
+{
+    for (SamplerType candidate : {SAMPLER_RANDOM, SAMPLER_STRATIFIED, SAMPLER_SOBOL, SAMPLER_R2})
+    {
+        if (name == samplerName(candidate))
+        {
+            type = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *samplerName(SamplerType type)
+{
+    switch (type)
+    {
+    case SAMPLER_RANDOM:
+        return "random";
+    case SAMPLER_STRATIFIED:
+        return "stratified";
+    case SAMPLER_SOBOL:
+        return "sobol";
+    case SAMPLER_R2:
+        return "r2";
+    }
+    return "unknown";
+}
+
+Sampler::Sampler(SamplerType type, unsigned int seed, int samplesPerPixel)
+    : type(type), seed(seed)
+{
+    // Smallest grid with at least samplesPerPixel cells, as square as possible
+    int samples = std::max(1, samplesPerPixel);
+    gridX = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(samples))));
+    gridY = (samples + gridX - 1) / gridX;
+}
+
+uint32_t Sampler::pixelHash(int x, int y, uint32_t salt) const
+{
+    uint32_t h = seed * 0x9E3779B9u;
+    h ^= static_cast<uint32_t>(x) * 0x85EBCA6Bu;
+    h ^= static_cast<uint32_t>(y) * 0xC2B2AE35u;
+    h ^= salt * 0x27D4EB2Fu;
+
+    // murmur3 finalizer
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+glm::vec2 Sampler::pixelOffset(int x, int y, int sample) const
+{
+    switch (type)
+    {
+    case SAMPLER_RANDOM:
+    {
+        PCG32 rng(pixelHash(x, y, 0), static_cast<uint64_t>(sample));
+        float u = rng.nextFloat();
+        return glm::vec2(u, rng.nextFloat());
+    }
+
+    case SAMPLER_STRATIFIED:
+    {
+        // Cells are visited from a different start in every pixel, so a frame
+        // stopped early does not leave the same corner empty everywhere
+        int cells = gridX * gridY;
+        int cell = static_cast<int>((static_cast<uint32_t>(sample) + pixelHash(x, y, 1)) % static_cast<uint32_t>(cells));
+        PCG32 rng(pixelHash(x, y, 0), static_cast<uint64_t>(sample));
+        float u = rng.nextFloat();
+        float v = rng.nextFloat();
+        glm::vec2 point(((cell % gridX) + u) / gridX, ((cell / gridX) + v) / gridY);
+        return glm::min(point, glm::vec2(1.0f - FLOAT_FROM_24_BITS));
+    }
+
+    case SAMPLER_SOBOL:
+    {
+        // A random XOR per pixel keeps the net property and decorrelates pixels
+        uint32_t u = sobolDimension0(static_cast<uint32_t>(sample)) ^ pixelHash(x, y, 2);
+        uint32_t v = sobolDimension1(static_cast<uint32_t>(sample)) ^ pixelHash(x, y, 3);
+        return glm::vec2(toUnitFloat(u), toUnitFloat(v));
+    }
+
+    case SAMPLER_R2:
+    {
+        // Cranley-Patterson rotation per pixel
+        glm::vec2 point = r2(sample) + glm::vec2(toUnitFloat(pixelHash(x, y, 2)), toUnitFloat(pixelHash(x, y, 3)));
+        point -= glm::floor(point);
+        return glm::min(point, glm::vec2(1.0f - FLOAT_FROM_24_BITS));
+    }
+    }
+    return glm::vec2(0.5f);
+}
@@ -0,0 +1,58 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <string>
+#include <glm/glm.hpp>
+
+// Small counter-based PCG32 generator (O'Neill, pcg-random.org).
+// A generator is cheap to create, so every (pixel, sample) makes its own and
+// the numbers never depend on the order or thread pixels are rendered by.
+class PCG32
+{
+public:
+    PCG32(uint64_t seed, uint64_t stream);
+
+    uint32_t nextUint();
+    float nextFloat(); // [0, 1)
+
+private:
+    uint64_t state;
+    uint64_t increment;
+};
+
+enum SamplerType
+{
+    SAMPLER_RANDOM,     // independent uniform jitter
+    SAMPLER_STRATIFIED, // one jittered sample per cell of a grid over the pixel
+    SAMPLER_SOBOL,      // (0,2)-sequence in base 2, digitally shifted per pixel
+    SAMPLER_R2          // additive recurrence of the plastic number, rotated per pixel
+};
+
+bool parseSamplerType(const std::string &name, SamplerType &type);
+const char *samplerName(SamplerType type);
+
+// Sub-pixel sample positions. Every position is a pure function of
+// (seed, x, y, sample), so the image is the same for any thread count.
+// Sobol and R2 are progressive: any prefix of samples is well distributed,
+// which suits the progressive and adaptive modes. Stratified is only
+// balanced once all samplesPerPixel samples are taken.
+class Sampler
+{
+public:
+    Sampler(SamplerType type = SAMPLER_SOBOL, unsigned int seed = 0, int samplesPerPixel = 1);
+
+    // Offset inside pixel (x, y) for the given sample, in [0, 1)^2
+    glm::vec2 pixelOffset(int x, int y, int sample) const;
+
+    SamplerType getType() const { return type; }
+
+private:
+    SamplerType type;
+    unsigned int seed;
+    int gridX, gridY; // stratified grid
+
+    uint32_t pixelHash(int x, int y, uint32_t salt) const;
+};
+
+#endif // SAMPLER_H
@@ -1,5 +1,7 @@
 #include "Scene.h"
 #include "phong.h"
+#include "RenderStats.h"
+#include <glm/gtc/matrix_transform.hpp>
 // Material class
 Material::Material(const glm::vec3 &color, float shininess)
     : color(color), shininess(shininess) {}
@@ -104,6 +106,13 @@ Sphere::Sphere(int status, const glm::vec3 &center, float radius)
     this->radius = radius;
 }
 
+AABB Sphere::getBounds() const
+{
+    // Padded a little so rounding in the box test never loses a grazing hit
+    glm::vec3 extent(radius + 1e-5f * (radius + glm::length(center)));
+    return AABB(center - extent, center + extent);
+}
+
 void Sphere::print() const
 {
     std::cout << "Sphere - Center: " << glm::to_string(center)
@@ -113,6 +122,8 @@ void Sphere::print() const
 
 bool Sphere::Intersect(Ray &ray, float &t)
 {
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_SPHERE, 1));
+
     // Calculate the vector from the ray origin to the sphere center
     glm::vec3 oc = ray.origin - center;
 
@@ -173,6 +184,8 @@ Plane::Plane(int status, const glm::vec4 &coefficients)
 
 bool Plane::Intersect(Ray &ray, float &t)
 {
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_PLANE, 1));
+
     // Extract plane coefficients
     float a = coefficients.x;
     float b = coefficients.y;
@@ -199,6 +212,158 @@ bool Plane::Intersect(Ray &ray, float &t)
     return t >= 0;
 }
 
+// Mesh Class
+Mesh::Mesh(const Material &material, int status, std::shared_ptr<const TriangleMesh> mesh, const glm::vec3 &position, float scale)
+    : mesh(std::move(mesh)), position(position), scale(scale)
+{
+    this->material = material;
+    this->status = status;
+}
+
+AABB Mesh::getBounds() const
+{
+    AABB bounds;
+    for (const glm::vec3 &vertex : mesh->vertices)
+        bounds.expand(position + scale * vertex);
+    return bounds;
+}
+
+bool Mesh::intersectTriangles(const Ray &ray, float &t, int &triangle) const
+{
+    RENDER_COUNTER(countIntersectionTests(PRIMITIVE_TRIANGLE, mesh->numTriangles()));
+    WatertightRay watertight(ray.origin, ray.direction);
+    triangle = -1;
+    for (int i = 0; i < mesh->numTriangles(); i++)
+    {
+        float triangleT;
+        if (intersectTriangle(watertight, triangleVertex(i, 0), triangleVertex(i, 1), triangleVertex(i, 2), triangleT) &&
+            (triangle < 0 || triangleT < t))
+        {
+            t = triangleT;
+            triangle = i;
+        }
+    }
+    return triangle >= 0;
+}
+
+bool Mesh::Intersect(Ray &ray, float &t)
+{
+    int triangle;
+    return intersectTriangles(ray, t, triangle);
+}
+
+void Mesh::print() const
+{
+    std::cout << "Mesh - Position: " << glm::to_string(position) << ", Scale: " << scale
+              << ", Triangles: " << mesh->numTriangles() << std::endl;
+    material.print();
+}
+
+// InstanceGeometry Class
+InstanceGeometry::~InstanceGeometry()
+{
+    for (Object *obj : objects)
+        delete obj;
+}
+
+void InstanceGeometry::addObject(Object *obj)
+{
+    if (!obj->isBounded() || obj->isInstance())
+    {
+        delete obj;
+        throw std::runtime_error("Instance geometry can only hold spheres and meshes");
+    }
+    objects.push_back(obj);
+}
+
+void InstanceGeometry::build()
+{
+    bounds = AABB();
+    for (Object *obj : objects)
+        bounds.expand(obj->getBounds());
+    compiled.build(objects);
+}
+
+// Instance Class
+Instance::Instance(std::shared_ptr<const InstanceGeometry> geometry, const glm::mat4 &objectToWorld)
+    : geometry(std::move(geometry)), overrideMaterial(false)
+{
+    this->status = 0;
+    setTransform(objectToWorld);
+}
+
+Instance::Instance(const Material &material, int status, std::shared_ptr<const InstanceGeometry> geometry, const glm::mat4 &objectToWorld)
+    : geometry(std::move(geometry)), overrideMaterial(true)
+{
+    this->material = material;
+    this->status = status;
+    setTransform(objectToWorld);
+}
+
+void Instance::setTransform(const glm::mat4 &objectToWorld)
+{
+    if (glm::determinant(glm::mat3(objectToWorld)) == 0.0f)
+        throw std::runtime_error("Instance transform cannot be inverted");
+    this->objectToWorld = objectToWorld;
+    worldToObject = glm::inverse(objectToWorld);
+}
+
+glm::mat4 Instance::placement(const glm::vec3 &position, float scale, const glm::vec3 &rotationDegrees)
+{
+    glm::mat4 transform = glm::translate(glm::mat4(1.0f), position);
+    if (rotationDegrees != glm::vec3(0.0f))
+    {
+        transform = glm::rotate(transform, glm::radians(rotationDegrees.z), glm::vec3(0.0f, 0.0f, 1.0f));
+        transform = glm::rotate(transform, glm::radians(rotationDegrees.y), glm::vec3(0.0f, 1.0f, 0.0f));
+        transform = glm::rotate(transform, glm::radians(rotationDegrees.x), glm::vec3(1.0f, 0.0f, 0.0f));
+    }
+    return glm::scale(transform, glm::vec3(scale));
+}
+
+AABB Instance::getBounds() const
+{
+    return transformBounds(geometry->bounds, glm::mat4x3(objectToWorld));
+}
+
+Ray Instance::toObject(const Ray &ray) const
+{
+    // Set the members directly, the Ray constructor would normalize the direction
+    Ray local;
+    local.origin = glm::vec3(worldToObject * glm::vec4(ray.origin, 1.0f));
+    local.direction = glm::vec3(worldToObject * glm::vec4(ray.direction, 0.0f));
+    local.objectId = ray.objectId;
+    return local;
+}
+
+Object *Instance::closestObject(const Ray &localRay, float &t) const
+{
+    Ray ray = localRay;
+    Object *closest = nullptr;
+    for (Object *obj : geometry->objects)
+    {
+        float objectT = 0.0f;
+        if (obj->Intersect(ray, objectT) && (closest == nullptr || objectT < t))
+        {
+            t = objectT;
+            closest = obj;
+        }
+    }
+    return closest;
+}
+
+bool Instance::Intersect(Ray &ray, float &t)
+{
+    return closestObject(toObject(ray), t) != nullptr;
+}
+
+void Instance::print() const
+{
+    std::cout << "Instance - Transform: " << glm::to_string(objectToWorld)
+              << ", Objects: " << geometry->objects.size() << std::endl;
+    if (overrideMaterial)
+        material.print();
+}
+
 void Plane::print() const
 {
     std::cout << "Plane - Coefficients: " << glm::to_string(coefficients) << std::endl;
@@ -235,6 +400,50 @@ void Scene::addLight(LightSource *light)
 void Scene::addObject(Object *obj)
 {
     objects.push_back(obj);
+    accelerationBuilt = false;
+}
+
+void Scene::buildAccelerationStructure()
+{
+    RENDER_STAGE(STAGE_BUILD);
+    // A scene loaded from a binary scene file has no objects to compile from
+    if (objects.empty() && compiled.isMapped())
+        return;
+    compiled.build(objects);
+    accelerationBuilt = true;
+}
+
+void Scene::setObjectTransform(int object, const glm::mat4 &objectToWorld)
+{
+    Object *obj = objects.at(object);
+    if (!obj->isInstance())
+    {
+        if (!obj->isBounded())
+            throw std::runtime_error("Planes cannot be moved");
+        // Wrap the object in an instance, it keeps its material and status
+        std::shared_ptr<InstanceGeometry> geometry = std::make_shared<InstanceGeometry>();
+        int objectId = obj->ObjectId;
+        geometry->addObject(obj);
+        geometry->build();
+        obj = new Instance(geometry, glm::mat4(1.0f));
+        obj->ObjectId = objectId;
+        objects[object] = obj;
+        accelerationBuilt = false;
+    }
+
+    Instance *instance = dynamic_cast<Instance *>(obj);
+    instance->setTransform(objectToWorld);
+    if (accelerationBuilt)
+        compiled.setInstanceTransform(object, instance->objectToWorld, instance->worldToObject);
+}
+
+void Scene::updateAccelerationStructure()
+{
+    RENDER_STAGE(STAGE_BUILD);
+    if (!accelerationBuilt)
+        buildAccelerationStructure();
+    else
+        compiled.updateInstances();
 }
 
 void Scene::print() const
@@ -266,54 +475,218 @@ Scene::~Scene()
     }
 }
 
+// A triangle has no inside, so its normal faces the ray. Transparent meshes keep
+// the winding normal (outwards for counter-clockwise faces), refraction needs it
+// to tell rays entering the mesh from rays leaving it.
+static glm::vec3 triangleNormal(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const Ray &ray, int status)
+{
+    glm::vec3 normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+    if (status != 2 && glm::dot(normal, ray.direction) > 0.0f)
+        normal = -normal;
+    return normal;
+}
+
+// Normal of a triangle of an instance, from its vertices moved to world space
+static glm::vec3 instanceTriangleNormal(const glm::mat4x3 &objectToWorld, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
+                                        const Ray &ray, int status)
+{
+    glm::vec3 normal = triangleNormal(objectToWorld * glm::vec4(v0, 1.0f), objectToWorld * glm::vec4(v1, 1.0f),
+                                      objectToWorld * glm::vec4(v2, 1.0f), ray, status);
+    // A mirroring transform turns the winding around
+    if (status == 2 && glm::determinant(glm::mat3(objectToWorld)) < 0.0f)
+        normal = -normal;
+    return normal;
+}
+
+void Scene::fillIntersection(Intersection &hit, Object *obj, Ray &ray, float t)
+{
+    hit.t = t;
+    hit.point = ray.pointAtParameter(t);
+
+    // Check if the object is a plane
+    if (obj->isPlane()) {
+        Plane *plane = dynamic_cast<Plane *>(obj);
+
+        // Extract normal from the plane coefficients (a, b, c)
+        glm::vec3 normal(plane->coefficients.x, plane->coefficients.y, plane->coefficients.z);
+
+        // Flip the normal if needed (depends on scene setup)
+        hit.normal = glm::normalize(-normal);  // Optionally flip the normal
+        hit.material = plane->material; // Set material from Plane
+        hit.ObjectType = "Plane";  // Set ObjectType to "Plane"
+    }
+    // Check if the object is a sphere
+    else if (obj->isSphere()) {
+        Sphere *sphere = dynamic_cast<Sphere *>(obj);
+        hit.normal = glm::normalize(hit.point - sphere->center);
+        hit.material = sphere->material; // Set material from Sphere
+        hit.ObjectType = "Sphere"; // Set ObjectType to "Sphere"
+    }
+    else if (obj->isMesh()) {
+        Mesh *mesh = dynamic_cast<Mesh *>(obj);
+        int triangle;
+        float triangleT;
+        mesh->intersectTriangles(ray, triangleT, triangle);
+        hit.normal = triangleNormal(mesh->triangleVertex(triangle, 0), mesh->triangleVertex(triangle, 1), mesh->triangleVertex(triangle, 2), ray, mesh->status);
+        int face = mesh->mesh->faceMaterials[triangle];
+        hit.material = face < 0 ? mesh->material : Material(mesh->mesh->materials[face].color, mesh->mesh->materials[face].shininess);
+        hit.ObjectType = "Mesh";
+    }
+    else if (obj->isInstance()) {
+        // Find the part that was hit in object space
+        Instance *instance = dynamic_cast<Instance *>(obj);
+        Ray localRay = instance->toObject(ray);
+        float localT;
+        Object *part = instance->closestObject(localRay, localT);
+        int status = instance->overrideMaterial ? instance->status : part->status;
+        if (part->isMesh()) {
+            Mesh *mesh = dynamic_cast<Mesh *>(part);
+            int triangle;
+            float triangleT;
+            mesh->intersectTriangles(localRay, triangleT, triangle);
+            hit.normal = instanceTriangleNormal(glm::mat4x3(instance->objectToWorld), mesh->triangleVertex(triangle, 0), mesh->triangleVertex(triangle, 1),
+                                                mesh->triangleVertex(triangle, 2), ray, status);
+            int face = mesh->mesh->faceMaterials[triangle];
+            hit.material = face < 0 ? mesh->material : Material(mesh->mesh->materials[face].color, mesh->mesh->materials[face].shininess);
+            hit.ObjectType = "Mesh";
+        }
+        else {
+            // Normals move back to world space with the inverse transpose
+            Sphere *sphere = dynamic_cast<Sphere *>(part);
+            glm::vec3 normal = localRay.pointAtParameter(t) - sphere->center;
+            hit.normal = glm::normalize(glm::transpose(glm::mat3(instance->worldToObject)) * normal);
+            hit.material = sphere->material;
+            hit.ObjectType = "Sphere";
+        }
+        if (instance->overrideMaterial)
+            hit.material = instance->material;
+
+        hit.objectId = obj->ObjectId;
+        hit.hitObject = true;
+        hit.ObjectStatus = status;
+        return;
+    }
+
+    hit.objectId = obj->ObjectId;
+    hit.hitObject = true; // Mark the intersection as valid
+    hit.ObjectStatus = obj->status; // Set the object status
+}
+
+void Scene::fillIntersection(Intersection &hit, const PrimitiveHit &primitive, Ray &ray)
+{
+    hit.t = primitive.t;
+    hit.point = ray.pointAtParameter(primitive.t);
+
+    if (primitive.instance >= 0) {
+        fillInstanceIntersection(hit, primitive, ray);
+        return;
+    }
+
+    int material;
+    if (primitive.type == PRIMITIVE_PLANE) {
+        // Flip the normal if needed (depends on scene setup)
+        hit.normal = glm::normalize(-compiled.planeNormal(primitive.index));
+        material = compiled.planeMaterial[primitive.index];
+        hit.ObjectType = "Plane";
+    }
+    else if (primitive.type == PRIMITIVE_TRIANGLE) {
+        material = compiled.triangleMaterial[primitive.index];
+        hit.normal = triangleNormal(compiled.triangleVertex(primitive.index, 0), compiled.triangleVertex(primitive.index, 1),
+                                    compiled.triangleVertex(primitive.index, 2), ray, compiled.materialStatus[material]);
+        hit.ObjectType = "Mesh";
+    }
+    else {
+        hit.normal = glm::normalize(hit.point - compiled.sphereCenter(primitive.index));
+        material = compiled.sphereMaterial[primitive.index];
+        hit.ObjectType = "Sphere";
+    }
+
+    hit.material = Material(compiled.materialColor[material], compiled.materialShininess[material]);
+    hit.objectId = compiled.objectIds[primitive.object];
+    hit.objectIndex = primitive.object;
+    hit.hitObject = true; // Mark the intersection as valid
+    hit.ObjectStatus = compiled.materialStatus[material]; // Set the object status
+}
+
+void Scene::fillInstanceIntersection(Intersection &hit, const PrimitiveHit &primitive, Ray &ray)
+{
+    const CompiledScene &geometry = compiled.instanceScene(primitive.instance);
+    const glm::mat4x3 &worldToObject = compiled.instanceWorldToObject[primitive.instance];
+
+    int instanceMaterial = compiled.instanceMaterial[primitive.instance];
+    int material = primitive.type == PRIMITIVE_TRIANGLE ? geometry.triangleMaterial[primitive.index] : geometry.sphereMaterial[primitive.index];
+    int status = instanceMaterial >= 0 ? compiled.materialStatus[instanceMaterial] : geometry.materialStatus[material];
+
+    if (primitive.type == PRIMITIVE_TRIANGLE) {
+        hit.normal = instanceTriangleNormal(compiled.instanceObjectToWorld[primitive.instance], geometry.triangleVertex(primitive.index, 0),
+                                            geometry.triangleVertex(primitive.index, 1), geometry.triangleVertex(primitive.index, 2), ray, status);
+        hit.ObjectType = "Mesh";
+    }
+    else {
+        // Normals move back to world space with the inverse transpose
+        glm::vec3 normal = worldToObject * glm::vec4(hit.point, 1.0f) - geometry.sphereCenter(primitive.index);
+        hit.normal = glm::normalize(glm::transpose(glm::mat3(worldToObject)) * normal);
+        hit.ObjectType = "Sphere";
+    }
+
+    if (instanceMaterial >= 0)
+        hit.material = Material(compiled.materialColor[instanceMaterial], compiled.materialShininess[instanceMaterial]);
+    else
+        hit.material = Material(geometry.materialColor[material], geometry.materialShininess[material]);
+    hit.ObjectStatus = status;
+    hit.objectId = compiled.objectIds[primitive.object];
+    hit.objectIndex = primitive.object;
+    hit.hitObject = true;
+}
+
 Intersection Scene::GetHit(Ray &ray) {
     // Initialize closestIntersection with proper member values
     Intersection closestIntersection;
     closestIntersection.t = std::numeric_limits<float>::infinity(); // Start with a very large value
     closestIntersection.hitObject = false;
 
-    // Iterate through all objects in the scene
-    for (Object *obj : objects) {
-        float zero  =  0 ;
-            float t = 0.0f; // Parameter for the intersection
-            if (obj->Intersect(ray, t)) { // If there's an intersection
-                if (t < closestIntersection.t) { // Check if it's the closest one
-                    closestIntersection.t = t;
-                    closestIntersection.point = ray.pointAtParameter(t);
-
-                    // Check if the object is a plane
-                    if (obj->isPlane()) {
-                        Plane *plane = dynamic_cast<Plane *>(obj);
-
-                        // Extract normal from the plane coefficients (a, b, c)
-                        glm::vec3 normal(plane->coefficients.x, plane->coefficients.y, plane->coefficients.z);
-
-                        // Flip the normal if needed (depends on scene setup)
-                        closestIntersection.normal = glm::normalize(-normal);  // Optionally flip the normal
-                        closestIntersection.material = plane->material; // Set material from Plane
-                        closestIntersection.ObjectType = "Plane";  // Set ObjectType to "Plane"
-                        closestIntersection.objectId = obj->ObjectId;   
-
-                    }
-                    // Check if the object is a sphere
-                    else if (obj->isSphere()) {
-                        Sphere *sphere = dynamic_cast<Sphere *>(obj);
-                        closestIntersection.normal = glm::normalize(closestIntersection.point - sphere->center);
-                        closestIntersection.material = sphere->material; // Set material from Sphere
-                        closestIntersection.ObjectType = "Sphere"; // Set ObjectType to "Sphere"
-                        closestIntersection.objectId = obj->ObjectId;   
-
-                    }
-
-                    closestIntersection.hitObject = true; // Mark the intersection as valid
-                    closestIntersection.ObjectStatus = obj->status; // Set the object status
-                }
-            }
+    if (accelerationBuilt) {
+        PrimitiveHit primitive = compiled.closestHit(ray.origin, ray.direction);
+        if (primitive.type != PRIMITIVE_NONE)
+            fillIntersection(closestIntersection, primitive, ray);
+        return closestIntersection;
+    }
+
+    // Not compiled yet: iterate through all objects in the scene
+    float closestT = std::numeric_limits<float>::infinity();
+    int closestIndex = -1;
+    for (size_t i = 0; i < objects.size(); i++) {
+        float t = 0.0f; // Parameter for the intersection
+        if (objects[i]->Intersect(ray, t) && t < closestT) { // Check if it's the closest one
+            closestT = t;
+            closestIndex = static_cast<int>(i);
+        }
+    }
+
+    if (closestIndex >= 0) {
+        fillIntersection(closestIntersection, objects[closestIndex], ray, closestT);
+        closestIntersection.objectIndex = closestIndex;
     }
-        
+
     return closestIntersection; // Return the closest intersection
 }
 
+bool Scene::Occluded(Ray &ray, float tMax, PrimitiveHit *hint)
+{
+    countShadowRay();
+
+    if (accelerationBuilt)
+        return compiled.occluded(ray.origin, ray.direction, tMax, hint);
+
+    // Not compiled yet: any object in front of tMax blocks the ray
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        float t = 0.0f;
+        if (objects[i]->Intersect(ray, t) && t < tMax)
+            return true;
+    }
+    return false;
+}
 
 LightSource *Scene::getLight(int num)
 {
@@ -339,7 +712,7 @@ glm::vec3 Intersection ::getColor()
 // Ray Class
 
 // Default constructor (initialize with zero vectors)
-//Ray ::Ray() : origin(glm::vec3(0.0f)), direction(glm::vec3(0.0f)) {};
+Ray ::Ray() : origin(glm::vec3(0.0f)), direction(glm::vec3(0.0f)), objectId(-1) {}
 
 // Constructor with origin and direction
 Ray ::Ray(const glm::vec3 &origin, const glm::vec3 &direction)
@@ -8,8 +8,12 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <stdexcept>
+#include "BVH.h"
+#include "CompiledScene.h"
+#include "TriangleMesh.h"
 #define WIDTH 800
 #define HEIGHT 800
 
@@ -20,6 +24,9 @@ public:
     glm::vec3 direction; // The direction of the ray
     int objectId ;  
 
+    // Default constructor (zero origin and direction)
+    Ray();
+
     // Constructor with origin and direction
     Ray(const glm::vec3 &origin, const glm::vec3 &direction);
 
@@ -95,6 +102,12 @@ public:
 
     virtual bool isSphere() const;
     virtual bool isPlane() const;
+    virtual bool isMesh() const { return false; }
+    virtual bool isInstance() const { return false; }
+
+    // Unbounded objects (planes) are kept out of the BVH and always tested
+    virtual bool isBounded() const { return true; }
+    virtual AABB getBounds() const = 0;
 
     virtual ~Object() = default;
     void setMaterial(Material &material);
@@ -115,6 +128,7 @@ public:
     // funcitons
     bool Intersect(Ray &ray, float &t) override;
     void print() const override;
+    AABB getBounds() const override;
 
     bool isSphere() const override { return true; }
     bool isPlane() const override { return false; }
@@ -132,11 +146,100 @@ public:
     // fucntions
     bool Intersect(Ray &ray, float &t) override;
     void print() const override;
+    bool isBounded() const override { return false; }
+    AABB getBounds() const override { return AABB(); }
 
     bool isSphere() const override { return false; }
     bool isPlane() const override { return true; }
 };
 
+// Triangle mesh placed in the scene: a model vertex p is at position + scale * p.
+// Several objects may share one TriangleMesh. Faces without a material of their
+// own use the object's material, the status applies to all faces.
+class Mesh : public Object
+{
+public:
+    std::shared_ptr<const TriangleMesh> mesh;
+    glm::vec3 position;
+    float scale;
+
+    Mesh(const Material &material, int status, std::shared_ptr<const TriangleMesh> mesh,
+         const glm::vec3 &position = glm::vec3(0.0f), float scale = 1.0f);
+
+    glm::vec3 vertex(int index) const { return position + scale * mesh->vertices[index]; }
+    glm::vec3 triangleVertex(int triangle, int corner) const { return vertex(mesh->indices[3 * triangle + corner]); }
+
+    // Closest triangle hit by testing every triangle (the scene is not compiled yet)
+    bool intersectTriangles(const Ray &ray, float &t, int &triangle) const;
+
+    bool Intersect(Ray &ray, float &t) override;
+    void print() const override;
+    AABB getBounds() const override;
+
+    bool isSphere() const override { return false; }
+    bool isPlane() const override { return false; }
+    bool isMesh() const override { return true; }
+};
+
+// Geometry shared by instances: spheres and meshes in object space, compiled
+// once into a scene of their own. Planes are not allowed (an instance must be
+// bounded) and neither are instances (no nesting).
+class InstanceGeometry
+{
+public:
+    std::vector<Object *> objects; // owned
+    CompiledScene compiled;
+    AABB bounds; // object space
+
+    InstanceGeometry() = default;
+    InstanceGeometry(const InstanceGeometry &) = delete;
+    InstanceGeometry &operator=(const InstanceGeometry &) = delete;
+    ~InstanceGeometry();
+
+    // Throws std::runtime_error on planes and instances
+    void addObject(Object *obj);
+    // Compiles the objects, call once all are added
+    void build();
+};
+
+// Placement of an InstanceGeometry: object space point p is at objectToWorld * p.
+// Any number of instances share one geometry. With overrideMaterial the whole
+// geometry takes the instance's material and status, otherwise every part keeps
+// its own.
+class Instance : public Object
+{
+public:
+    std::shared_ptr<const InstanceGeometry> geometry;
+    glm::mat4 objectToWorld;
+    glm::mat4 worldToObject;
+    bool overrideMaterial;
+
+    // Uses the geometry's materials
+    Instance(std::shared_ptr<const InstanceGeometry> geometry, const glm::mat4 &objectToWorld);
+    // Overrides them with material and status
+    Instance(const Material &material, int status, std::shared_ptr<const InstanceGeometry> geometry, const glm::mat4 &objectToWorld);
+
+    // Throws std::runtime_error if the matrix cannot be inverted
+    void setTransform(const glm::mat4 &objectToWorld);
+
+    // Object to world matrix that scales uniformly, rotates by rotationDegrees
+    // (about x, then y, then z) and moves the origin to position
+    static glm::mat4 placement(const glm::vec3 &position, float scale, const glm::vec3 &rotationDegrees = glm::vec3(0.0f));
+
+    // The ray in object space. The direction is not normalized, so t is the same in both spaces.
+    Ray toObject(const Ray &ray) const;
+    // Closest part of the geometry hit by testing every one (the scene is not compiled yet)
+    Object *closestObject(const Ray &localRay, float &t) const;
+
+    bool Intersect(Ray &ray, float &t) override;
+    void print() const override;
+    AABB getBounds() const override;
+
+    bool isSphere() const override { return false; }
+    bool isPlane() const override { return false; }
+    bool isInstance() const override { return true; }
+};
+
 // Eye class to represent the camera
 class Eye
 {
@@ -171,6 +274,7 @@ public:
     std::string ObjectType;
     int ObjectStatus = 1 ; 
     int objectId ; 
+    int objectIndex = -1; // of the object hit in Scene::objects
 
     // Default constructor
     Intersection();
@@ -202,9 +306,45 @@ public:
     int getNumLights();
     Intersection GetHit(Ray &ray);
 
+    // Shadow ray query: true if anything is hit with 0 <= t < tMax. Computes no
+    // shading data and stops at the first blocker. hint (optional) is tried first
+    // and receives the blocker found, see CompiledScene::occluded.
+    bool Occluded(Ray &ray, float tMax, PrimitiveHit *hint = nullptr);
+
+    // Builds the compiled scene (SoA primitives + BVH over the bounded objects).
+    // Must be called again after objects are added or changed, until then
+    // GetHit falls back to testing every object.
+    void buildAccelerationStructure();
+    bool isCompiled() const { return accelerationBuilt; }
+
+    // Moves objects[object] between frames. An instance gets objectToWorld as its
+    // new placement; a sphere or mesh is moved by it from where the scene put it.
+    // The first move of a sphere or mesh turns it into an instance of a geometry
+    // of its own (the next update rebuilds everything), after that only the top
+    // level of the two-level structure changes. Planes cannot move.
+    void setObjectTransform(int object, const glm::mat4 &objectToWorld);
+
+    // Makes the compiled scene match the objects before a frame: refits the
+    // top level if only instances moved, rebuilds everything if objects were
+    // added or replaced. Renderer::Render calls it.
+    void updateAccelerationStructure();
+
     LightSource *getLight(int num);
 
     void print() const;
+
+    CompiledScene compiled;
+
+    // Shading data for a hit found on the compiled scene
+    void fillIntersection(Intersection &hit, const PrimitiveHit &primitive, Ray &ray);
+
+private:
+    friend class BinaryScene;
+
+    bool accelerationBuilt = false;
+
+    void fillIntersection(Intersection &hit, Object *obj, Ray &ray, float t);
+    void fillInstanceIntersection(Intersection &hit, const PrimitiveHit &primitive, Ray &ray);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "SceneCache.h"
+#include "BinaryScene.h"
+#include "SceneReader.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+SceneCache::SceneCache(size_t capacity) : capacity(std::max<size_t>(1, capacity))
+{
+}
+
+uint64_t SceneCache::hash(const char *data, size_t size, uint64_t seed)
+{
+    uint64_t value = seed;
+    for (size_t i = 0; i < size; i++)
+    {
+        value ^= static_cast<unsigned char>(data[i]);
+        value *= 1099511628211ull;
+    }
+    return value;
+}
+
+size_t SceneCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+static bool sameScene(const SceneCache::Entry &a, const SceneCache::Entry &b)
+{
+    return a.hash == b.hash && a.directory == b.directory && a.content == b.content && a.path == b.path &&
+           a.fileSize == b.fileSize && a.writeTime == b.writeTime;
+}
+
+// Hash of a whole file, read in chunks so a large binary scene is never held in memory twice
+static uint64_t hashFile(const std::string &filename, uint64_t seed)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+        throw std::runtime_error("Failed to open scene file " + filename);
+    std::vector<char> chunk(65536);
+    uint64_t value = seed;
+    while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0)
+        value = SceneCache::hash(chunk.data(), static_cast<size_t>(file.gcount()), value);
+    return value;
+}
+
+std::shared_ptr<SceneCache::Entry> SceneCache::find(const Entry &probe)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (sameScene(**it, probe))
+        {
+            entries.splice(entries.begin(), entries, it);
+            hitCount++;
+            return entries.front();
+        }
+    }
+    missCount++;
+    return nullptr;
+}
+
+std::shared_ptr<SceneCache::Entry> SceneCache::insert(std::shared_ptr<Entry> entry)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    // Two requests may have read the same scene at once, keep the first
+    for (const std::shared_ptr<Entry> &existing : entries)
+    {
+        if (sameScene(*existing, *entry))
+            return existing;
+    }
+    entries.push_front(entry);
+    if (entries.size() > capacity)
+        entries.pop_back();
+    return entry;
+}
+
+std::shared_ptr<SceneCache::Entry> SceneCache::loadBinary(const std::string &filename, bool &cached)
+{
+    std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+    entry->path = std::filesystem::absolute(filename).lexically_normal().string();
+    std::error_code error;
+    entry->fileSize = std::filesystem::file_size(entry->path, error);
+    entry->writeTime = std::filesystem::last_write_time(entry->path, error);
+    if (error)
+        throw std::runtime_error("Failed to open scene file " + filename);
+    entry->hash = hashFile(entry->path, hash(entry->path.data(), entry->path.size()));
+
+    std::shared_ptr<Entry> existing = find(*entry);
+    cached = existing != nullptr;
+    if (existing)
+        return existing;
+
+    entry->scene.reset(BinaryScene::read(entry->path));
+    entry->scene->updateAccelerationStructure();
+    return insert(entry);
+}
+
+std::shared_ptr<SceneCache::Entry> SceneCache::load(const std::string &filename, ThreadPool *pool, bool &cached)
+{
+    if (BinaryScene::isBinarySceneFile(filename))
+        return loadBinary(filename, cached);
+
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        throw std::runtime_error("Failed to open scene file " + filename);
+    std::string content(static_cast<size_t>(file.tellg()), '\0');
+    file.seekg(0);
+    file.read(&content[0], content.size());
+    return loadText(content, std::filesystem::absolute(filename).parent_path().string(), pool, cached);
+}
+
+std::shared_ptr<SceneCache::Entry> SceneCache::loadText(const std::string &text, const std::string &directory, ThreadPool *pool, bool &cached)
+{
+    // Mesh files are looked up next to the scene, so the same text elsewhere is another scene
+    std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+    entry->hash = hash(text.data(), text.size(), hash(directory.data(), directory.size()));
+    entry->directory = directory;
+    entry->content = text;
+
+    std::shared_ptr<Entry> existing = find(*entry);
+    cached = existing != nullptr;
+    if (existing)
+        return existing;
+
+    entry->scene.reset(SceneReader().readSceneText(text, directory, pool));
+    entry->scene->updateAccelerationStructure();
+    return insert(entry);
+}
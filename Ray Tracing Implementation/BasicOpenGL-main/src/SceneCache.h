@@ -0,0 +1,72 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "Scene.h"
+#include "ThreadPool.h"
+
+// Parsed and compiled scenes (BVHs included) by their file content, so
+// rendering a scene again skips reading it. Entries are looked up by a hash,
+// but a hit also compares the content, so a collision is only a miss. Binary
+// scene files are used in place (mapped) and not copied: they are matched by
+// path, size and modification time, and the hash of the file is taken again.
+// Holds up to capacity scenes and drops the least recently used one first; a
+// dropped scene lives on until the last render using it lets go.
+//
+// Only the scene file itself is compared: an edited OBJ file of a mesh is not
+// noticed while the scene file stays the same.
+class SceneCache
+{
+public:
+    struct Entry
+    {
+        std::unique_ptr<Scene> scene;
+        // Held while rendering: a request may move the eye of the shared scene
+        std::mutex renderMutex;
+
+        uint64_t hash = 0;
+        std::string directory; // mesh files are looked up there
+        std::string content;   // of a text scene file
+
+        // Binary scene files, empty path for text scenes
+        std::string path;
+        uintmax_t fileSize = 0;
+        std::filesystem::file_time_type writeTime;
+    };
+
+    explicit SceneCache(size_t capacity = 8);
+
+    // The scene of a file (text or binary); cached is set if it was not read.
+    // Throws std::runtime_error like SceneReader::readScene.
+    std::shared_ptr<Entry> load(const std::string &filename, ThreadPool *pool, bool &cached);
+
+    // The scene of a scene file's text; mesh file names are relative to directory
+    std::shared_ptr<Entry> loadText(const std::string &text, const std::string &directory, ThreadPool *pool, bool &cached);
+
+    size_t size() const;
+    uint64_t hits() const { return hitCount; }
+    uint64_t misses() const { return missCount; }
+
+    // 64-bit FNV-1a
+    static uint64_t hash(const char *data, size_t size, uint64_t seed = 14695981039346656037ull);
+
+private:
+    mutable std::mutex mutex;
+    size_t capacity;
+    std::list<std::shared_ptr<Entry>> entries; // most recently used first
+    std::atomic<uint64_t> hitCount{0};
+    std::atomic<uint64_t> missCount{0};
+
+    // The entry matching the keys of probe, counted as a hit or a miss
+    std::shared_ptr<Entry> find(const Entry &probe);
+    std::shared_ptr<Entry> insert(std::shared_ptr<Entry> entry);
+    std::shared_ptr<Entry> loadBinary(const std::string &filename, bool &cached);
+};
+
+#endif // SCENE_CACHE_H
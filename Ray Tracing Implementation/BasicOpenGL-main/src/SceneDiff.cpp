@@ -0,0 +1,178 @@
+#include "SceneDiff.h"
+
+static bool sameMaterial(const Material &a, const Material &b)
+{
+    return a.color == b.color && a.shininess == b.shininess;
+}
+
+static bool sameMeshMaterials(const TriangleMesh &a, const TriangleMesh &b)
+{
+    if (a.faceMaterials != b.faceMaterials || a.materials.size() != b.materials.size())
+        return false;
+    for (size_t i = 0; i < a.materials.size(); i++)
+    {
+        if (a.materials[i].color != b.materials[i].color || a.materials[i].shininess != b.materials[i].shininess)
+            return false;
+    }
+    return true;
+}
+
+static bool sameGeometry(const Object &a, const Object &b);
+
+// Everything that only changes the color of the rays hitting the object
+static bool sameSurface(const Object &a, const Object &b)
+{
+    if (a.status != b.status || !sameMaterial(a.material, b.material))
+        return false;
+
+    if (a.isMesh() && b.isMesh())
+    {
+        const Mesh &meshA = static_cast<const Mesh &>(a);
+        const Mesh &meshB = static_cast<const Mesh &>(b);
+        return meshA.mesh == meshB.mesh || sameMeshMaterials(*meshA.mesh, *meshB.mesh);
+    }
+    if (a.isInstance() && b.isInstance())
+    {
+        const Instance &instanceA = static_cast<const Instance &>(a);
+        const Instance &instanceB = static_cast<const Instance &>(b);
+        if (instanceA.overrideMaterial != instanceB.overrideMaterial)
+            return false;
+        if (instanceA.geometry == instanceB.geometry)
+            return true;
+        // Parts of different geometries are only compared if sameGeometry matched them up
+        const std::vector<Object *> &partsA = instanceA.geometry->objects;
+        const std::vector<Object *> &partsB = instanceB.geometry->objects;
+        for (size_t i = 0; i < partsA.size() && i < partsB.size(); i++)
+        {
+            if (!sameSurface(*partsA[i], *partsB[i]))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Everything that decides which rays hit the object and where
+static bool sameGeometry(const Object &a, const Object &b)
+{
+    if (a.isSphere() != b.isSphere() || a.isPlane() != b.isPlane() || a.isMesh() != b.isMesh() || a.isInstance() != b.isInstance())
+        return false;
+
+    if (a.isSphere())
+    {
+        const Sphere &sphereA = static_cast<const Sphere &>(a);
+        const Sphere &sphereB = static_cast<const Sphere &>(b);
+        return sphereA.center == sphereB.center && sphereA.radius == sphereB.radius;
+    }
+    if (a.isPlane())
+        return static_cast<const Plane &>(a).coefficients == static_cast<const Plane &>(b).coefficients;
+    if (a.isMesh())
+    {
+        const Mesh &meshA = static_cast<const Mesh &>(a);
+        const Mesh &meshB = static_cast<const Mesh &>(b);
+        if (meshA.position != meshB.position || meshA.scale != meshB.scale)
+            return false;
+        // A re-read scene loads its OBJ files again, so compare the contents
+        return meshA.mesh == meshB.mesh ||
+               (meshA.mesh->vertices == meshB.mesh->vertices && meshA.mesh->indices == meshB.mesh->indices);
+    }
+    if (a.isInstance())
+    {
+        const Instance &instanceA = static_cast<const Instance &>(a);
+        const Instance &instanceB = static_cast<const Instance &>(b);
+        if (instanceA.objectToWorld != instanceB.objectToWorld)
+            return false;
+        if (instanceA.geometry == instanceB.geometry)
+            return true;
+        const std::vector<Object *> &partsA = instanceA.geometry->objects;
+        const std::vector<Object *> &partsB = instanceB.geometry->objects;
+        if (partsA.size() != partsB.size())
+            return false;
+        for (size_t i = 0; i < partsA.size(); i++)
+        {
+            if (!sameGeometry(*partsA[i], *partsB[i]))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool sameLightGeometry(const LightSource &a, const LightSource &b)
+{
+    if (a.isSpotlight() != b.isSpotlight() || a.direction != b.direction)
+        return false;
+    if (!a.isSpotlight())
+        return true;
+    const Spotlight &spotA = static_cast<const Spotlight &>(a);
+    const Spotlight &spotB = static_cast<const Spotlight &>(b);
+    return spotA.position == spotB.position && spotA.cutoff == spotB.cutoff;
+}
+
+bool SceneChanges::empty() const
+{
+    if (everything)
+        return false;
+    for (char changed : materialChanged)
+        if (changed)
+            return false;
+    if (!movedObjects.empty())
+        return false;
+    for (char changed : intensityChanged)
+        if (changed)
+            return false;
+    for (char changed : lightMoved)
+        if (changed)
+            return false;
+    return true;
+}
+
+SceneChanges diffScenes(const Scene &before, const Scene &after)
+{
+    SceneChanges changes;
+    if (before.eye.position != after.eye.position || before.eye.modeFlag != after.eye.modeFlag ||
+        before.ambient.intensity != after.ambient.intensity ||
+        before.objects.size() != after.objects.size() || before.lights.size() != after.lights.size() ||
+        after.objects.empty()) // binary scenes have no objects to compare
+    {
+        changes.everything = true;
+        return changes;
+    }
+
+    changes.materialChanged.assign(after.objects.size(), 0);
+    changes.objectMoved.assign(after.objects.size(), 0);
+    changes.movedBounds.resize(after.objects.size());
+    for (size_t i = 0; i < after.objects.size(); i++)
+    {
+        const Object &a = *before.objects[i];
+        const Object &b = *after.objects[i];
+        if (!sameGeometry(a, b))
+        {
+            // A moved plane can show up behind any ray
+            if (!a.isBounded() || !b.isBounded())
+            {
+                changes.everything = true;
+                return changes;
+            }
+            changes.objectMoved[i] = 1;
+            changes.movedObjects.push_back(static_cast<int>(i));
+
+            // Only the new place matters: rays that hit the old one are in the records
+            AABB bounds = b.getBounds();
+            glm::vec3 magnitude = glm::max(glm::abs(bounds.min), glm::abs(bounds.max));
+            float padding = 1e-4f * (1.0f + glm::max(magnitude.x, glm::max(magnitude.y, magnitude.z)));
+            changes.movedBounds[i] = AABB(bounds.min - padding, bounds.max + padding);
+        }
+        else if (!sameSurface(a, b))
+            changes.materialChanged[i] = 1;
+    }
+
+    changes.intensityChanged.assign(after.lights.size(), 0);
+    changes.lightMoved.assign(after.lights.size(), 0);
+    for (size_t i = 0; i < after.lights.size(); i++)
+    {
+        if (!sameLightGeometry(*before.lights[i], *after.lights[i]))
+            changes.lightMoved[i] = 1;
+        else if (before.lights[i]->intensity != after.lights[i]->intensity)
+            changes.intensityChanged[i] = 1;
+    }
+    return changes;
+}
@@ -0,0 +1,28 @@
+#ifndef SCENE_DIFF_H
+#define SCENE_DIFF_H
+
+#include <vector>
+#include "BVH.h"
+#include "Scene.h"
+
+// What differs between two versions of a scene, e.g. a scene file before and
+// after an edit. Objects and lights are matched by their index.
+struct SceneChanges
+{
+    // Eye, ambient, the number of objects or lights or an unbounded object
+    // changed: every pixel has to be traced again
+    bool everything = false;
+
+    std::vector<char> materialChanged; // by object: only color, shininess or status differ
+    std::vector<char> objectMoved;     // by object: the geometry differs (moved, resized, new mesh)
+    std::vector<AABB> movedBounds;     // new bounds of the moved objects, padded
+    std::vector<int> movedObjects;     // indices of the moved objects, for tests against all of them
+    std::vector<char> intensityChanged; // by light: only the intensity differs
+    std::vector<char> lightMoved;       // by light: direction, position or cutoff differ
+
+    bool empty() const;
+};
+
+SceneChanges diffScenes(const Scene &before, const Scene &after);
+
+#endif // SCENE_DIFF_H
@@ -1,112 +1,424 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
 #include <fstream>
-#include <sstream>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
-#include "scene.h"
+#include "Scene.h"
 #include "SceneReader.h"
+#include "BinaryScene.h"
+#include "ObjLoader.h"
+#include "RenderStats.h"
+#include <filesystem>
+#include <unordered_map>
 #include <bits/unique_ptr.h>
 #include <bits/shared_ptr.h>
 #define WIDTH 800
 #define HEIGHT 800
 
-Scene *SceneReader::readScene(const std::string &filePath)
+// Text scenes above this size are parsed in parallel
+static const size_t PARALLEL_PARSE_BYTES = 1 << 22;
+
+namespace
+{
+// Sphere or mesh of a named instance geometry (go/gr/gt, gm/gmr/gmt lines)
+struct GeometryPart
+{
+    std::string geometry;
+    int status;
+    glm::vec4 data; // sphere (x, y, z, radius) or mesh (x, y, z, scale)
+    Material material;
+    std::string meshFile; // empty for spheres
+};
+
+// Instance object (n/nr/nt lines)
+struct InstanceLine
+{
+    size_t index; // in objectData
+    std::string geometry;
+    glm::mat4 objectToWorld;
+};
+
+// Everything one chunk of lines defines, in file order
+struct ParsedChunk
+{
+    bool hasEye = false, hasAmbient = false;
+    glm::vec4 eye;     // x, y, z, mode flag
+    glm::vec3 ambient;
+    std::vector<glm::vec4> objectData; // sphere (x, y, z, radius), plane (a, b, c, d) or mesh (x, y, z, scale)
+    std::vector<int> objectStatus;
+    std::vector<std::pair<size_t, std::string>> meshFiles; // mesh objects: index in objectData, OBJ file
+    std::vector<InstanceLine> instances;
+    std::vector<GeometryPart> geometryParts;
+    std::vector<Material> materials;
+    std::vector<glm::vec3> lightDirections, lightIntensities;
+    std::vector<glm::vec4> spotlightPositions; // x, y, z, cutoff
+};
+}
+
+static bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Reads up to count floats from [p, end) like `istream >> float`; fields that are
+// missing or not numbers are 0. Returns the end of the last number read.
+static const char *parseFloats(const char *p, const char *end, float *values, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        while (p < end && isBlank(*p))
+            p++;
+        if (p < end && *p == '+')
+            p++;
+        std::from_chars_result result = std::from_chars(p, end, values[i]);
+        if (result.ec != std::errc())
+        {
+            for (; i < count; i++)
+                values[i] = 0.0f;
+            return p;
+        }
+        p = result.ptr;
+    }
+    return p;
+}
+
+// Next blank separated word of [p, end); returns the end of it
+static const char *parseWord(const char *p, const char *end, std::string &word)
+{
+    while (p < end && isBlank(*p))
+        p++;
+    const char *wordEnd = p;
+    while (wordEnd < end && !isBlank(*wordEnd))
+        wordEnd++;
+    word.assign(p, wordEnd);
+    return wordEnd;
+}
+
+// The rest of the line without surrounding blanks (file names may contain spaces)
+static std::string restOfLine(const char *p, const char *end)
+{
+    while (p < end && isBlank(*p))
+        p++;
+    while (end > p && isBlank(end[-1]))
+        end--;
+    return std::string(p, end);
+}
+
+// Status of a token suffix: "" regular, "r" reflective, "t" transparent, -1 for anything else
+static int statusSuffix(const char *suffix, const char *end)
+{
+    if (suffix == end)
+        return 0;
+    if (end - suffix == 1 && (*suffix == 'r' || *suffix == 't'))
+        return *suffix == 'r' ? 1 : 2;
+    return -1;
+}
+
+// Object to world matrix of an instance line: "x y z scale" (4 numbers),
+// "x y z scale rx ry rz" (7, rotations in degrees about x, then y, then z) or
+// a 3x4 matrix row by row (12)
+static glm::mat4 parseInstanceTransform(const char *p, const char *end)
+{
+    float v[12] = {};
+    int count = 0;
+    while (count < 12)
+    {
+        while (p < end && isBlank(*p))
+            p++;
+        if (p == end)
+            break;
+        p = parseFloats(p, end, &v[count++], 1);
+    }
+
+    if (count < 12)
+        return Instance::placement(glm::vec3(v[0], v[1], v[2]), v[3], glm::vec3(v[4], v[5], v[6]));
+
+    glm::mat4 transform(1.0f);
+    for (int row = 0; row < 3; row++)
+        for (int column = 0; column < 4; column++)
+            transform[column][row] = v[4 * row + column];
+    return transform;
+}
+
+// Parses the complete lines in [begin, end)
+static void parseChunk(const char *begin, const char *end, ParsedChunk &chunk)
+{
+    // Roughly half the lines of a big scene are objects and half are materials
+    size_t lines = std::count(begin, end, '\n') + 1;
+    chunk.objectData.reserve(lines / 2);
+    chunk.objectStatus.reserve(lines / 2);
+    chunk.materials.reserve(lines / 2);
+
+    const char *line = begin;
+    while (line < end)
+    {
+        const char *lineEnd = static_cast<const char *>(std::memchr(line, '\n', end - line));
+        if (lineEnd == nullptr)
+            lineEnd = end;
+
+        const char *token = line;
+        while (token < lineEnd && isBlank(*token))
+            token++;
+        const char *tokenEnd = token;
+        while (tokenEnd < lineEnd && !isBlank(*tokenEnd))
+            tokenEnd++;
+
+        int status = tokenEnd > token ? statusSuffix(token + 1, tokenEnd) : -1;
+        if (status >= 0 && *token == 'm')
+        {
+            // Mesh: m|mr|mt x y z scale file.obj, status like o|r|t
+            float v[4];
+            const char *file = parseFloats(tokenEnd, lineEnd, v, 4);
+            chunk.meshFiles.emplace_back(chunk.objectData.size(), restOfLine(file, lineEnd));
+            chunk.objectData.emplace_back(v[0], v[1], v[2], v[3]);
+            chunk.objectStatus.push_back(status);
+        }
+        else if (status >= 0 && *token == 'n')
+        {
+            // Instance: n|nr|nt geometry transform, see parseInstanceTransform
+            InstanceLine instance;
+            instance.index = chunk.objectData.size();
+            const char *p = parseWord(tokenEnd, lineEnd, instance.geometry);
+            instance.objectToWorld = parseInstanceTransform(p, lineEnd);
+            chunk.instances.push_back(instance);
+            chunk.objectData.emplace_back(0.0f);
+            chunk.objectStatus.push_back(status);
+        }
+        else if (tokenEnd - token >= 2 && *token == 'g')
+        {
+            // Geometry part: go|gr|gt geometry x y z radius r g b shininess
+            //            or gm|gmr|gmt geometry x y z scale r g b shininess file.obj
+            bool isMesh = token[1] == 'm';
+            int partStatus = isMesh ? statusSuffix(token + 2, tokenEnd)
+                                    : tokenEnd - token == 2 && token[1] == 'o' ? 0 : statusSuffix(token + 1, tokenEnd);
+            if (partStatus >= 0)
+            {
+                GeometryPart part;
+                part.status = partStatus;
+                const char *p = parseWord(tokenEnd, lineEnd, part.geometry);
+                float v[8];
+                p = parseFloats(p, lineEnd, v, 8);
+                part.data = glm::vec4(v[0], v[1], v[2], v[3]);
+                part.material = Material(glm::vec3(v[4], v[5], v[6]), v[7]);
+                if (isMesh)
+                    part.meshFile = restOfLine(p, lineEnd);
+                chunk.geometryParts.push_back(part);
+            }
+        }
+        else if (tokenEnd - token == 1)
+        {
+            float v[4];
+            parseFloats(tokenEnd, lineEnd, v, 4);
+            switch (*token)
+            {
+            case 'e': // Eye
+                chunk.hasEye = true;
+                chunk.eye = glm::vec4(v[0], v[1], v[2], v[3]);
+                break;
+            case 'a': // Ambient
+                chunk.hasAmbient = true;
+                chunk.ambient = glm::vec3(v[0], v[1], v[2]);
+                break;
+            case 'd': // Light direction
+                chunk.lightDirections.emplace_back(v[0], v[1], v[2]);
+                break;
+            case 'p': // Spotlight position
+                chunk.spotlightPositions.emplace_back(v[0], v[1], v[2], v[3]);
+                break;
+            case 'i': // Light intensity
+                chunk.lightIntensities.emplace_back(v[0], v[1], v[2]);
+                break;
+            case 'o': // Objects
+            case 'r':
+            case 't':
+                chunk.objectData.emplace_back(v[0], v[1], v[2], v[3]);
+                chunk.objectStatus.push_back(*token == 'o' ? 0 : *token == 'r' ? 1 : 2);
+                break;
+            case 'c': // Materials
+                chunk.materials.emplace_back(glm::vec3(v[0], v[1], v[2]), v[3]);
+                break;
+            }
+        }
+        line = lineEnd + 1;
+    }
+}
+
+Scene *SceneReader::readScene(const std::string &filePath, ThreadPool *pool)
 {
-    std::ifstream file(filePath);
+    // Precompiled scenes are mapped, not parsed
+    if (BinaryScene::isBinarySceneFile(filePath))
+        return BinaryScene::read(filePath);
+
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
     if (!file.is_open())
     {
         throw std::runtime_error("Failed to open scene file.");
     }
+    std::string text(static_cast<size_t>(file.tellg()), '\0');
+    file.seekg(0);
+    file.read(&text[0], text.size());
+
+    return readSceneText(text, std::filesystem::path(filePath).parent_path().string(), pool);
+}
+
+Scene *SceneReader::readSceneText(const std::string &text, const std::string &directory, ThreadPool *pool)
+{
+    RENDER_STAGE(STAGE_PARSE);
+    std::unique_ptr<ThreadPool> ownedPool;
+    if (pool == nullptr && text.size() >= PARALLEL_PARSE_BYTES)
+    {
+        ownedPool.reset(new ThreadPool());
+        pool = ownedPool.get();
+    }
 
+    // Split at line boundaries, a few chunks per thread so uneven lines even out
+    int numChunks = pool != nullptr && text.size() >= PARALLEL_PARSE_BYTES ? 4 * pool->size() : 1;
+    std::vector<size_t> chunkStart(numChunks + 1, text.size());
+    chunkStart[0] = 0;
+    for (int i = 1; i < numChunks; i++)
+    {
+        size_t position = std::max(chunkStart[i - 1], text.size() * i / numChunks);
+        size_t newline = text.find('\n', position);
+        chunkStart[i] = newline == std::string::npos ? text.size() : newline + 1;
+    }
+
+    std::vector<ParsedChunk> chunks(numChunks);
+    auto parse = [&](int i)
+    {
+        parseChunk(text.data() + chunkStart[i], text.data() + chunkStart[i + 1], chunks[i]);
+    };
+    if (numChunks > 1)
+        pool->parallelFor(numChunks, parse);
+    else
+        parse(0);
+
+    // Merge in file order: later e/a lines win, list entries keep their positions
     Eye eye(glm::vec3(0.0f));
     Ambient ambient(glm::vec3(0.0f));
-    std::vector<LightSource *> lights;
-    std::vector<Object *> objects;
-
-    std::string line;
     std::vector<glm::vec3> lightDirections, lightIntensities;
-    std::vector<glm::vec4> spotlightPositions; // x, y, z, cutoff
-    std::vector<Material> materials;
+    std::vector<glm::vec4> spotlightPositions;
+    std::vector<size_t> objectStart(numChunks + 1, 0), materialStart(numChunks + 1, 0);
+    for (int i = 0; i < numChunks; i++)
+    {
+        const ParsedChunk &chunk = chunks[i];
+        if (chunk.hasEye)
+            eye = Eye(glm::vec3(chunk.eye), static_cast<int>(chunk.eye.w));
+        if (chunk.hasAmbient)
+            ambient = Ambient(chunk.ambient);
+        lightDirections.insert(lightDirections.end(), chunk.lightDirections.begin(), chunk.lightDirections.end());
+        lightIntensities.insert(lightIntensities.end(), chunk.lightIntensities.begin(), chunk.lightIntensities.end());
+        spotlightPositions.insert(spotlightPositions.end(), chunk.spotlightPositions.begin(), chunk.spotlightPositions.end());
+        objectStart[i + 1] = objectStart[i] + chunk.objectData.size();
+        materialStart[i + 1] = materialStart[i] + chunk.materials.size();
+    }
 
-    while (std::getline(file, line))
+    // Every OBJ file is loaded once, relative paths start at the scene file
+    std::filesystem::path sceneDirectory = directory;
+    std::unordered_map<std::string, std::shared_ptr<TriangleMesh>> meshes;
+    for (const ParsedChunk &chunk : chunks)
     {
-        std::istringstream iss(line);
-        std::string token;
-        iss >> token;
+        for (const auto &meshFile : chunk.meshFiles)
+            meshes.emplace((sceneDirectory / meshFile.second).string(), nullptr);
+        for (const GeometryPart &part : chunk.geometryParts)
+            if (!part.meshFile.empty())
+                meshes.emplace((sceneDirectory / part.meshFile).string(), nullptr);
+    }
+    for (auto &mesh : meshes)
+        mesh.second = loadObj(mesh.first);
 
-        if (token == "e")
-        { // Eye
-            glm::vec3 position;
-            float modeFlag;
-            iss >> position.x >> position.y >> position.z >> modeFlag;
-            eye = Eye(position, static_cast<int>(modeFlag));
-        }
-        else if (token == "a")
-        { // Ambient
-            glm::vec3 intensity;
-            float ignore;
-            iss >> intensity.x >> intensity.y >> intensity.z >> ignore;
-            ambient = Ambient(intensity);
-        }
-        else if (token == "d")
-        { // Light direction
-            glm::vec3 direction;
-            float type;
-            iss >> direction.x >> direction.y >> direction.z >> type;
-            lightDirections.push_back(direction);
-        }
-        else if (token == "p")
-        { // Spotlight position
-            glm::vec4 position;
-            iss >> position.x >> position.y >> position.z >> position.w;
-            spotlightPositions.push_back(position);
+    // Instance geometries are compiled once, before the instances refer to them
+    std::unordered_map<std::string, std::shared_ptr<InstanceGeometry>> geometries;
+    for (const ParsedChunk &chunk : chunks)
+    {
+        for (const GeometryPart &part : chunk.geometryParts)
+        {
+            std::shared_ptr<InstanceGeometry> &geometry = geometries[part.geometry];
+            if (!geometry)
+                geometry = std::make_shared<InstanceGeometry>();
+            Object *obj;
+            if (part.meshFile.empty())
+                obj = new Sphere(part.material, part.status, glm::vec3(part.data), part.data.w);
+            else
+                obj = new Mesh(part.material, part.status, meshes.at((sceneDirectory / part.meshFile).string()), glm::vec3(part.data), part.data.w);
+            obj->ObjectId = static_cast<int>(geometry->objects.size()) + 1;
+            geometry->addObject(obj);
         }
-        else if (token == "i")
-        { // Light intensity
-            glm::vec3 intensity;
-            float ignore;
-            iss >> intensity.x >> intensity.y >> intensity.z >> ignore;
-            lightIntensities.push_back(intensity);
+    }
+    for (auto &geometry : geometries)
+        geometry.second->build();
+    for (const ParsedChunk &chunk : chunks)
+    {
+        for (const InstanceLine &instance : chunk.instances)
+        {
+            if (geometries.find(instance.geometry) == geometries.end())
+                throw std::runtime_error("Instance of unknown geometry '" + instance.geometry + "'");
+            if (glm::determinant(glm::mat3(instance.objectToWorld)) == 0.0f)
+                throw std::runtime_error("Instance of '" + instance.geometry + "' has a singular transform");
         }
-        else if (token == "o" || token == "r" || token == "t")
-        { // Objects
-            glm::vec4 objData;
-            iss >> objData.x >> objData.y >> objData.z >> objData.w;
-            Material material;
-            int status = (token == "o") ? 0 : (token == "r") ? 1
-                                                             : 2;
-            if (objData.w > 0)
+    }
+
+    std::vector<Material> materials(materialStart[numChunks]);
+    std::vector<Object *> objects(objectStart[numChunks]);
+    auto gatherMaterials = [&](int i)
+    {
+        std::copy(chunks[i].materials.begin(), chunks[i].materials.end(), materials.begin() + materialStart[i]);
+    };
+    // Materials are associated with objects by position: the i-th c line colors the i-th object
+    auto createObjects = [&](int i)
+    {
+        const ParsedChunk &chunk = chunks[i];
+        size_t nextMesh = 0, nextInstance = 0;
+        for (size_t j = 0; j < chunk.objectData.size(); j++)
+        {
+            size_t index = objectStart[i] + j;
+            const glm::vec4 &objData = chunk.objectData[j];
+            Material material = index < materials.size() ? materials[index] : Material();
+            if (nextInstance < chunk.instances.size() && chunk.instances[nextInstance].index == j)
+            { // Instance: a c line of its own overrides the geometry's materials
+                const InstanceLine &instance = chunk.instances[nextInstance++];
+                const std::shared_ptr<InstanceGeometry> &geometry = geometries.at(instance.geometry);
+                if (index < materials.size())
+                    objects[index] = new Instance(material, chunk.objectStatus[j], geometry, instance.objectToWorld);
+                else
+                    objects[index] = new Instance(geometry, instance.objectToWorld);
+            }
+            else if (nextMesh < chunk.meshFiles.size() && chunk.meshFiles[nextMesh].first == j)
+            { // Mesh
+                std::shared_ptr<TriangleMesh> mesh = meshes.at((sceneDirectory / chunk.meshFiles[nextMesh++].second).string());
+                objects[index] = new Mesh(material, chunk.objectStatus[j], mesh, glm::vec3(objData), objData.w);
+            }
+            else if (objData.w > 0)
             { // Sphere
-                objects.push_back(new Sphere(status, glm::vec3(objData.x, objData.y, objData.z), objData.w));
+                objects[index] = new Sphere(material, chunk.objectStatus[j], glm::vec3(objData.x, objData.y, objData.z), objData.w);
             }
             else
             { // Plane
-                objects.push_back(new Plane(status, objData));
+                objects[index] = new Plane(material, chunk.objectStatus[j], objData);
             }
+            objects[index]->ObjectId = static_cast<int>(index) + 1;
         }
-        else if (token == "c")
-        { // Materials
-            glm::vec3 color;
-            float shininess;
-            iss >> color.x >> color.y >> color.z >> shininess;
-            materials.emplace_back(color, shininess);
-        }
+    };
+    if (numChunks > 1)
+    {
+        pool->parallelFor(numChunks, gatherMaterials);
+        pool->parallelFor(numChunks, createObjects);
     }
-
-    // Associate materials with objects
-    for (size_t i = 0; i < objects.size(); ++i)
+    else
     {
-        if (i < materials.size())
-        {
-            objects[i]->setMaterial(materials[i]);
-        }
+        gatherMaterials(0);
+        createObjects(0);
     }
+    chunks.clear();
 
-    // Create light sources
+    // Create light sources: the first directions pair with the spotlight positions
+    std::vector<LightSource *> lights;
     size_t spotlightIndex = 0;
     for (size_t i = 0; i < lightDirections.size(); ++i)
     {
         glm::vec3 direction = lightDirections[i];
-        glm::vec3 intensity = lightIntensities[i];
+        glm::vec3 intensity = i < lightIntensities.size() ? lightIntensities[i] : glm::vec3(0.0f);
         if (i < spotlightPositions.size())
         { // Spotlight
             glm::vec4 position = spotlightPositions[spotlightIndex++];
@@ -127,26 +439,34 @@ Scene *SceneReader::readScene(const std::string &filePath)
 
         scene->addLight(light);
     }
-    int id = 1;
+    scene->objects.reserve(objects.size());
     for (auto object : objects)
     {
-        object->ObjectId = id;
         scene->addObject(object);
-        id+=1;
     }
+    scene->buildAccelerationStructure();
 
     return scene;
 }
 
 Ray SceneReader::ConstructRayThroughPixel(int x, int y, Scene &scene)
 {
-    // Map pixel (x, y) to normalized device coordinates (NDC)
-    float ndc_x = (x + 0.5f) / WIDTH; // Add 0.5 to sample pixel center
-    float ndc_y = (y + 0.5f) / HEIGHT;
+    return ConstructRayThroughPoint(x + 0.5f, y + 0.5f, scene); // Add 0.5 to sample pixel center
+}
+
+Ray SceneReader::ConstructRayThroughPoint(float x, float y, Scene &scene, int width, int height)
+{
+    // Map point (x, y) to normalized device coordinates (NDC)
+    float ndc_x = x / width;
+    float ndc_y = y / height;
 
-    // Map NDC to screen coordinates (from -1 to 1 on both axes)
+    // Map NDC to screen coordinates (from -1 to 1 on the shorter axis)
     float screen_x = -1.0f + 2.0f * ndc_x;
     float screen_y = -1.0f + 2.0f * ndc_y;
+    if (width > height)
+        screen_x *= static_cast<float>(width) / height;
+    else if (height > width)
+        screen_y *= static_cast<float>(height) / width;
 
     // Compute the screen point on the z=0 plane
     glm::vec3 screen_point(screen_x, screen_y, 0.0f);
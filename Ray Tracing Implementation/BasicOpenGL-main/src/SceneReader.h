@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include "Scene.h"
+#include "ThreadPool.h"
 
 class SceneReader {
 public:
@@ -15,9 +16,25 @@ std::vector<LightSource*> lights;
 // Constructor
 SceneReader() : eye(nullptr), ambient(nullptr) {}
 
-// Function to load scene data from a file
-Scene* readScene(const std::string& filename);
+// Function to load scene data from a file (text or binary, see BinaryScene).
+// Besides e/a/o/r/t/c/d/p/i, text scenes may place OBJ meshes with
+// "m x y z scale file.obj" (mr/mt for reflective/transparent); the file name is
+// relative to the scene file and the mesh takes the next c line like any object.
+// Instancing: "go|gr|gt name x y z radius r g b shininess" and
+// "gm|gmr|gmt name x y z scale r g b shininess file.obj" add a sphere or mesh to
+// the geometry called name (they are not objects and take no c line);
+// "n|nr|nt name x y z scale [rx ry rz]" or "n name m00 m01 m02 m03 m10 .. m23"
+// places the geometry. An instance is an object: if it gets a c line, that
+// material and its status replace the geometry's own.
+// Large text files are parsed in parallel on pool, or on a temporary pool if it is null.
+Scene* readScene(const std::string& filename, ThreadPool *pool = nullptr);
+// The same for the text of a scene file held in memory; mesh file names are relative to directory.
+Scene *readSceneText(const std::string &text, const std::string &directory, ThreadPool *pool = nullptr);
 static  Ray  ConstructRayThroughPixel(int i  , int j , Scene & scene ) ; 
+// x, y are continuous pixel coordinates of a width x height image, (i + 0.5, j + 0.5)
+// is the center of pixel (i, j). The image spans [-1, 1] of the screen along its
+// shorter side, the longer side sees more of the scene.
+static Ray ConstructRayThroughPoint(float x, float y, Scene &scene, int width = WIDTH, int height = HEIGHT);
 
 
 };
@@ -0,0 +1,161 @@
+#include "ThreadPool.h"
+
+#include <exception>
+
+ThreadPool::ThreadPool(int numThreads)
+{
+    if (numThreads <= 0)
+    {
+        numThreads = static_cast<int>(std::thread::hardware_concurrency());
+        if (numThreads <= 0)
+            numThreads = 1;
+    }
+
+    for (int i = 0; i < numThreads; i++)
+        queues.push_back(std::make_unique<WorkQueue>());
+
+    for (int i = 0; i < numThreads; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        stopping = true;
+    }
+    wakeCv.notify_all();
+
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::push(int queue, Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+        queues[queue]->tasks.push_back(std::move(task));
+    }
+    queuedTasks++;
+}
+
+bool ThreadPool::popLocal(int queue, Task &task)
+{
+    WorkQueue &q = *queues[queue];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty())
+        return false;
+
+    task = std::move(q.tasks.front());
+    q.tasks.pop_front();
+    queuedTasks--;
+    return true;
+}
+
+bool ThreadPool::steal(int thief, Task &task)
+{
+    int numQueues = static_cast<int>(queues.size());
+    int start = thief < 0 ? 0 : thief + 1;
+
+    // Take from the back of the victim: that is the work its owner would reach last
+    for (int i = 0; i < numQueues; i++)
+    {
+        int victim = (start + i) % numQueues;
+        if (victim == thief)
+            continue;
+
+        WorkQueue &q = *queues[victim];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty())
+            continue;
+
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        queuedTasks--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(int index)
+{
+    while (true)
+    {
+        Task task;
+        if (popLocal(index, task) || steal(index, task))
+        {
+            task.run();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wakeCv.wait(lock, [this]
+                    { return stopping || queuedTasks.load() > 0; });
+        if (stopping && queuedTasks.load() == 0)
+            return;
+    }
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)> &body)
+{
+    if (count <= 0)
+        return;
+
+    struct Batch
+    {
+        std::atomic<int> pending{0};
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->pending = count;
+
+    // Hand out contiguous blocks so neighbouring items start on the same worker
+    int numQueues = static_cast<int>(queues.size());
+    for (int i = 0; i < count; i++)
+    {
+        int queue = static_cast<int>(static_cast<long long>(i) * numQueues / count);
+        push(queue, Task{[&body, i, batch]
+                         {
+                             try
+                             {
+                                 body(i);
+                             }
+                             catch (...)
+                             {
+                                 std::lock_guard<std::mutex> lock(batch->mutex);
+                                 if (!batch->error)
+                                     batch->error = std::current_exception();
+                             }
+
+                             if (--batch->pending == 0)
+                             {
+                                 std::lock_guard<std::mutex> lock(batch->mutex);
+                                 batch->done.notify_all();
+                             }
+                         }});
+    }
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+    }
+    wakeCv.notify_all();
+
+    // Help out instead of idling until the batch is finished
+    while (batch->pending.load() > 0)
+    {
+        Task task;
+        if (steal(-1, task))
+        {
+            task.run();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->done.wait(lock, [&batch]
+                         { return batch->pending.load() == 0; });
+    }
+
+    if (batch->error)
+        std::rethrow_exception(batch->error);
+}
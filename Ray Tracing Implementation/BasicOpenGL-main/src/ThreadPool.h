@@ -0,0 +1,60 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool.
+// Every worker owns a queue; it takes work from the front of its own queue and,
+// when that runs dry, steals from the back of the other queues. This keeps a
+// few expensive tasks (e.g. tiles full of mirrors) from stalling the others.
+class ThreadPool
+{
+public:
+    // numThreads <= 0 => one worker per hardware thread
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+    // Runs body(i) for every i in [0, count) and blocks until all are done.
+    // The calling thread helps with the work while it waits, so nested or
+    // concurrent calls from several threads are fine.
+    void parallelFor(int count, const std::function<void(int)> &body);
+
+private:
+    struct Task
+    {
+        std::function<void()> run;
+    };
+
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void workerLoop(int index);
+    void push(int queue, Task task);
+    bool popLocal(int queue, Task &task);
+    bool steal(int thief, Task &task);
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+
+    std::mutex wakeMutex;
+    std::condition_variable wakeCv;
+    std::atomic<int> queuedTasks{0};
+    bool stopping = false;
+};
+
+#endif // THREAD_POOL_H
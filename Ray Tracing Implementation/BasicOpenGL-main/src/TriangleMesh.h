@@ -0,0 +1,99 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <glm/glm.hpp>
+#include <cmath>
+#include <string>
+#include <vector>
+
+// Material of a group of faces (an OBJ usemtl/newmtl entry)
+struct MeshMaterial
+{
+    std::string name;
+    glm::vec3 color = glm::vec3(1.0f); // Kd
+    float shininess = 0.0f;            // Ns
+};
+
+// Indexed triangle mesh in model space. Triangles share the vertex buffer
+// through the index buffer (3 indices per triangle).
+struct TriangleMesh
+{
+    std::vector<glm::vec3> vertices;
+    std::vector<int> indices;
+    std::vector<int> faceMaterials; // per triangle: index in materials, -1 => the object's material
+    std::vector<MeshMaterial> materials;
+
+    int numTriangles() const { return static_cast<int>(indices.size() / 3); }
+};
+
+// Per-ray setup of the watertight ray/triangle test (Woop, Benthin and Wald,
+// "Watertight Ray/Triangle Intersection", JCGT 2013). The ray is sheared so it
+// runs along +z; edges shared by two triangles then give exactly opposite edge
+// functions, so no ray slips through between neighbouring triangles.
+struct WatertightRay
+{
+    glm::vec3 origin;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    WatertightRay(const glm::vec3 &origin, const glm::vec3 &direction) : origin(origin)
+    {
+        glm::vec3 absDirection = glm::abs(direction);
+        kz = absDirection.x > absDirection.y ? (absDirection.x > absDirection.z ? 0 : 2) : (absDirection.y > absDirection.z ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // Keep the winding of the sheared triangle
+        if (direction[kz] < 0.0f)
+            std::swap(kx, ky);
+        sx = direction[kx] / direction[kz];
+        sy = direction[ky] / direction[kz];
+        sz = 1.0f / direction[kz];
+    }
+};
+
+// Two-sided; true with the distance t >= 0 if the ray hits the triangle
+inline bool intersectTriangle(const WatertightRay &ray, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, float &t)
+{
+    glm::vec3 a = v0 - ray.origin;
+    glm::vec3 b = v1 - ray.origin;
+    glm::vec3 c = v2 - ray.origin;
+
+    float ax = a[ray.kx] - ray.sx * a[ray.kz], ay = a[ray.ky] - ray.sy * a[ray.kz];
+    float bx = b[ray.kx] - ray.sx * b[ray.kz], by = b[ray.ky] - ray.sy * b[ray.kz];
+    float cx = c[ray.kx] - ray.sx * c[ray.kz], cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+    // Scaled barycentric coordinates (edge functions)
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+
+    // On an edge the sign decides which triangle owns the hit, so redo it exactly
+    if (u == 0.0f || v == 0.0f || w == 0.0f)
+    {
+        u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+        v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+        w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+    }
+
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+        return false;
+
+    float det = u + v + w;
+    if (det == 0.0f)
+        return false;
+
+    float az = ray.sz * a[ray.kz], bz = ray.sz * b[ray.kz], cz = ray.sz * c[ray.kz];
+    float scaledT = u * az + v * bz + w * cz;
+    if (det < 0.0f)
+    {
+        scaledT = -scaledT;
+        det = -det;
+    }
+    if (scaledT < 0.0f)
+        return false;
+
+    t = scaledT / det;
+    return true;
+}
+
+#endif // TRIANGLE_MESH_H
@@ -0,0 +1,276 @@
+#include "Wavefront.h"
+#include "RayPacket.h"
+#include "phong.h"
+
+#include <algorithm>
+#include <limits>
+
+// Items per parallel task, large enough to amortize the scheduling
+static const int STAGE_GRAIN = 1024;
+
+// Secondary ray bins: 8 direction octants x BIN_GRID^3 origin cells
+static const int BIN_GRID = 8;
+static const int NUM_BINS = 8 * BIN_GRID * BIN_GRID * BIN_GRID;
+static const int MIN_BINNED_RAYS = 256; // sorting fewer rays does not pay off
+
+WavefrontTracer::WavefrontTracer(Scene &scene, ThreadPool *pool, int maxDepth, bool packets, bool binning,
+                                 RenderStatsAccumulator *stats)
+    : scene(scene), pool(pool), maxDepth(maxDepth), packets(packets), binning(binning), stats(stats)
+{
+}
+
+void WavefrontTracer::forRange(int count, const std::function<void(int begin, int end)> &body)
+{
+    if (count <= 0)
+        return;
+    // The stage timer runs inside measure, so its time is counted with the block
+    auto run = [&](int begin, int end)
+    {
+        if (stats)
+            stats->measure([&]
+                           {
+                RENDER_STAGE(STAGE_TRACE);
+                body(begin, end); });
+        else
+        {
+            RENDER_STAGE(STAGE_TRACE);
+            body(begin, end);
+        }
+    };
+    if (!pool || count <= STAGE_GRAIN)
+    {
+        run(0, count);
+        return;
+    }
+
+    int blocks = (count + STAGE_GRAIN - 1) / STAGE_GRAIN;
+    pool->parallelFor(blocks, [&](int block)
+                      { run(block * STAGE_GRAIN, std::min(count, (block + 1) * STAGE_GRAIN)); });
+}
+
+void WavefrontTracer::trace(int count, const std::function<Ray(int)> &generate, glm::vec3 *colors)
+{
+    // The stages pass hits of the compiled scene from one to the next
+    if (!scene.isCompiled())
+        scene.buildAccelerationStructure();
+
+    // Generate
+    paths.resize(count);
+    forRange(count, [&](int begin, int end)
+             {
+        for (int i = begin; i < end; i++)
+        {
+            paths[i] = {generate(i), glm::vec3(1.0f), i, 0};
+            colors[i] = glm::vec3(0.0f, 0.0f, 0.0f);
+        } });
+
+    bool primary = true;
+    while (!paths.empty())
+    {
+        if (!primary && binning)
+            binStage();
+        intersectStage(primary);
+        shadeStage();
+        shadowStage();
+        accumulateStage(colors);
+        compactStage();
+        primary = false;
+    }
+}
+
+void WavefrontTracer::binStage()
+{
+    // Binning only makes BVH traversal more coherent, flat loops touch every sphere anyway
+    int count = static_cast<int>(paths.size());
+    if (count < MIN_BINNED_RAYS || !scene.compiled.usesBVH())
+        return;
+
+    // Origin cells span the bounding box of this wave's origins
+    AABB bounds;
+    for (const Path &path : paths)
+        bounds.expand(path.ray.origin);
+    glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(1e-6f));
+    glm::vec3 scale = static_cast<float>(BIN_GRID) / extent;
+
+    binKeys.resize(count);
+    binStarts.assign(NUM_BINS + 1, 0);
+    for (int i = 0; i < count; i++)
+    {
+        const Ray &ray = paths[i].ray;
+        int octant = (ray.direction.x < 0.0f ? 1 : 0) | (ray.direction.y < 0.0f ? 2 : 0) | (ray.direction.z < 0.0f ? 4 : 0);
+        glm::ivec3 cell = glm::clamp(glm::ivec3((ray.origin - bounds.min) * scale), glm::ivec3(0), glm::ivec3(BIN_GRID - 1));
+        binKeys[i] = ((octant * BIN_GRID + cell.z) * BIN_GRID + cell.y) * BIN_GRID + cell.x;
+        binStarts[binKeys[i] + 1]++;
+    }
+
+    // Counting sort; the results find their pixel again through Path::output
+    for (int bin = 0; bin < NUM_BINS; bin++)
+        binStarts[bin + 1] += binStarts[bin];
+    nextPaths.resize(count);
+    for (int i = 0; i < count; i++)
+        nextPaths[binStarts[binKeys[i]]++] = paths[i];
+    std::swap(paths, nextPaths);
+}
+
+void WavefrontTracer::intersectStage(bool primary)
+{
+    int count = static_cast<int>(paths.size());
+    hits.resize(count);
+
+    // Camera rays of neighbouring pixels share their origin and are coherent
+    if (primary && packets)
+    {
+        int numPackets = (count + RayPacket::MAX_RAYS - 1) / RayPacket::MAX_RAYS;
+        forRange(numPackets, [&](int begin, int end)
+                 {
+            for (int p = begin; p < end; p++)
+            {
+                int first = p * RayPacket::MAX_RAYS;
+                int last = std::min(count, first + RayPacket::MAX_RAYS);
+
+                RayPacket packet;
+                packet.origin = paths[first].ray.origin;
+                bool coherent = true;
+                for (int i = first; i < last; i++)
+                {
+                    coherent = coherent && paths[i].ray.origin == packet.origin;
+                    packet.directions[packet.count++] = paths[i].ray.direction;
+                }
+
+                if (coherent)
+                {
+                    scene.compiled.closestHitPacket(packet, &hits[first]);
+                    continue;
+                }
+                for (int i = first; i < last; i++)
+                    hits[i] = scene.compiled.closestHit(paths[i].ray.origin, paths[i].ray.direction);
+            } });
+        return;
+    }
+
+    forRange(count, [&](int begin, int end)
+             {
+        for (int i = begin; i < end; i++)
+            hits[i] = scene.compiled.closestHit(paths[i].ray.origin, paths[i].ray.direction); });
+}
+
+void WavefrontTracer::shadeStage()
+{
+    int count = static_cast<int>(paths.size());
+    int numLights = scene.getNumLights();
+    isSurface.assign(count, 0);
+    continues.assign(count, 0);
+    surfaceBase.resize(count);
+    nextPaths.resize(count);
+    shadowSlots.resize(static_cast<size_t>(count) * numLights);
+
+    forRange(count, [&](int begin, int end)
+             {
+        for (int i = begin; i < end; i++)
+        {
+            Path &path = paths[i];
+            RENDER_COUNTER(countPathDepth(path.level));
+            if (hits[i].type == PRIMITIVE_NONE)
+                continue; // Black color (no hit)
+
+            Intersection hit;
+            hit.t = std::numeric_limits<float>::infinity();
+            scene.fillIntersection(hit, hits[i], path.ray);
+
+            // Reflective or transparent: the path goes on in the next queue
+            if (hit.ObjectStatus != 0)
+            {
+                Ray next;
+                if (path.level < maxDepth && Phong::continuePath(path.ray, hit, next))
+                {
+                    nextPaths[i] = {next, path.weight, path.output, path.level + 1};
+                    continues[i] = 1;
+                }
+                continue;
+            }
+
+            // Regular surface: everything but the visibility of the lights
+            isSurface[i] = 1;
+            surfaceBase[i] = Phong::calcEmissionColor(scene) + Phong::calcAmbientColor(scene, hit);
+            for (int l = 0; l < numLights; l++)
+            {
+                LightSource *light = scene.getLight(l);
+                ShadowSlot &slot = shadowSlots[static_cast<size_t>(i) * numLights + l];
+                slot.traced = Phong::buildShadowRay(hit, light, slot.ray, slot.lightDistance);
+                slot.blocked = !slot.traced;
+                if (slot.traced)
+                {
+                    glm::vec3 specularColor = Phong::calcSpecularColor(scene, hit, light, path.ray);
+                    slot.contribution = (Phong::calcDiffuseColor(scene, hit, light) + specularColor) * light->intensity;
+                }
+                else
+                    RENDER_COUNTER(countConeRejection()); // outside a spotlight cone
+            }
+        } });
+}
+
+void WavefrontTracer::shadowStage()
+{
+    // Compact the shadow rays into one queue, in path and light order
+    int count = static_cast<int>(paths.size());
+    int numLights = scene.getNumLights();
+    shadowQueue.clear();
+    for (int i = 0; i < count; i++)
+    {
+        if (!isSurface[i])
+            continue;
+        for (int l = 0; l < numLights; l++)
+        {
+            int slot = i * numLights + l;
+            if (shadowSlots[slot].traced)
+                shadowQueue.push_back(slot);
+        }
+    }
+
+    forRange(static_cast<int>(shadowQueue.size()), [&](int begin, int end)
+             {
+        for (int q = begin; q < end; q++)
+        {
+            ShadowSlot &slot = shadowSlots[shadowQueue[q]];
+            LightSource *light = scene.getLight(shadowQueue[q] % numLights);
+            slot.blocked = Phong::traceShadowRay(scene, slot.ray, slot.lightDistance, light);
+        } });
+}
+
+void WavefrontTracer::accumulateStage(glm::vec3 *colors)
+{
+    int count = static_cast<int>(paths.size());
+    int numLights = scene.getNumLights();
+
+    // A path has a single output, no two paths of the queue write the same color
+    forRange(count, [&](int begin, int end)
+             {
+        for (int i = begin; i < end; i++)
+        {
+            if (!isSurface[i])
+                continue;
+
+            // Same order of additions as Phong::calcSurfaceColor
+            glm::vec3 color = surfaceBase[i];
+            for (int l = 0; l < numLights; l++)
+            {
+                const ShadowSlot &slot = shadowSlots[static_cast<size_t>(i) * numLights + l];
+                if (!slot.blocked)
+                    color += slot.contribution;
+            }
+            colors[paths[i].output] += paths[i].weight * color;
+        } });
+}
+
+void WavefrontTracer::compactStage()
+{
+    int count = static_cast<int>(paths.size());
+    int live = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (continues[i])
+            nextPaths[live++] = nextPaths[i];
+    }
+    nextPaths.resize(live);
+    std::swap(paths, nextPaths);
+}
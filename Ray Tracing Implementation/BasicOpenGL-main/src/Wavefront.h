@@ -0,0 +1,81 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <functional>
+#include <vector>
+#include "RenderStats.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+
+// Breadth-first path evaluation.
+// Instead of following one path to its end before starting the next, a whole
+// queue of paths goes through one stage at a time: intersect, shade, trace
+// shadow rays, accumulate. Paths that continue (reflection, refraction) are
+// compacted into the next queue. Every stage is one tight loop over its queue
+// split across the pool, and the hit queries of a stage run back to back.
+//
+// Produces exactly the same colors as Phong::calcColor for every path.
+class WavefrontTracer
+{
+public:
+    // pool may be null (single thread). Primary rays of 64 consecutive paths
+    // with a common origin are traced as one packet if packets is set. With
+    // binning (off by default, as in RenderSettings), reflected and refracted
+    // rays are sorted by direction octant and origin cell before they are
+    // traced, so rays that walk the same part of the BVH run one after the
+    // other. stats (optional) receives the counters of all stages.
+    WavefrontTracer(Scene &scene, ThreadPool *pool, int maxDepth, bool packets, bool binning = false,
+                    RenderStatsAccumulator *stats = nullptr);
+
+    // Traces count paths, path i starting with generate(i), and stores the
+    // color of path i in colors[i]. Builds the acceleration structure of the
+    // scene first if it has none.
+    void trace(int count, const std::function<Ray(int)> &generate, glm::vec3 *colors);
+
+private:
+    struct Path
+    {
+        Ray ray;
+        glm::vec3 weight;
+        int output; // index into colors
+        int level;
+    };
+
+    // Shading of a lit surface waiting for its shadow rays
+    struct ShadowSlot
+    {
+        Ray ray;
+        float lightDistance;
+        glm::vec3 contribution; // added if the light is not blocked
+        bool traced;            // false: outside a spotlight cone, never lit
+        bool blocked;
+    };
+
+    Scene &scene;
+    ThreadPool *pool;
+    int maxDepth;
+    bool packets;
+    bool binning;
+    RenderStatsAccumulator *stats;
+
+    // Stage queues, kept between calls to avoid reallocating
+    std::vector<Path> paths, nextPaths;
+    std::vector<PrimitiveHit> hits;
+    std::vector<char> isSurface, continues;
+    std::vector<glm::vec3> surfaceBase;
+    std::vector<ShadowSlot> shadowSlots; // numLights per path
+    std::vector<int> shadowQueue;        // slots that need a ray traced
+    std::vector<int> binKeys, binStarts;  // binning
+
+    void binStage();
+    void intersectStage(bool primary);
+    void shadeStage();
+    void shadowStage();
+    void accumulateStage(glm::vec3 *colors);
+    void compactStage();
+
+    // Runs body(begin, end) over [0, count) in blocks, in parallel if there is a pool
+    void forRange(int count, const std::function<void(int begin, int end)> &body);
+};
+
+#endif // WAVEFRONT_H
@@ -12,18 +12,44 @@
 #include <Texture.h>
 #include <Camera.h>
 
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
 #include <iostream>
+#include <thread>
 #include <../include/stb/stb_image.h>
 #include <../include/stb/stb_image_write.h>
 #include <SceneReader.h>
+#include "Animation.h"
+#include "BinaryScene.h"
 #include "phong.h"
+#include "Renderer.h"
+#include "SceneDiff.h"
+#include "IntersectKernels.h"
 
 /* Window size */
 #define WIDTH 800
 #define HEIGHT 800
 
-void SaveImage(const std::vector<std::vector<std::vector<unsigned char>>> &imageArray, const std::string &imageName, const std::string &outputDirectory);
-void RayTrace(Scene &scene, int width, int height, std::string outputImageName, std::string filepath_outputImage);
+void SaveImage(const Framebuffer &framebuffer, const std::string &imageName, const std::string &outputDirectory);
+void SaveRenderStats(const RenderStats &stats, const std::string &imageName, const std::string &outputDirectory);
+void RayTrace(Scene &scene, int width, int height, std::string outputImageName, std::string filepath_outputImage, const RenderSettings &settings);
+void RenderAnimation(Scene &scene, Animation &animation, int firstFrame, int lastFrame, int width, int height,
+                     const std::string &outputImageName, const std::string &filepath_outputImage, const RenderSettings &settings);
+void WatchScene(Scene *scene, const std::string &sceneFile, int width, int height,
+                const std::string &outputImageName, const std::string &filepath_outputImage, const RenderSettings &settings);
+
+// Ctrl+C stops a progressive render after the current pass, the image so far is still saved
+static std::atomic<Renderer *> activeRenderer{nullptr};
+
+static void stopRender(int)
+{
+    Renderer *renderer = activeRenderer.load();
+    if (renderer)
+        renderer->Stop();
+}
 
 int main(int argc, char *argv[])
 {
@@ -32,90 +58,321 @@ int main(int argc, char *argv[])
     std::string filepath_outputImage = "C:\\Users\\aseel\\OneDrive\\Desktop\\computer graphics\\Assignment2\\BasicOpenGL-main\\src\\res\\";
     std::string outputImageName = "raytracing.png";
 
+    // Usage: main [scene file] [output directory] [image name] [--threads N] [--serial] [--samples N] [--seed N] [--sampler random|stratified|sobol|r2] [--max-depth N]
+    //                 [--wavefront on|off|auto] [--binning on|off] [--kernel scalar|avx2|neon] [--packets 4|8]
+    //                 [--progressive] [--preview-passes N] [--preview-seconds S]
+    //                 [--adaptive on|off] [--adaptive-min N] [--adaptive-threshold T]
+    //                 [--convert file.rtscene [--no-bvh]] [--animate keys.txt [--frames FIRST-LAST]] [--watch]
+    // Scene files may be text or binary (see BinaryScene); --convert writes the scene as binary and exits.
+    // --animate renders the frames of a keyframe file (see Animation) as image_0000.png, image_0001.png, ...
+    // --watch renders the scene, then renders it again whenever the scene file is saved, tracing only the
+    // pixels the edit can change (see Renderer::Rerender). Runs until interrupted.
+    RenderSettings settings;
+    std::string adaptive = "scene"; // scene => Eye::modeFlag decides
+    bool samplesGiven = false;
+    std::string convertOutput;
+    bool convertBVH = true;
+    std::string animationFile;
+    int firstFrame = 0, lastFrame = -1; // -1 => the last frame of the animation
+    bool watch = false;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+            settings.numThreads = std::stoi(argv[++i]);
+        else if (arg == "--serial")
+            settings.parallel = false;
+        else if (arg == "--samples" && i + 1 < argc)
+        {
+            settings.samplesPerPixel = std::stoi(argv[++i]);
+            samplesGiven = true;
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+            settings.seed = static_cast<unsigned int>(std::stoul(argv[++i]));
+        else if (arg == "--wavefront" && i + 1 < argc)
+        {
+            std::string wavefront = argv[++i];
+            if (wavefront == "on")
+                settings.wavefrontMinPixels = 0;
+            else if (wavefront == "off")
+                settings.wavefrontMinPixels = -1;
+        }
+        else if (arg == "--binning" && i + 1 < argc)
+            settings.binSecondaryRays = std::string(argv[++i]) != "off";
+        else if (arg == "--max-depth" && i + 1 < argc)
+            settings.maxDepth = std::stoi(argv[++i]);
+        else if (arg == "--sampler" && i + 1 < argc)
+        {
+            std::string sampler = argv[++i];
+            if (!parseSamplerType(sampler, settings.sampler))
+                std::cerr << "Unknown sampler '" << sampler << "', using " << samplerName(settings.sampler) << std::endl;
+        }
+        else if (arg == "--packets" && i + 1 < argc)
+            settings.packetSize = std::stoi(argv[++i]);
+        else if (arg == "--adaptive" && i + 1 < argc)
+            adaptive = argv[++i];
+        else if (arg == "--adaptive-min" && i + 1 < argc)
+            settings.adaptiveMinSamples = std::stoi(argv[++i]);
+        else if (arg == "--adaptive-threshold" && i + 1 < argc)
+            settings.adaptiveThreshold = std::stof(argv[++i]);
+        else if (arg == "--progressive")
+            settings.progressive = true;
+        else if (arg == "--preview-passes" && i + 1 < argc)
+            settings.previewPasses = std::stoi(argv[++i]);
+        else if (arg == "--preview-seconds" && i + 1 < argc)
+            settings.previewSeconds = std::stod(argv[++i]);
+        else if (arg == "--convert" && i + 1 < argc)
+            convertOutput = argv[++i];
+        else if (arg == "--no-bvh")
+            convertBVH = false;
+        else if (arg == "--animate" && i + 1 < argc)
+            animationFile = argv[++i];
+        else if (arg == "--frames" && i + 1 < argc)
+        {
+            std::string frames = argv[++i];
+            size_t dash = frames.find('-');
+            firstFrame = std::stoi(frames.substr(0, dash));
+            lastFrame = dash == std::string::npos ? firstFrame : std::stoi(frames.substr(dash + 1));
+        }
+        else if (arg == "--watch")
+            watch = true;
+        else if (arg == "--kernel" && i + 1 < argc)
+        {
+            std::string kernel = argv[++i];
+            if (!selectIntersectKernels(kernel))
+                std::cerr << "Intersection kernel '" << kernel << "' is not available, using " << getIntersectKernels().name << std::endl;
+        }
+        else
+            positional.push_back(arg);
+    }
+    if (positional.size() > 0)
+        filepath_input = positional[0];
+    if (positional.size() > 1)
+        filepath_outputImage = positional[1];
+    if (positional.size() > 2)
+        outputImageName = positional[2];
+
     // Create SceneReader object and read the scene from the file
     SceneReader reader;
     Scene* scene = reader.readScene(filepath_input);
 
+    if (!convertOutput.empty())
+    {
+        BinaryScene::write(*scene, convertOutput, convertBVH);
+        std::cout << "Wrote " << convertOutput << " (" << scene->compiled.numSpheres() << " spheres, "
+                  << scene->compiled.numPlanes() << " planes, " << scene->compiled.numTriangles() << " triangles)" << std::endl;
+        delete scene;
+        return 0;
+    }
+
+    // A non-zero mode flag on the eye turns on adaptive anti-aliasing
+    if (adaptive == "scene")
+        settings.adaptive = scene->eye.modeFlag != 0;
+    else
+        settings.adaptive = adaptive == "on";
+    if (settings.adaptive && !samplesGiven)
+        settings.samplesPerPixel = 16; // edges get 16 samples, flat regions 2
+
+    if (!animationFile.empty())
+    {
+        Animation animation = Animation::load(animationFile);
+        if (lastFrame < 0 || lastFrame >= animation.numFrames())
+            lastFrame = animation.numFrames() - 1;
+        RenderAnimation(*scene, animation, firstFrame, lastFrame, WIDTH, HEIGHT, outputImageName, filepath_outputImage, settings);
+        delete scene;
+        return 0;
+    }
+
+    if (watch)
+    {
+        WatchScene(scene, filepath_input, WIDTH, HEIGHT, outputImageName, filepath_outputImage, settings);
+        return 0;
+    }
+
     std::cout << "  we are before the ray trace " << std::endl;
 
-    RayTrace(*(scene), WIDTH, HEIGHT, outputImageName, filepath_outputImage);
+    RayTrace(*(scene), WIDTH, HEIGHT, outputImageName, filepath_outputImage, settings);
 
     std::cout << "  we are after the ray trace " << std::endl;
 
     return 0;
 }
 
-void RayTrace(Scene &scene, int width, int height, std::string outputImageName, std::string filepath_outputImage) {
+void RayTrace(Scene &scene, int width, int height, std::string outputImageName, std::string filepath_outputImage, const RenderSettings &settings) {
     
-    const int SAMPLES_PER_PIXEL = 1; // Adjust this to control the quality of anti-aliasing
-    std::vector<std::vector<std::vector<unsigned char>>> image(
-        height, std::vector<std::vector<unsigned char>>(width, std::vector<unsigned char>(3)));
-
-    // Iterate over height (Y) first for better cache locality (row-major order)
-    for (int y = 0; y < height; y++) {
-        int flipped_y = height - 1 - y; // Flip the Y-coordinate to correct vertical orientation
-
-        for (int x = 0; x < width; x++) {
-            glm::vec3 accumulatedColor(0.0f);
-
-            // Supersampling: Take multiple samples per pixel
-            for (int sample = 0; sample < SAMPLES_PER_PIXEL; sample++) {
-                // Generate jittered sub-pixel coordinates
-                float offsetX = (static_cast<float>(rand()) / RAND_MAX - 0.5f) / width;
-                float offsetY = (static_cast<float>(rand()) / RAND_MAX - 0.5f) / height;
-
-                // Construct ray for the sub-pixel
-                Ray ray = SceneReader::ConstructRayThroughPixel(
-                    x + offsetX, flipped_y + offsetY, scene);
-
-                // Accumulate the color
-                accumulatedColor += Phong::calcColor(scene, ray, 0);
-            }
-
-            // Average the accumulated color
-            glm::vec3 finalColor = accumulatedColor / static_cast<float>(SAMPLES_PER_PIXEL);
-
-            // Store the RGB values in the image
-            image[y][x][0] = static_cast<unsigned char>(255 * glm::clamp(finalColor.r, 0.0f, 1.0f)); // Red
-            image[y][x][1] = static_cast<unsigned char>(255 * glm::clamp(finalColor.g, 0.0f, 1.0f)); // Green
-            image[y][x][2] = static_cast<unsigned char>(255 * glm::clamp(finalColor.b, 0.0f, 1.0f)); // Blue
-        }
+    Framebuffer image(width, height);
+
+    RenderSettings frameSettings = settings;
+    frameSettings.width = width;
+    frameSettings.height = height;
+
+    Renderer renderer(scene, frameSettings);
+    if (settings.progressive)
+    {
+        activeRenderer.store(&renderer);
+        std::signal(SIGINT, stopRender);
     }
 
+    // Previews overwrite the output file, so it always holds the latest image
+    renderer.Render(image, [&](const Framebuffer &preview, int samples)
+                    {
+        std::cout << "Preview after " << samples << "/" << settings.samplesPerPixel << " samples per pixel" << std::endl;
+        SaveImage(preview, outputImageName, filepath_outputImage); });
+
+    if (settings.progressive)
+    {
+        std::signal(SIGINT, SIG_DFL);
+        activeRenderer.store(nullptr);
+        std::cout << "Rendered " << renderer.getCompletedSamples() << "/" << settings.samplesPerPixel << " samples per pixel" << std::endl;
+    }
+
+    const RenderStats &stats = renderer.getStats();
+    std::cout << "Camera rays: " << stats.cameraRays << " (" << static_cast<double>(stats.cameraRays) / (width * height) << " per pixel)" << std::endl;
+    std::cout << "Shadow rays: " << stats.shadowRays << ", occluder cache hits: " << stats.occluderCacheHits
+              << " (" << 100.0 * stats.occluderCacheHitRate() << "%)" << std::endl;
+
     // Save the image to the output file
     SaveImage(image, outputImageName, filepath_outputImage);
+
+#ifdef RT_RENDER_COUNTERS
+    // One frame per run: the totals of all threads are the counters of this frame
+    SaveRenderStats(collectRenderStats(), outputImageName, filepath_outputImage);
+#endif
 }
 
 
 
-void SaveImage(const std::vector<std::vector<std::vector<unsigned char>>> &imageArray, const std::string &imageName, const std::string &outputDirectory)
+void RenderAnimation(Scene &scene, Animation &animation, int firstFrame, int lastFrame, int width, int height,
+                     const std::string &outputImageName, const std::string &filepath_outputImage, const RenderSettings &settings)
 {
-    // Construct the full file path
-    std::string filePath = outputDirectory + imageName;
+    // image.png => image_0000.png, image_0001.png, ...
+    size_t dot = outputImageName.rfind('.');
+    std::string stem = outputImageName.substr(0, dot);
+    std::string extension = dot == std::string::npos ? ".png" : outputImageName.substr(dot);
+
+    RenderSettings frameSettings = settings;
+    frameSettings.width = width;
+    frameSettings.height = height;
+    frameSettings.progressive = false;
+
+    // One scene, renderer and thread pool for all frames: a frame only pays for
+    // moving what its keys change (see Animation::apply) and for tracing
+    Framebuffer image(width, height);
+    Renderer renderer(scene, frameSettings);
+    RenderStats total;
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = firstFrame; frame <= lastFrame; frame++)
+    {
+        auto frameStart = std::chrono::steady_clock::now();
+#ifdef RT_RENDER_COUNTERS
+        RenderStats before = collectRenderStats();
+#endif
+        animation.apply(scene, frame);
+        renderer.Render(image);
+        total += renderer.getStats();
 
-    // Derive image dimensions from the input array
-    int height = imageArray.size();         // Number of rows
-    int width = imageArray[0].size();       // Number of columns
-    int channels = imageArray[0][0].size(); // Number of color channels (e.g., 3 for RGB)
+        char number[16];
+        std::snprintf(number, sizeof(number), "_%04d", frame);
+        SaveImage(image, stem + number + extension, filepath_outputImage);
+#ifdef RT_RENDER_COUNTERS
+        SaveRenderStats(collectRenderStats() - before, stem + number + extension, filepath_outputImage);
+#endif
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - frameStart;
+        std::cout << "Frame " << frame << ": " << seconds.count() << " s" << std::endl;
+    }
+
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    int frames = lastFrame - firstFrame + 1;
+    std::cout << "Rendered " << frames << " frames in " << seconds.count() << " s (" << seconds.count() / std::max(frames, 1) << " s per frame), "
+              << total.cameraRays << " camera rays, " << total.shadowRays << " shadow rays" << std::endl;
+}
+
+void WatchScene(Scene *scene, const std::string &sceneFile, int width, int height,
+                const std::string &outputImageName, const std::string &filepath_outputImage, const RenderSettings &settings)
+{
+    RenderSettings frameSettings = settings;
+    frameSettings.width = width;
+    frameSettings.height = height;
 
-    // Create a buffer to hold the image data in a format suitable for saving
-    unsigned char *buffer = new unsigned char[width * height * channels];
+    // Every version of the scene gets a renderer of its own, the threads stay
+    std::unique_ptr<ThreadPool> pool;
+    if (settings.parallel)
+        pool = std::make_unique<ThreadPool>(settings.numThreads);
 
-    // Copy image data to the buffer
-    for (int y = 0; y < height; ++y)
+    Framebuffer image(width, height);
+    RayTreeRecords records;
+    auto start = std::chrono::steady_clock::now();
     {
-        for (int x = 0; x < width; ++x)
+        Renderer renderer(*scene, frameSettings, pool.get());
+        renderer.RenderRecorded(image, records);
+    }
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    std::cout << "Rendered in " << seconds.count() << " s, " << records.numRecords() << " rays recorded ("
+              << records.numRecords() * sizeof(RayRecord) / (1024 * 1024) << " MB)" << std::endl;
+    SaveImage(image, outputImageName, filepath_outputImage);
+
+    std::filesystem::file_time_type lastWrite = std::filesystem::last_write_time(sceneFile);
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        std::error_code error;
+        std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(sceneFile, error);
+        if (error || writeTime == lastWrite)
+            continue;
+        lastWrite = writeTime;
+
+        Scene *edited = nullptr;
+        try
+        {
+            SceneReader reader;
+            edited = reader.readScene(sceneFile);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << sceneFile << ": " << e.what() << ", keeping the last image" << std::endl;
+            continue;
+        }
+
+        SceneChanges changes = diffScenes(*scene, *edited);
+        if (changes.empty())
         {
-            int index = (y * width + x) * channels;
-            for (int c = 0; c < channels; ++c)
-            {
-                buffer[index + c] = imageArray[y][x][c];
-            }
+            std::cout << "Nothing to render again" << std::endl;
+            delete edited;
+            continue;
         }
+
+        start = std::chrono::steady_clock::now();
+        size_t traced;
+        {
+            Renderer renderer(*edited, frameSettings, pool.get());
+            traced = renderer.Rerender(image, records, changes);
+        }
+        seconds = std::chrono::steady_clock::now() - start;
+        delete scene;
+        scene = edited;
+
+        size_t pixels = static_cast<size_t>(width) * height;
+        std::cout << "Traced " << traced << " of " << pixels << " pixels (" << 100.0 * traced / pixels << "%) in "
+                  << seconds.count() << " s" << std::endl;
+        SaveImage(image, outputImageName, filepath_outputImage);
     }
+}
+
+void SaveImage(const Framebuffer &framebuffer, const std::string &imageName, const std::string &outputDirectory)
+{
+    RENDER_STAGE(STAGE_SAVE);
+
+    // Construct the full file path
+    std::string filePath = outputDirectory + imageName;
+
+    // The 8-bit plane is already laid out the way stb expects it
+    int width = framebuffer.getWidth();
+    int height = framebuffer.getHeight();
+    int channels = Framebuffer::CHANNELS;
 
     // Save the image as a PNG file
-    int result = stbi_write_png(filePath.c_str(), width, height, channels, buffer, width * channels);
+    int result = stbi_write_png(filePath.c_str(), width, height, channels, framebuffer.pixels(), framebuffer.getRowStride());
     if (result)
     {
         std::cout << "Image saved successfully to " << filePath << std::endl;
@@ -124,7 +381,17 @@ void SaveImage(const std::vector<std::vector<std::vector<unsigned char>>> &image
     {
         std::cerr << "Failed to save the image to " << filePath << std::endl;
     }
+}
 
-    // Free the buffer after saving
-    delete[] buffer;
+void SaveRenderStats(const RenderStats &stats, const std::string &imageName, const std::string &outputDirectory)
+{
+    std::string filePath = renderStatsFile(outputDirectory + imageName);
+    if (writeRenderStatsJson(filePath, stats))
+    {
+        std::cout << "Render counters saved to " << filePath << std::endl;
+    }
+    else
+    {
+        std::cerr << "Failed to save the render counters to " << filePath << std::endl;
+    }
 }
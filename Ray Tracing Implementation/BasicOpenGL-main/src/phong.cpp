@@ -1,62 +1,92 @@
-#include "Phong.h"
+#include "phong.h"
 #include "Scene.h"
 #include <glm/glm.hpp>
+#include <limits>
+#include "RayTreeRecords.h"
+#include "RenderStats.h"
 
-#define MAX_LEVEL 5
-
-glm::vec3 Phong::calcColor(Scene &scene, Ray &ray, int level) {                         
+glm::vec3 Phong::calcColor(Scene &scene, Ray &ray, int level, int maxDepth) {
     // Get the intersection point
     Intersection hit = scene.GetHit(ray);
 
-    int status = hit.ObjectStatus;  // Object=0.0, Reflective=1, Transparent=2
+    return shadeHit(scene, ray, hit, level, maxDepth);
+}
+
+glm::vec3 Phong::shadeHit(Scene &scene, Ray &ray, Intersection &hit, int level, int maxDepth) {
+    // Reflective and transparent surfaces continue the path with a new ray instead
+    // of recursing. Pending bounces wait on a fixed-size stack together with the
+    // weight they contribute with, so any depth runs in constant stack space.
+    struct Bounce {
+        Ray ray;
+        glm::vec3 weight;
+        int level;
+    };
+    Bounce stack[BOUNCE_STACK_SIZE];
+    int stackSize = 0;
 
-    // Start with emission and ambient components
     glm::vec3 color = glm::vec3(0.0f, 0.0f, 0.0f);
+    addBounce(scene, ray, hit, glm::vec3(1.0f), level, maxDepth, color, [&](const Ray &next, const glm::vec3 &weight, int nextLevel) {
+        stack[stackSize++] = {next, weight, nextLevel};
+    });
+
+    while (stackSize > 0) {
+        Bounce bounce = stack[--stackSize];
+        Intersection next = scene.GetHit(bounce.ray);
+        addBounce(scene, bounce.ray, next, bounce.weight, bounce.level, maxDepth, color, [&](const Ray &nextRay, const glm::vec3 &weight, int nextLevel) {
+            stack[stackSize++] = {nextRay, weight, nextLevel};
+        });
+    }
+
+    return color;
+}
+
+template <typename PushFn>
+void Phong::addBounce(Scene &scene, Ray &ray, Intersection &hit, const glm::vec3 &weight, int level, int maxDepth, glm::vec3 &color, PushFn &&push) {
+    int status = hit.ObjectStatus;  // Object=0.0, Reflective=1, Transparent=2
+    RENDER_COUNTER(countPathDepth(level));
+
+    RayTreeRecording::recordRay(ray, hit.hitObject ? hit.t : std::numeric_limits<float>::infinity(), hit.objectIndex);
 
     // Black color (no hit)
-    if (!hit.hitObject) {    
-        return glm::vec3(0.0f, 0.0f, 0.0f);
+    if (!hit.hitObject) {
+        return;
     }
 
-    // Regular object
-    if (status == 0) { 
-        color = calcEmissionColor(scene) + calcAmbientColor(scene, hit);
+    // Regular object: the path ends here
+    if (status == 0) {
+        color += weight * calcSurfaceColor(scene, ray, hit);
+    }
 
-        // Add diffuse and specular contributions from all lights
-        for (int i = 0; i < scene.getNumLights(); i++) {
-            LightSource *light = scene.getLight(i);
+    // Reflective or transparent object: continue with the next ray
+    else {
+        // Past the depth limit the path adds nothing
+        if (level >= maxDepth) {
+            return;
+        }
 
-            if (!occluded(scene, hit, light)) {
-                glm::vec3 specularColor = calcSpecularColor(scene, hit, light, ray); 
-                color += (calcDiffuseColor(scene, hit, light) + specularColor) * light->intensity;
-            }
+        Ray next;
+        if (continuePath(ray, hit, next)) {
+            push(next, weight, level + 1);
         }
     }
+}
 
-    // Reflective object
-    else if (status == 1) {
-        // Base case for recursion
-        if (level >= MAX_LEVEL) {
-            return glm::vec3(0.0f);  // Don't add anything
-        }
+bool Phong::continuePath(Ray &ray, Intersection &hit, Ray &next) {
+    int status = hit.ObjectStatus;  // Object=0.0, Reflective=1, Transparent=2
 
+    // Reflective object
+    if (status == 1) {
         // Reflective contribution
         glm::vec3 normal = hit.normal;  // Surface normal
-        Ray outRay = ConstructOutRay(ray, normal, hit.point);
-        outRay.objectId = hit.objectId; 
-
-        glm::vec3 reflectedColor = calcColor(scene, outRay, level + 1);
-        color += reflectedColor;
+        next = ConstructOutRay(ray, normal, hit.point);
+        next.objectId = hit.objectId;
+        countSecondaryRay();
+        RENDER_COUNTER(countReflectionRay());
+        return true;
     }
 
     // Transparent (Refractive) object
-    else if (status == 2) {
-        // Base case for recursion
-        if (level >= MAX_LEVEL) {
-            return glm::vec3(0.0f) ;
-        }
-
-
+    if (status == 2) {
         glm::vec3 normal = hit.normal;
 
         // Calculate entry refraction ray
@@ -64,13 +94,33 @@ glm::vec3 Phong::calcColor(Scene &scene, Ray &ray, int level) {
 
         // Simulate exit refraction
         glm::vec3 exitPoint = hit.point + 0.01f * refractedRay.direction; // Offset exit point slightly to avoid self-intersection
-        Ray exitRay(exitPoint, refractedRay.direction);
-        exitRay.objectId = hit.objectId; 
-        glm::vec3 exitColor = calcColor(scene, exitRay, level + 1);
-
-        color += exitColor;  
+        next = Ray(exitPoint, refractedRay.direction);
+        next.objectId = hit.objectId;
+        countSecondaryRay();
+        RENDER_COUNTER(countRefractionRay());
+        return true;
     }
 
+    return false;
+}
+
+glm::vec3 Phong::calcSurfaceColor(Scene &scene, Ray &ray, Intersection &hit) {
+    // Start with emission and ambient components
+    glm::vec3 color = calcEmissionColor(scene) + calcAmbientColor(scene, hit);
+
+    // Add diffuse and specular contributions from all lights
+    for (int i = 0; i < scene.getNumLights(); i++) {
+        LightSource *light = scene.getLight(i);
+
+        bool lit = !occluded(scene, hit, light);
+        if (RayTreeRecording::isActive()) {
+            recordShadowRay(hit, light, i, lit);
+        }
+        if (lit) {
+            glm::vec3 specularColor = calcSpecularColor(scene, hit, light, ray);
+            color += (calcDiffuseColor(scene, hit, light) + specularColor) * light->intensity;
+        }
+    }
     return color;
 }
 
@@ -186,6 +236,17 @@ glm::vec3 Phong::calcDiffuseColor(Scene& scene, Intersection &hit, LightSource*
 }
 
     bool Phong::occluded(Scene &scene, Intersection &hit, LightSource *light) {
+    Ray shadowRay;
+    float lightDistance;
+    if (!buildShadowRay(hit, light, shadowRay, lightDistance)) {
+        RENDER_COUNTER(countConeRejection());
+        return true; // The point is outside the spotlight's cone, so it's occluded
+    }
+
+    return traceShadowRay(scene, shadowRay, lightDistance, light);
+}
+
+bool Phong::buildShadowRay(Intersection &hit, LightSource *light, Ray &shadowRay, float &lightDistance) {
     glm::vec3 lightDir;
 
     // Determine light direction based on light type
@@ -199,7 +260,7 @@ glm::vec3 Phong::calcDiffuseColor(Scene& scene, Intersection &hit, LightSource*
 
         // Check if the hit point is within the cutoff angle of the spotlight
         if (!spotLight->isWithinCutoff(hit.point)) {
-            return true; // The point is outside the spotlight's cone, so it's occluded
+            return false;
         }
     }
 
@@ -207,28 +268,53 @@ glm::vec3 Phong::calcDiffuseColor(Scene& scene, Intersection &hit, LightSource*
     glm::vec3 shadowRayOrigin = hit.point + hit.normal * 1e-4f;
 
     // Create a ray from the intersection point towards the light source
-    Ray shadowRay(shadowRayOrigin, lightDir);
-
-    // Get the intersection from the shadow ray
-    Intersection shadowIntersection = scene.GetHit(shadowRay);
+    shadowRay = Ray(shadowRayOrigin, lightDir);
 
-    // Directional Light: Check only if there's any hit
-    if (light->isDirectional()) {
-        return shadowIntersection.hitObject; // Any hit means the light is occluded
-    }
+    // Directional Light: any hit blocks it
+    lightDistance = std::numeric_limits<float>::infinity();
 
-    // Spotlight: Check if the intersection is closer than the light position
+    // Spotlight: only hits closer than the light position block it
     if (light->isSpotlight()) {
         Spotlight *spotLight = dynamic_cast<Spotlight *>(light);
-        float lightDistance = glm::length(spotLight->position - shadowRayOrigin);
+        lightDistance = glm::length(spotLight->position - shadowRayOrigin);
+    }
+    return true;
+}
 
-        // If there's a hit and it's closer than the light, the light is occluded
-        if (shadowIntersection.hitObject && shadowIntersection.t < lightDistance) {
-            return true; // The point is occluded by another object
-        }
+bool Phong::traceShadowRay(Scene &scene, Ray &shadowRay, float lightDistance, LightSource *light) {
+    return scene.Occluded(shadowRay, lightDistance, &lastOccluder(light));
+}
+
+void Phong::recordShadowRay(Intersection &hit, LightSource *light, int lightIndex, bool lit) {
+    // Built again rather than passed out of occluded, so the normal path stays as it is
+    Ray shadowRay;
+    float lightDistance;
+    if (!buildShadowRay(hit, light, shadowRay, lightDistance)) {
+        RayTreeRecording::recordOutsideCone(lightIndex);
+        return;
     }
+    // A blocked ray leaves its blocker in the occluder cache of the light
+    RayTreeRecording::recordShadowRay(shadowRay, lightDistance, lit ? -1 : lastOccluder(light).object, lightIndex);
+}
 
-    return false; // No occlusion, the light is not blocked
+PrimitiveHit &Phong::lastOccluder(LightSource *light) {
+    // Neighbouring shadow points of a light are usually blocked by the same object,
+    // so every thread remembers the last blocker it found for each light
+    struct CacheEntry {
+        const LightSource *light;
+        PrimitiveHit occluder;
+    };
+    static thread_local std::vector<CacheEntry> cache;
+
+    for (CacheEntry &entry : cache) {
+        if (entry.light == light)
+            return entry.occluder;
+    }
+    // Lights of scenes that are gone are never looked up again
+    if (cache.size() >= 64)
+        cache.clear();
+    cache.push_back({light, {0.0f, PRIMITIVE_NONE, -1, -1}});
+    return cache.back().occluder;
 }
 
 
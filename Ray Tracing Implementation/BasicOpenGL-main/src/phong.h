@@ -8,6 +8,9 @@
 class Phong
 {
 public:
+    static const int DEFAULT_MAX_DEPTH = 5; // reflection/refraction bounces before a path turns black
+    static const int BOUNCE_STACK_SIZE = 8; // every surface continues at most one path
+
     // phong model
     static glm::vec3 calcAmbientColor(Scene &scene, Intersection &hit);
     static glm::vec3 calcEmissionColor(Scene &scene);
@@ -15,9 +18,18 @@ public:
     static glm::vec3 calcSpecularColor(Scene &scene, Intersection &hit, LightSource *light ,Ray& ray);
     static bool occluded(Scene &scene, Intersection &hit, LightSource *light) ; 
 
+    // occluded in two steps, for callers that batch the shadow rays.
+    // buildShadowRay returns false if the light cannot reach the point at all
+    // (outside a spotlight cone); the light is blocked if traceShadowRay is true.
+    static bool buildShadowRay(Intersection &hit, LightSource *light, Ray &shadowRay, float &lightDistance);
+    static bool traceShadowRay(Scene &scene, Ray &shadowRay, float lightDistance, LightSource *light);
+
 
     // other static functions
-    static glm::vec3 calcColor(Scene &scene, Ray &ray , int level );
+    static glm::vec3 calcColor(Scene &scene, Ray &ray , int level, int maxDepth = DEFAULT_MAX_DEPTH);
+    static glm::vec3 shadeHit(Scene &scene, Ray &ray, Intersection &hit, int level, int maxDepth = DEFAULT_MAX_DEPTH); // calcColor for a hit that is already known
+    static glm::vec3 calcSurfaceColor(Scene &scene, Ray &ray, Intersection &hit); // emission, ambient and all lights
+    static bool continuePath(Ray &ray, Intersection &hit, Ray &next); // reflected/refracted ray, false for regular surfaces
     static glm::vec3 checkerboardColor(glm::vec3 rgbColor, glm ::vec3 hitPoint);
     static Ray  ConstructOutRay (Ray &ray, glm::vec3  normal, glm::vec3 hitPoint) ;
     static Ray calcTransparencyRay(const Ray &ray, const glm::vec3 &normal, const glm::vec3 &hitPosition);
@@ -26,6 +38,10 @@ public:
 
 
 private:
+    template <typename PushFn>
+    static void addBounce(Scene &scene, Ray &ray, Intersection &hit, const glm::vec3 &weight, int level, int maxDepth, glm::vec3 &color, PushFn &&push);
+    static PrimitiveHit &lastOccluder(LightSource *light); // per-thread occluder cache of a light
+    static void recordShadowRay(Intersection &hit, LightSource *light, int lightIndex, bool lit); // for RayTreeRecording
 
 };
 
@@ -0,0 +1,101 @@
+#ifndef RENDER_PROTOCOL_H
+#define RENDER_PROTOCOL_H
+
+// Protocol between render_daemon and its clients (Linux, UNIX domain socket).
+//
+// Requests are single text lines, answered by a single line:
+//
+//   render scene=PATH shm=NAME [width=N] [height=N] [samples=N] [depth=N] [seed=N]
+//          [sampler=NAME] [adaptive=scene|on|off] [eye=x,y,z]
+//   render text=BYTES [dir=DIR] shm=NAME ...   the scene text follows the line (BYTES bytes)
+//       => ok width=W height=H cached=0|1 load=SECONDS render=SECONDS rays=N
+//   stats
+//       => ok scenes=N hits=N misses=N
+//   shutdown
+//       => ok
+//
+// Values are percent-encoded (encodeProtocolValue), so paths may hold spaces.
+// Failures answer "error MESSAGE". A request line longer than MAX_REQUEST_LINE
+// or scene text longer than MAX_SCENE_TEXT is answered with an error, and the
+// daemon closes the connection without reading the rest. The client creates the shared memory
+// object NAME (shm_open) with at least sharedFramebufferSize bytes; the daemon
+// writes a SharedFramebufferHeader and the 8-bit RGB image (rows top to bottom)
+// into it before it answers.
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+static const char *const DEFAULT_RENDER_SOCKET = "/tmp/raytracer.sock";
+static const size_t MAX_REQUEST_LINE = 64 * 1024;       // bytes, without the newline
+static const size_t MAX_SCENE_TEXT = 256 * 1024 * 1024; // bytes of render text=BYTES
+
+struct SharedFramebufferHeader
+{
+    char magic[4]; // "RTFB"
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+};
+
+// Pixels start on the cache line after the header
+static const size_t SHARED_FRAMEBUFFER_PIXELS = 64;
+
+inline size_t sharedFramebufferSize(int width, int height)
+{
+    return SHARED_FRAMEBUFFER_PIXELS + static_cast<size_t>(width) * height * 3;
+}
+
+// '%', '=', control characters and spaces become %XX
+inline std::string encodeProtocolValue(const std::string &value)
+{
+    static const char *const digits = "0123456789ABCDEF";
+    std::string encoded;
+    for (unsigned char c : value)
+    {
+        if (c <= ' ' || c == '%' || c == '=' || c == 127)
+        {
+            encoded += '%';
+            encoded += digits[c >> 4];
+            encoded += digits[c & 15];
+        }
+        else
+            encoded += static_cast<char>(c);
+    }
+    return encoded;
+}
+
+inline int protocolHexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// Throws std::invalid_argument unless every '%' is followed by two hex digits
+inline std::string decodeProtocolValue(const std::string &value)
+{
+    std::string decoded;
+    for (size_t i = 0; i < value.size(); i++)
+    {
+        if (value[i] != '%')
+        {
+            decoded += value[i];
+            continue;
+        }
+        int high = i + 1 < value.size() ? protocolHexDigit(value[i + 1]) : -1;
+        int low = i + 2 < value.size() ? protocolHexDigit(value[i + 2]) : -1;
+        if (high < 0 || low < 0)
+            throw std::invalid_argument("bad %XX escape in " + value);
+        decoded += static_cast<char>(16 * high + low);
+        i += 2;
+    }
+    return decoded;
+}
+
+#endif // RENDER_PROTOCOL_H
@@ -0,0 +1,125 @@
+// Headless batch renderer: renders many scenes on one shared thread pool, a
+// few jobs at a time, and reports the wall time and ray rate of every job.
+// Needs neither a display nor OpenGL (make batch).
+//
+// Usage: render_batch [options] scene.txt ...
+//        render_batch [options] --manifest jobs.txt
+//
+//   --manifest FILE      job list, see readManifest in BatchRenderer.h
+//   --output-dir DIR     where jobs without an image name write <scene>.png, or
+//                        <scene>-2.png etc. for a scene rendered more than once (default .)
+//   --jobs N             jobs rendered at the same time (default 2)
+//   --threads N          pool workers (default one per hardware thread)
+//   --width N --height N --samples N --max-depth N --seed N
+//   --sampler random|stratified|sobol|r2 --adaptive scene|on|off
+//                        defaults for every job, a manifest line may override them
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BatchRenderer.h"
+
+static void printUsage()
+{
+    std::cerr << "Usage: render_batch [--manifest jobs.txt] [--output-dir DIR] [--jobs N] [--threads N]" << std::endl
+              << "                    [--width N] [--height N] [--samples N] [--max-depth N] [--seed N]" << std::endl
+              << "                    [--sampler NAME] [--adaptive scene|on|off] [scene.txt ...]" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    RenderJob defaults;
+    defaults.settings.width = 800;
+    defaults.settings.height = 800;
+    std::string manifest;
+    std::string outputDirectory = ".";
+    int concurrentJobs = 2;
+    int numThreads = 0;
+    std::vector<std::string> scenes;
+
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "--manifest" && hasValue)
+                manifest = argv[++i];
+            else if (arg == "--output-dir" && hasValue)
+                outputDirectory = argv[++i];
+            else if (arg == "--jobs" && hasValue)
+                concurrentJobs = std::stoi(argv[++i]);
+            else if (arg == "--threads" && hasValue)
+                numThreads = std::stoi(argv[++i]);
+            else if (arg == "--max-depth" && hasValue)
+                setJobOption(defaults, "depth", argv[++i]);
+            else if (arg.compare(0, 2, "--") == 0 && hasValue && setJobOption(defaults, arg.substr(2), argv[i + 1]))
+                i++;
+            else if (arg.compare(0, 2, "--") == 0)
+            {
+                printUsage();
+                return 2;
+            }
+            else
+                scenes.push_back(arg);
+        }
+
+        std::vector<RenderJob> jobs;
+        if (!manifest.empty())
+            jobs = readManifest(manifest, defaults, outputDirectory);
+        for (const std::string &scene : scenes)
+        {
+            RenderJob job = defaults;
+            job.sceneFile = scene;
+            jobs.push_back(job);
+        }
+        assignImageFiles(jobs, outputDirectory);
+        if (jobs.empty())
+        {
+            printUsage();
+            return 2;
+        }
+
+        ThreadPool pool(numThreads);
+        BatchRenderer batch(pool, concurrentJobs);
+        std::cout << jobs.size() << " jobs, " << concurrentJobs << " at a time on " << pool.size() << " threads" << std::endl;
+
+        std::mutex outputMutex;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<RenderJobResult> results = batch.run(jobs, [&](int index, const RenderJobResult &result)
+                                                         {
+            const RenderJob &job = jobs[index];
+            std::lock_guard<std::mutex> lock(outputMutex);
+            if (!result.ok)
+            {
+                std::cerr << job.sceneFile << ": FAILED: " << result.error << std::endl;
+                return;
+            }
+            char line[256];
+            std::snprintf(line, sizeof(line), "%dx%d, %d spp, depth %d: load %.3f s, render %.3f s, wall %.3f s, %.2f Mrays/s",
+                          job.settings.width, job.settings.height, job.settings.samplesPerPixel, job.settings.maxDepth,
+                          result.loadSeconds, result.renderSeconds, result.wallSeconds, result.raysPerSecond() * 1e-6);
+            std::cout << job.sceneFile << " -> " << job.imageFile << ": " << line << std::endl; });
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        int failed = 0;
+        uint64_t rays = 0;
+        for (const RenderJobResult &result : results)
+        {
+            failed += !result.ok;
+            rays += result.rays();
+        }
+        std::printf("%d of %d jobs done in %.3f s, %.2f Mrays/s overall\n", static_cast<int>(results.size()) - failed,
+                    static_cast<int>(results.size()), seconds, seconds > 0.0 ? rays / seconds * 1e-6 : 0.0);
+        return failed > 0 ? 1 : 0;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "render_batch: " << e.what() << std::endl;
+        return 2;
+    }
+}
@@ -0,0 +1,208 @@
+// Client of render_daemon: sends one scene, takes the image out of shared
+// memory and writes it as a PNG.
+//
+// Usage: render_client [--socket PATH] [--inline] scene.txt image.png [key=value ...]
+//        render_client [--socket PATH] --stats | --shutdown
+//
+//   --inline     send the scene text instead of its path (the daemon need not
+//                see the file; meshes are still looked up next to it)
+//   key=value    render options of RenderProtocol.h, e.g. samples=4 eye=0,0,4
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <stb/stb_image_write.h>
+#include "RenderProtocol.h"
+
+static void printUsage()
+{
+    std::cerr << "Usage: render_client [--socket PATH] [--inline] scene.txt image.png [key=value ...]" << std::endl
+              << "       render_client [--socket PATH] --stats | --shutdown" << std::endl;
+}
+
+static int connectTo(const std::string &socketPath)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        return -1;
+    std::strcpy(address.sun_path, socketPath.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool sendAll(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool readReply(int fd, std::string &reply)
+{
+    reply.clear();
+    char c;
+    while (recv(fd, &c, 1, 0) == 1)
+    {
+        if (c == '\n')
+            return true;
+        reply += c;
+    }
+    return false;
+}
+
+// Sends request and prints the reply; 0 if the daemon answered ok
+static int simpleRequest(int fd, const std::string &request)
+{
+    std::string reply;
+    if (!sendAll(fd, request + "\n") || !readReply(fd, reply))
+    {
+        std::cerr << "No answer from the daemon" << std::endl;
+        return 1;
+    }
+    std::cout << reply << std::endl;
+    return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string socketPath = DEFAULT_RENDER_SOCKET;
+    std::string command;
+    bool sendText = false;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc)
+            socketPath = argv[++i];
+        else if (arg == "--inline")
+            sendText = true;
+        else if (arg == "--stats" || arg == "--shutdown")
+            command = arg.substr(2);
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            printUsage();
+            return 2;
+        }
+        else
+            positional.push_back(arg);
+    }
+    if (command.empty() && positional.size() < 2)
+    {
+        printUsage();
+        return 2;
+    }
+
+    int fd = connectTo(socketPath);
+    if (fd < 0)
+    {
+        std::cerr << "Cannot connect to " << socketPath << ": is render_daemon running?" << std::endl;
+        return 1;
+    }
+    if (!command.empty())
+    {
+        int status = simpleRequest(fd, command);
+        close(fd);
+        return status;
+    }
+
+    std::string sceneFile = std::filesystem::absolute(positional[0]).string();
+    std::string imageFile = positional[1];
+    int width = 800, height = 800;
+    std::string options;
+    for (size_t i = 2; i < positional.size(); i++)
+    {
+        if (positional[i].compare(0, 6, "width=") == 0)
+            width = std::stoi(positional[i].substr(6));
+        else if (positional[i].compare(0, 7, "height=") == 0)
+            height = std::stoi(positional[i].substr(7));
+        options += " " + positional[i];
+    }
+
+    // The image comes back in a shared memory object of our own
+    std::string shmName = "/raytracer-" + std::to_string(getpid());
+    size_t size = sharedFramebufferSize(width, height);
+    int shm = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (shm < 0 || ftruncate(shm, static_cast<off_t>(size)) != 0)
+    {
+        std::cerr << "Cannot create shared memory " << shmName << ": " << std::strerror(errno) << std::endl;
+        if (shm >= 0)
+            shm_unlink(shmName.c_str());
+        return 1;
+    }
+
+    std::string request = "render";
+    std::string text;
+    if (sendText)
+    {
+        std::ifstream file(sceneFile, std::ios::binary);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        text = buffer.str();
+        if (text.size() > MAX_SCENE_TEXT)
+        {
+            std::cerr << sceneFile << " is larger than the " << MAX_SCENE_TEXT << " bytes the daemon takes inline" << std::endl;
+            close(fd);
+            shm_unlink(shmName.c_str());
+            return 1;
+        }
+        request += " text=" + std::to_string(text.size()) +
+                   " dir=" + encodeProtocolValue(std::filesystem::path(sceneFile).parent_path().string());
+    }
+    else
+        request += " scene=" + encodeProtocolValue(sceneFile);
+    request += " shm=" + shmName + options + "\n";
+
+    std::string reply;
+    bool answered = sendAll(fd, request + text) && readReply(fd, reply);
+    close(fd);
+    int status = 1;
+    if (!answered)
+        std::cerr << "No answer from the daemon" << std::endl;
+    else if (reply.compare(0, 2, "ok") != 0)
+        std::cerr << reply << std::endl;
+    else
+    {
+        void *memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, shm, 0);
+        const SharedFramebufferHeader *header = static_cast<const SharedFramebufferHeader *>(memory);
+        if (memory == MAP_FAILED || std::memcmp(header->magic, "RTFB", 4) != 0)
+            std::cerr << "No image in shared memory " << shmName << std::endl;
+        else if (!stbi_write_png(imageFile.c_str(), header->width, header->height, header->channels,
+                                 static_cast<const char *>(memory) + SHARED_FRAMEBUFFER_PIXELS, header->width * header->channels))
+            std::cerr << "Failed to save " << imageFile << std::endl;
+        else
+        {
+            std::cout << reply << std::endl;
+            status = 0;
+        }
+        if (memory != MAP_FAILED)
+            munmap(memory, size);
+    }
+    close(shm);
+    shm_unlink(shmName.c_str());
+    return status;
+}
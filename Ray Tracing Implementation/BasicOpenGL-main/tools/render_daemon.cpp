@@ -0,0 +1,401 @@
+// Persistent render service (Linux). Listens on a UNIX domain socket, keeps
+// parsed and compiled scenes in a SceneCache keyed by their content, and
+// writes the images into shared memory framebuffers of the clients. A
+// repeated scene, even with another eye, size or sample count, goes straight
+// to tracing. See RenderProtocol.h for the requests and render_client.cpp for
+// a client.
+//
+// Usage: render_daemon [--socket PATH] [--threads N] [--cache N]
+//
+// Every connection is served by a thread of its own; all renders share one
+// thread pool. Renders of the same cached scene take turns, since a request
+// may move its eye. On shutdown the daemon waits for the renders in flight.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <list>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "BatchRenderer.h"
+#include "RenderProtocol.h"
+#include "SceneCache.h"
+
+static std::atomic<bool> stopping{false};
+static int listenSocket = -1;
+
+// A request the connection cannot recover from: answered with an error, then
+// the connection is closed instead of reading what the client still sends
+class ConnectionError : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+static void stopDaemon(int)
+{
+    stopping.store(true);
+    // Wakes up accept; shutdown is async-signal-safe
+    if (listenSocket >= 0)
+        shutdown(listenSocket, SHUT_RDWR);
+}
+
+// Buffered reads of request lines and the scene text that may follow them
+class SocketReader
+{
+public:
+    explicit SocketReader(int fd) : fd(fd) {}
+
+    // False at the end of the connection
+    bool readLine(std::string &line)
+    {
+        size_t newline;
+        while ((newline = buffer.find('\n')) == std::string::npos)
+        {
+            if (buffer.size() > MAX_REQUEST_LINE)
+                throw ConnectionError("request line longer than " + std::to_string(MAX_REQUEST_LINE) + " bytes");
+            if (!fill())
+                return false;
+        }
+        if (newline > MAX_REQUEST_LINE)
+            throw ConnectionError("request line longer than " + std::to_string(MAX_REQUEST_LINE) + " bytes");
+        line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        return true;
+    }
+
+    std::string readBytes(size_t count)
+    {
+        while (buffer.size() < count)
+        {
+            if (!fill())
+                throw ConnectionError("connection closed in the middle of the scene text");
+        }
+        std::string bytes = buffer.substr(0, count);
+        buffer.erase(0, count);
+        return bytes;
+    }
+
+private:
+    int fd;
+    std::string buffer;
+
+    bool fill()
+    {
+        char chunk[65536];
+        ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        if (received <= 0)
+            return false;
+        buffer.append(chunk, static_cast<size_t>(received));
+        return true;
+    }
+};
+
+static bool writeAll(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static void writeSharedFramebuffer(const std::string &name, const Framebuffer &image)
+{
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        throw std::runtime_error("cannot open shared memory " + name + ": " + std::strerror(errno));
+
+    struct stat info;
+    size_t size = sharedFramebufferSize(image.getWidth(), image.getHeight());
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < size)
+    {
+        close(fd);
+        throw std::runtime_error("shared memory " + name + " is smaller than " + std::to_string(size) + " bytes");
+    }
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+        throw std::runtime_error("cannot map shared memory " + name + ": " + std::strerror(errno));
+
+    SharedFramebufferHeader header;
+    std::memcpy(header.magic, "RTFB", 4);
+    header.width = static_cast<uint32_t>(image.getWidth());
+    header.height = static_cast<uint32_t>(image.getHeight());
+    header.channels = Framebuffer::CHANNELS;
+    std::memcpy(memory, &header, sizeof(header));
+    std::memcpy(static_cast<char *>(memory) + SHARED_FRAMEBUFFER_PIXELS, image.pixels(),
+                static_cast<size_t>(image.getRowStride()) * image.getHeight());
+    munmap(memory, size);
+}
+
+static glm::vec3 parseVector(const std::string &value)
+{
+    glm::vec3 v;
+    if (std::sscanf(value.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z) != 3)
+        throw std::invalid_argument("expected x,y,z instead of " + value);
+    return v;
+}
+
+static std::string handleRender(std::istringstream &words, SocketReader &reader, SceneCache &cache, ThreadPool &pool)
+{
+    RenderJob job;
+    std::string sceneFile, directory, shm;
+    long long textBytes = -1;
+    bool moveEye = false;
+    glm::vec3 eye(0.0f);
+
+    // The scene text has to be read off the socket even if the request is
+    // refused, so the first bad option is only thrown after that
+    std::exception_ptr refused;
+    std::string word;
+    while (words >> word)
+    {
+        size_t equals = word.find('=');
+        std::string key = word.substr(0, equals);
+        if (key == "text")
+        {
+            // Without a size the text cannot be skipped, so the connection cannot go on
+            std::string value = word.substr(equals + 1);
+            if (equals == std::string::npos || value.empty() || value.size() > 18 ||
+                value.find_first_not_of("0123456789") != std::string::npos)
+                throw ConnectionError("text=BYTES needs a byte count instead of " + word);
+            textBytes = std::stoll(value);
+            if (static_cast<unsigned long long>(textBytes) > MAX_SCENE_TEXT)
+                throw ConnectionError("scene text longer than " + std::to_string(MAX_SCENE_TEXT) + " bytes");
+            continue;
+        }
+
+        try
+        {
+            std::string value = equals == std::string::npos ? "" : decodeProtocolValue(word.substr(equals + 1));
+            if (key == "scene")
+                sceneFile = value;
+            else if (key == "dir")
+                directory = value;
+            else if (key == "shm")
+                shm = value;
+            else if (key == "eye")
+            {
+                eye = parseVector(value);
+                moveEye = true;
+            }
+            else if (equals == std::string::npos || !setJobOption(job, key, value))
+                throw std::invalid_argument("unknown option " + word);
+        }
+        catch (const std::exception &)
+        {
+            if (!refused)
+                refused = std::current_exception();
+        }
+    }
+
+    std::string text;
+    if (textBytes >= 0)
+        text = reader.readBytes(static_cast<size_t>(textBytes));
+    if (refused)
+        std::rethrow_exception(refused);
+    if (shm.empty())
+        throw std::invalid_argument("shm=NAME is missing");
+    if (sceneFile.empty() == (textBytes < 0))
+        throw std::invalid_argument("give either scene=PATH or text=BYTES");
+
+    auto start = std::chrono::steady_clock::now();
+    bool cached = false;
+    std::shared_ptr<SceneCache::Entry> entry = textBytes >= 0 ? cache.loadText(text, directory, &pool, cached)
+                                                              : cache.load(sceneFile, &pool, cached);
+    RenderJobResult result;
+    result.loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Framebuffer image;
+    {
+        std::lock_guard<std::mutex> lock(entry->renderMutex);
+        Scene &scene = *entry->scene;
+        Eye sceneEye = scene.eye;
+        if (moveEye)
+            scene.eye.position = eye;
+        try
+        {
+            BatchRenderer::renderScene(job, scene, pool, image, result);
+        }
+        catch (...)
+        {
+            scene.eye = sceneEye;
+            throw;
+        }
+        scene.eye = sceneEye;
+    }
+    writeSharedFramebuffer(shm, image);
+
+    char reply[256];
+    std::snprintf(reply, sizeof(reply), "ok width=%d height=%d cached=%d load=%.6f render=%.6f rays=%llu",
+                  image.getWidth(), image.getHeight(), cached ? 1 : 0, result.loadSeconds, result.renderSeconds,
+                  static_cast<unsigned long long>(result.rays()));
+    return reply;
+}
+
+// An accepted client and the thread serving it
+struct Connection
+{
+    int fd = -1;
+    std::thread thread;
+    std::atomic<bool> finished{false};
+};
+
+static void serveConnection(Connection &connection, SceneCache &cache, ThreadPool &pool)
+{
+    int fd = connection.fd;
+    SocketReader reader(fd);
+    std::string line;
+    while (true)
+    {
+        std::string command;
+        std::string reply;
+        bool closing = false;
+        try
+        {
+            if (!reader.readLine(line))
+                break;
+            std::istringstream words(line);
+            words >> command;
+
+            if (command == "render")
+                reply = handleRender(words, reader, cache, pool);
+            else if (command == "stats")
+                reply = "ok scenes=" + std::to_string(cache.size()) + " hits=" + std::to_string(cache.hits()) +
+                        " misses=" + std::to_string(cache.misses());
+            else if (command == "shutdown")
+                reply = "ok";
+            else
+                reply = "error unknown command " + command;
+        }
+        catch (const ConnectionError &e)
+        {
+            reply = std::string("error ") + e.what();
+            closing = true;
+        }
+        catch (const std::exception &e)
+        {
+            reply = std::string("error ") + e.what();
+        }
+
+        if (!writeAll(fd, reply + "\n") || closing)
+            break;
+        if (command == "shutdown")
+        {
+            stopDaemon(0);
+            break;
+        }
+    }
+    // The client sees the end of the connection now; main closes fd after the
+    // join, so its number is not reused while main may still shut it down
+    shutdown(fd, SHUT_RDWR);
+    connection.finished.store(true);
+}
+
+// Joins the threads of the connections and closes them, only the finished ones
+// unless all is set
+static void closeConnections(std::list<Connection> &connections, bool all)
+{
+    for (auto it = connections.begin(); it != connections.end();)
+    {
+        if (!all && !it->finished.load())
+        {
+            ++it;
+            continue;
+        }
+        it->thread.join();
+        close(it->fd);
+        it = connections.erase(it);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string socketPath = DEFAULT_RENDER_SOCKET;
+    int numThreads = 0;
+    size_t cacheSize = 8;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc)
+            socketPath = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc)
+            numThreads = std::stoi(argv[++i]);
+        else if (arg == "--cache" && i + 1 < argc)
+            cacheSize = static_cast<size_t>(std::stoul(argv[++i]));
+        else
+        {
+            std::cerr << "Usage: render_daemon [--socket PATH] [--threads N] [--cache N]" << std::endl;
+            return 2;
+        }
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Socket path " << socketPath << " is too long" << std::endl;
+        return 1;
+    }
+    std::strcpy(address.sun_path, socketPath.c_str());
+
+    listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str()); // left over from a daemon that was killed
+    if (listenSocket < 0 || bind(listenSocket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listenSocket, 16) != 0)
+    {
+        std::cerr << "Cannot listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    std::signal(SIGINT, stopDaemon);
+    std::signal(SIGTERM, stopDaemon);
+
+    ThreadPool pool(numThreads);
+    SceneCache cache(cacheSize);
+    std::cout << "Listening on " << socketPath << " with " << pool.size() << " threads, caching " << cacheSize << " scenes" << std::endl;
+
+    std::list<Connection> connections;
+    while (!stopping.load())
+    {
+        int client = accept(listenSocket, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        closeConnections(connections, false);
+        connections.emplace_back();
+        Connection &connection = connections.back();
+        connection.fd = client;
+        connection.thread = std::thread(serveConnection, std::ref(connection), std::ref(cache), std::ref(pool));
+    }
+
+    // The connection threads use cache and pool, so they end before them. Idle
+    // connections are woken up; renders in flight finish and answer.
+    for (Connection &connection : connections)
+        shutdown(connection.fd, SHUT_RD);
+    closeConnections(connections, true);
+    close(listenSocket);
+    unlink(socketPath.c_str());
+    std::cout << "Stopped" << std::endl;
+    return 0;
+}